@@ -17,13 +17,8 @@
 #define STOP 0x20;
 ///////////////////////////////////
 
-/* Define register access */
-#define RM_RDWR     (int(*)(BYTE, enum DEV_EM_IO))(-1)
-#define RM_RDONLY   (int(*)(BYTE, enum DEV_EM_IO))(-2)
-#define RM_USERP    (int(*)(BYTE, enum DEV_EM_IO))(-3)
-
-/* Register memory */
-struct reg_mem_el reg_mem[RM_SIZE];
+/* Machine run by this thread */
+THREAD_LOCAL struct machine *z8;
 
 void reg_mem_init()
 {
@@ -32,77 +27,152 @@ int i;
 
 /* Assume everything is RDWR - contents is unknown */
 for(i=0; i<RM_SIZE; i++)
-     reg_mem[i] . option = RM_RDWR;
+     z8->reg_attr[i] = RA_RDWR;
 
 /* 80..DF - not supported - make RD only and contents 0xFF */
 for(i=0x80; i<0xE0; i++)
 {
-     reg_mem[i] . content = 0xFF;
-     reg_mem[i] . option = RM_RDONLY;
+     reg_mem[i] = 0xFF;
+     z8->reg_attr[i] = RA_RDONLY;
 }
 
 /* E0..EF - special code to indicate RP shift and prefix */
 for(i=0xE0; i<0xF0; i++)
-     reg_mem[i] . option = RM_USERP;
+     z8->reg_attr[i] = RA_USERP;
+
+/* no devices */
+z8->reg_nhooks = 0;
+work_sync();
+}
+
+void work_sync()
+{
+/* RP or register attributes have changed - find the working registers 
+   again. WORK_RD()/WORK_WR() go straight to the bank unless a register 
+   in it is read only, a device or E0..EF, or the bank is F0..FF (FLAGS 
+   and RP itself) 
+*/
+int i;
+
+z8->work_blk = reg_mem[RP] << 4;
+z8->work_reg = (z8->work_blk == 0xF0) ? NULL : &reg_mem[z8->work_blk];
+for (i=0; i<16; i++)
+     if (z8->reg_attr[z8->work_blk|i] != RA_RDWR)
+          z8->work_reg = NULL;
+
+}
+
+#ifdef LAZY_FLAGS
+/* Lazy flags
+   adder(), subber() and the logic instructions record the operation, the
+   destination value and the result instead of writing FLAGS six (or three) 
+   times. flags_sync() brings FLAGS up to date the first time it is read: 
+   read_rm(FLAGS), the FLAG_x() updates of other instructions (which keep 
+   the bits they do not set) and disp_reg_mem(). Any other write to FLAGS
+   discards the pending record.
+   carry and half_carry are still set immediately - ADC, SBC, RLC, DA etc.
+   use them directly */
+void flags_sync()
+{
+BYTE f;
+BYTE s;
+
+if (z8->lazy_op == LAZY_NONE)
+	return;
+f = reg_mem[FLAGS];
+s = SIGN(z8->lazy_ans);
+switch (z8->lazy_op)
+{
+case LAZY_ADD:
+	f = (f & 0x03) | (CARRY(z8->lazy_temp)>>8)<<7 | ZERO(z8->lazy_ans)<<6 | s>>2 
+	  | (SIGN(z8->lazy_a1) != s)<<4 | (HALF_CARRY(z8->lazy_ans)!=HALF_CARRY(z8->lazy_a1))<<2;
+	break;
+case LAZY_SUB:
+	f = (f & 0x03) | (!(CARRY(z8->lazy_temp)>>8))<<7 | ZERO(z8->lazy_ans)<<6 | s>>2 
+	  | (SIGN(z8->lazy_a1) != s)<<4 | 0x01<<3 | (!(HALF_CARRY(z8->lazy_ans)!=HALF_CARRY(z8->lazy_a1)))<<2;
+	break;
+case LAZY_LOGIC: /* Z, S set and V cleared */
+	f = (f & 0x8F) | ZERO(z8->lazy_ans)<<6 | s>>2;
+	break;
+}
+reg_mem[FLAGS] = f;
+z8->lazy_op = LAZY_NONE;
+}
 
+/* Z, S and V of a logic instruction with result ans */
+void flags_logic(BYTE ans)
+{
+if (z8->lazy_op != LAZY_LOGIC)
+	flags_sync(); /* keep C, D and H of an earlier add/subtract */
+z8->lazy_op = LAZY_LOGIC;
+z8->lazy_ans = ans;
 }
+#else
+void flags_sync()
+{
+}
+#endif
 
 BYTE read_rm(BYTE reg_no)
 {
-/* Read specified byte and return value (RM_RDWR or RM_RDONLY)
-   Extract working register and prefix RP (RM_USERP)
-   Read byte and call device emulator function (none of the above)
-   NOTE: RP must not equal 0x0E
+/* Read specified byte and return value (RA_RDWR or RA_RDONLY)
+   Extract working register and prefix RP (RA_USERP)
+   Read byte and call device emulator function (RA_DEVICE + hook)
+   NOTE: RP must not equal 0x0E - if it does E0..EF act as plain registers
 */
+BYTE attr = z8->reg_attr[reg_no];
 
-if (reg_mem[reg_no] . option == RM_USERP)
-     reg_no = (reg_mem[RP] . content << 4) | (reg_no - 0xE0);
-     
-/* option requires a cast to an int because switch doesn't support pointers */
-switch((int) reg_mem[reg_no].option)
+if (attr == RA_USERP)
 {
-case (int) RM_RDWR:
-case (int) RM_RDONLY:
-     return reg_mem[reg_no] . content;
+     reg_no = (reg_mem[RP] << 4) | (reg_no - 0xE0);
+     attr = z8->reg_attr[reg_no];
+}
+     
+#ifdef LAZY_FLAGS
+if (reg_no == FLAGS)
+     flags_sync();
+#endif
 
-default:
-     /* Call device emulator: option(reg_no, REG_RD)
+if (attr >= RA_DEVICE)
+     /* Call device emulator: hook(reg_no, REG_RD)
         Device can update register contents
         Return device contents (after update)
      */
-     reg_mem[reg_no] . option(reg_no, REG_RD);
-     return reg_mem[reg_no] . content;
-}
+     z8->reg_hook[attr - RA_DEVICE](reg_no, REG_RD);
+return reg_mem[reg_no];
 }
 
 void write_rm(BYTE reg_no, BYTE value)
 {
-/* Write value to register (RM_RDWR)
-   Do nothing (RM_RDONLY)
-   Extract working register and prefix RP then write value (RM_USERP)
-   Write value and call device emulator function (none of the above)
+/* Write value to register (RA_RDWR)
+   Do nothing (RA_RDONLY)
+   Extract working register and prefix RP then write value (RA_USERP)
+   Write value and call device emulator function (RA_DEVICE + hook)
 */
-if (reg_mem[reg_no] . option == RM_USERP)
-     /* E0..EF correct to RP | regno */
-     reg_no = (reg_mem[RP] . content << 4) | (reg_no - 0xE0);
+BYTE attr = z8->reg_attr[reg_no];
 
-switch((int)reg_mem[reg_no] . option)
+if (attr == RA_USERP)
 {
-case (int)RM_RDWR:
-     reg_mem[reg_no] . content = value;
-     break;
+     /* E0..EF correct to RP | regno */
+     reg_no = (reg_mem[RP] << 4) | (reg_no - 0xE0);
+     attr = z8->reg_attr[reg_no];
+}
 
-case (int)RM_RDONLY:
-     break;
+#ifdef LAZY_FLAGS
+if (reg_no == FLAGS)
+     z8->lazy_op = LAZY_NONE; /* new value replaces any pending flags */
+#endif
 
-default:
-     /* Call device emulator: option(reg_no, REG_WR)
+if (attr == RA_RDONLY)
+     return;
+reg_mem[reg_no] = value;
+if (reg_no == RP)
+     work_sync();
+if (attr >= RA_DEVICE)
+     /* Call device emulator: hook(reg_no, REG_WR)
         Device can access register contents
      */
-     reg_mem[reg_no] . content = value;
-     reg_mem[reg_no] . option(reg_no, REG_WR);
-}
-
+     z8->reg_hook[attr - RA_DEVICE](reg_no, REG_WR);
 }
 
 void reg_mem_device_init(BYTE reg_no, 
@@ -110,17 +180,28 @@ void reg_mem_device_init(BYTE reg_no,
                          BYTE value)
 {
 /* Initialize register memory associated with an external device to 
-   initial value (contents) and option (dev_emulator)
+   initial value (contents) and device hook (dev_emulator) - registers 
+   of one device share its hook
 */
-reg_mem[reg_no] . content = value;
-reg_mem[reg_no] . option = dev_emulator;
+int h;
+
+for (h=0; h<z8->reg_nhooks && z8->reg_hook[h] != dev_emulator; h++)
+     ;
+if (h == z8->reg_nhooks)
+{
+     if (z8->reg_nhooks == RM_HOOKS)
+     {
+          printf("Too many device emulators\n");
+          exit(0);
+     }
+     z8->reg_hook[z8->reg_nhooks++] = dev_emulator;
+}
+reg_mem[reg_no] = value;
+z8->reg_attr[reg_no] = RA_DEVICE + h;
+work_sync();
 }
 /************************REGISTER MEMORY **********************/
 
-PRIVATE WORD tdc;       /* Timer delay count */
-PRIVATE BYTE treload;   /* Timer reload? T|F */
-PRIVATE BYTE trunning;  /* Timer running? T|F */
-
 int TIMER_device(BYTE reg_no, enum DEV_EM_IO cmd)
 {
 /* Emulate timer device port:
@@ -135,20 +216,20 @@ if (cmd == REG_RD)
      return;
 
 /* Write to port -- check port value */
-if (reg_mem[PORT0] . content == 0)
+if (reg_mem[PORT0] == 0)
      /* Timer off */
      trunning = FALSE;
 else
 {
      /* Non-zero write - extract tdc and treload */
-     tdc = (reg_mem[PORT0] . content & 0x7F) << 1;
-     treload = (reg_mem[PORT0] . content & 0x80) == 0x80;
+     tdc = (reg_mem[PORT0] & 0x7F) << 1;
+     treload = (reg_mem[PORT0] & 0x80) == 0x80;
      trunning = TRUE;
 }
 
 #ifdef DIAGNOSTIC
 printf("tdc: %x treload: %x trunning: %x\n", tdc, treload, trunning);
-printf("Port[0]: %02x\n", reg_mem[PORT0] . content);
+printf("Port[0]: %02x\n", reg_mem[PORT0]);
 #endif
 }
 
@@ -172,9 +253,9 @@ printf("TIMER COUNT IS %x \n", tdc);
 #endif
 if (tdc == 0)
 {
-     reg_mem[IRQ] . content |= IRQ0;  /* Signal IRQ0 - timer interrupt */
+     reg_mem[IRQ] |= IRQ0;  /* Signal IRQ0 - timer interrupt */
      if (treload)
-          tdc = (reg_mem[PORT0] . content & 0x7F) << 1;
+          tdc = (reg_mem[PORT0] & 0x7F) << 1;
      else
           trunning = FALSE;
 }
@@ -190,24 +271,154 @@ if (tdc == 0)
 /* Author : Ugochukwu Chukwu				student Number: B00556842 */
 
 
-/* Memory arrays */
-BYTE memory[2][PD_MEMSZ];        /* PROG and DATA */
+/* Machines
+   - memory, registers and the rest of the state of one Z8 (see Z8_IE.h)
+*/
+struct machine *machine_new()
+{
+/* Allocate a machine in its reset state and make it the machine of the 
+   calling thread */
+struct machine *m;
+
+if ((m = calloc(1, sizeof(struct machine))) == NULL)
+{
+     printf("No memory for a machine\n");
+     exit(0);
+}
+z8 = m;
+if (!sparse_memory && (memory = calloc(2, PD_MEMSZ)) == NULL)
+{
+     printf("No memory for a machine\n");
+     exit(0);
+}
+mem_map_init();
+#ifdef IMAGE_FILES
+if ((mem_image[PROG] && !mem_map_file(PROG, mem_image[PROG], image_private))
+    || (mem_image[DATA] && !mem_map_file(DATA, mem_image[DATA], image_private)))
+     exit(0);
+#endif
+reg_mem_init();
+cache_mem_init();
+return m;
+}
+
+void machine_free(struct machine *m)
+{
+/* Release machine m - the thread has no machine if m was its own */
+struct machine *cur = z8;
+int mem, page;
+
+z8 = m;
+cache_flush(); /* stores still in write back caches */
+for (mem=PROG; mem<=DATA; mem++)
+     for (page=0; page<(PD_MEMSZ>>8); page++)
+          free(z8->mem_map[mem][page].own);
+free(memory);
+free(z8->block_cache);
+cache_free();
+#ifdef JIT_DISPATCH
+if (z8->jit_buf)
+     munmap(z8->jit_buf, JIT_BUF_SIZE);
+#endif
+#ifdef IMAGE_FILES
+if (z8->mem_file[PROG])
+     munmap(z8->mem_file[PROG], z8->mem_file_len[PROG]);
+if (z8->mem_file[DATA])
+     munmap(z8->mem_file[DATA], z8->mem_file_len[DATA]);
+#endif
+z8 = (cur == m) ? NULL : cur;
+free(m);
+}
+
+/* Snapshots
+   - a snapshot holds program and data memory plus the block of machine 
+     state from reg_mem to sanity (registers, PC, clock, flags, timer 
+     and IF sequence) and the cache lines and contents
+   - bus() marks each 256 byte page it writes in page_dirty[]. While the 
+     machine's last snapshot (snap_base) is still the one at hand, taking
+     or restoring it copies only the dirty pages; anything else copies 
+     the whole of memory
+   - the predecoded blocks are not saved - blocks on program pages that 
+     are restored are dropped
+*/
+#define STATE_FROM  ((char *) reg_mem - (char *) z8)
+#define STATE_TO    ((char *) &z8->block_cache - (char *) z8)
+
+/* copy the dirty (or all) pages one way or the other */
+void snapshot_pages(struct snapshot *s, int all, int restore)
+{
+int mem, page;
+BYTE *m, *c;
+
+for (mem=PROG; mem<=DATA; mem++)
+     for (page=0; page<(PD_MEMSZ>>8); page++)
+     {
+          if (!all && !z8->page_dirty[mem][page])
+               continue;
+          c = &s->mem[mem][page<<8];
+          if (restore)
+          {
+               /* pages that cannot be written are left alone, sparse 
+                  pages not yet written stay so if the copy is zero */
+               if (z8->mem_map[mem][page].rd == zero_page && memcmp(c, zero_page, 256) == 0)
+                    continue;
+               if ((m = mem_page_host(mem, page)) == NULL)
+                    continue;
+               memcpy(m, c, 256);
+               if (mem == PROG)
+                    block_invalidate_page(page);
+          }
+          else if ((m = z8->mem_map[mem][page].rd) != NULL)
+               memcpy(c, m, 256);
+          else /* device */
+               memset(c, 0xFF, 256);
+     }
+memset(z8->page_dirty, 0, sizeof(z8->page_dirty));
+}
 
+struct snapshot *snapshot_take(struct snapshot *s)
+{
+/* Save the current machine in s (a new snapshot when s is NULL) */
+int all;
 
-/* Hidden registers */
-WORD pc;              /* Program counter */
-WORD sp; 			  /* stack pointer 	 */
-BYTE intr_ena;        /* Interrupt status */
+if (s == NULL)
+{
+     if ((s = calloc(1, sizeof(struct snapshot) + STATE_TO - STATE_FROM 
+                        + cache_state_len())) == NULL)
+     {
+          printf("No memory for a snapshot\n");
+          exit(0);
+     }
+     s->len = STATE_TO - STATE_FROM;
+}
+all = (z8->snap_base != s || z8->snap_gen != s->gen);
+snapshot_pages(s, all, FALSE);
+memcpy(s->state, (char *) z8 + STATE_FROM, s->len);
+cache_state(s->state + s->len, FALSE);
+s->gen++;
+z8->snap_base = s;
+z8->snap_gen = s->gen;
+return s;
+}
 
-unsigned long sys_clock; /* system clock */
+void snapshot_restore(struct snapshot *s)
+{
+/* Put the current machine back to snapshot s */
+snapshot_pages(s, z8->snap_base != s || z8->snap_gen != s->gen, TRUE);
+memcpy((char *) z8 + STATE_FROM, s->state, s->len);
+cache_state(s->state + s->len, TRUE);
+z8->fetch_ops = NULL;
+work_sync();
+z8->snap_base = s;
+z8->snap_gen = s->gen;
+}
 
-/* Flag bits */ 
-BYTE carry;
-BYTE sign;
-BYTE overflow;
-BYTE zero;
-BYTE half_carry;
-BYTE decimal_adjust;
+void snapshot_free(struct snapshot *s)
+{
+if (z8 && z8->snap_base == s)
+     z8->snap_base = NULL;
+free(s);
+}
 
 
 /*
@@ -222,20 +433,23 @@ BYTE decimal_adjust;
 */
 
 
-char srec[LINE_LEN];
-FILE *fp;
-void srec_error(enum SREC_ERRORS serr)
+/* Batch (headless) mode - no keyboard waits, no per cycle displays */
+int batch;
+
+void srec_error(enum SREC_ERRORS serr, char *srec)
 {
-/* Display diagnostic and abort */
+/* Display diagnostic */
 printf("%s: %s\n", srec_diag[serr], srec);
-getchar();
-fclose(fp);
-exit(0);
+if (!batch)
+     getchar();
 }
 
-void loader (int argc, char *argv[])
+int load_srec(char *name)
 {
-	/* Read and process s-records */
+	/* Read and process s-records of file name into the current machine 
+	   Returns FALSE on a missing file or an invalid record */
+char srec[LINE_LEN];
+FILE *fp;
 /* Record access variables */
 unsigned pos;
 unsigned int i;
@@ -244,19 +458,14 @@ int srtype;                   /* byte 1 - 0..9 */
 unsigned int length;          /* byte 2 */
 unsigned int ah, al, address; /* bytes 3 and 4 */
 signed char chksum;           /* checksum tally */
-unsigned char byte;            /* bytes 5 through checksum byte */
+unsigned int byte;             /* bytes 5 through checksum byte - %2x needs an int */
 unsigned char temp[LINE_LEN];	/*temp storage to hold LINE_LEN bytes */
+BYTE *p;                      /* page the byte goes to */
 
-if (argc != 2)
-{
-     printf("Format: parse filename\n");
-     exit(0);
-}
-
-if ((fp = fopen(argv[1], "r")) == NULL)
+if ((fp = fopen(name, "r")) == NULL)
 {
      printf("No file specified\n");
-     exit(0);
+     return FALSE;
 }
 
 while (fgets(srec, LINE_LEN, fp) > 0)
@@ -266,11 +475,19 @@ printf("\nsrec: %s\n", srec);
 #endif
      /* Should check min srec length */
      if (srec[0] != 'S')
-          srec_error(MISSING_S);        
+     {
+          srec_error(MISSING_S, srec);
+          fclose(fp);
+          return FALSE;
+     }
      /* Check srec type */
      srtype = srec[1] - '0';
      if (srtype < 0 || srtype > 9)
-          srec_error(BAD_TYPE);
+     {
+          srec_error(BAD_TYPE, srec);
+          fclose(fp);
+          return FALSE;
+     }
 	 if(srtype == 9) /* S9 recs define the initial value of the program counter */
      {
      	sscanf(&srec[2], "%2x%2x", &ah, &al);
@@ -279,7 +496,8 @@ printf("\nsrec: %s\n", srec);
      }
      else if(srtype ==0) /* name of srec*/
      {
-     	printf("%s \n", srec+3);
+     	if (!batch)
+     		printf("%s \n", srec+3);
      }
 	 else{
             
@@ -327,7 +545,11 @@ printf("\nsrec: %s\n", srec);
 		#endif
 		     /* Valid record? */
 		     if (chksum != -1)
-		          srec_error(CHKSUM_ERR);
+		     {
+		          srec_error(CHKSUM_ERR, srec);
+		          fclose(fp);
+		          return FALSE;
+		     }
 		     else{
 		     	/* Valid record !
 				 write values of temp to memoryory */
@@ -340,7 +562,12 @@ printf("\nsrec: %s\n", srec);
 			     			/* address still holds starting loc for loading 
                              srtype -1 = 0 for PROG memory
                                        = 1 for DATA memory */
-			     			memory[(srtype-1)][address++]= temp[i];
+			     			if (srtype == 1)
+			     				block_invalidate(address);
+			     			z8->page_dirty[srtype-1][MSBY(address)] = TRUE;
+			     			if ((p = mem_page_host(srtype-1, MSBY(address))) != NULL)
+			     				p[LSBY(address)] = temp[i];
+			     			address++;
 			     		}
 			     		#ifdef DEBUG
 			     		if(srtype == 1){
@@ -356,8 +583,9 @@ printf("\nsrec: %s\n", srec);
 			     		{
 			     			/* address still holds starting loc for loading */
 			     			/* reg_memory initiliazer called first */
-			     			 reg_mem[address++].content = temp[i];
+			     			 reg_mem[address++] = temp[i];
 			     		}
+			     		work_sync(); /* RP may have been loaded */
 			    	#ifdef DEBUG 
 			    	printf("Register memory \n");
 			    	#endif
@@ -369,7 +597,7 @@ printf("\nsrec: %s\n", srec);
 			if(srtype==3)
 			{
                 for(i=0; i<length; i++){
-                    printf("contents of memory loc %4x is: %2x \n", address, reg_mem[address].content);
+                    printf("contents of memory loc %4x is: %2x \n", address, reg_mem[address]);
                     address++;
                 }
             }
@@ -390,7 +618,21 @@ printf("pc is %4x \n", pc);
 printf("\n File read and succesfully loaded - no errors detected\n");
 #endif
 fclose(fp);
-getchar();
+return TRUE;
+}
+
+void loader (int argc, char *argv[])
+{
+/* Load the s-record file named on the command line - abort if invalid */
+if (argc != 2)
+{
+     printf("Format: parse filename\n");
+     exit(0);
+}
+if (!load_srec(argv[1]))
+     exit(0);
+if (!batch)
+     getchar();
 }
 
 
@@ -401,13 +643,14 @@ void disp_reg_mem()
 BYTE i;
 BYTE start = START;
 BYTE stop =  STOP;
+flags_sync();
 while(start<stop)
 {
 for (i=start; i<(start+0x10); i++)
 {
 	if (i==start)
 	printf(" \n start: %2x \t", i);
-	printf("%2x ", reg_mem[i].content);
+	printf("%2x ", reg_mem[i]);
 }
 start +=0x10;
 }
@@ -415,14 +658,162 @@ start =0xf0;
 printf("\n start: %2x \t", start);
 while (start<0xff)
 {
-	printf("%2x ", reg_mem[start].content);
+	printf("%2x ", reg_mem[start]);
 	start++;
 }
-printf("%2x", reg_mem[start].content);
+printf("%2x", reg_mem[start]);
 printf("\n");
-getchar();
+if (!batch)
+     getchar();
+}
+
+
+/* Memory map
+   - every 256 byte page of PROG and DATA is RAM, ROM, a hole or a device
+   - RAM and ROM pages point at the page in memory[] and bus() reads (and 
+     for RAM writes) it directly. Writes to ROM are ignored
+   - a hole reads 0xFF (from ff_page) and ignores writes
+   - a device page calls its handler with the address, the value written
+     and RD or WR. Reads return the handler's value
+   - the loader writes s-records to the page's host storage whatever the 
+     map says, so ROM pages are loaded like any other
+   - sparse memory (-S): a machine has no memory[]. RAM and ROM pages read
+     the shared zero_page until something is stored in them, then get a 
+     256 byte page of their own. A machine that touches a few pages costs
+     a few pages, so many thousands fit where a few hundred did
+*/
+BYTE zero_page[256];          /* unwritten sparse pages */
+BYTE ff_page[256];            /* holes - set to 0xFF by main() */
+int sparse_memory;            /* -S */
+
+void mem_map_init()
+{
+/* every page RAM */
+mem_map_pages(PROG, 0x00, 0xFF, PG_RAM, NULL);
+mem_map_pages(DATA, 0x00, 0xFF, PG_RAM, NULL);
+}
+
+void mem_map_pages(enum MEM mem, BYTE first, BYTE last, enum PAGE_TYPE type, 
+                   BYTE (*dev)(WORD, BYTE, enum RDWR))
+{
+/* map pages first..last of mem as type (dev for PG_DEVICE) */
+struct mem_page *mp;
+int page;
+
+for (page=first; page<=last; page++)
+{
+     mp = &z8->mem_map[mem][page];
+     mp->type = type;
+     if (type == PG_RAM || type == PG_ROM)
+     {
+          /* a page of its own keeps its contents when remapped */
+          mp->host = mp->own ? mp->own : memory ? &memory[mem][page<<8] : NULL;
+          mp->rd = mp->host ? mp->host : zero_page;
+          mp->wr = (type == PG_RAM) ? mp->host : NULL;
+     }
+     else
+     {
+          mp->host = mp->wr = NULL;
+          mp->rd = (type == PG_HOLE) ? ff_page : NULL;
+     }
+     mp->dev = (type == PG_DEVICE) ? dev : NULL;
+     if (mem == PROG)
+          block_invalidate_page(page);
+}
 }
 
+BYTE *mem_page_host(enum MEM mem, int page)
+{
+/* Storage of page for the loader and snapshots - a sparse page gets its 
+   own on first use. NULL for holes, devices and read only images */
+struct mem_page *mp = &z8->mem_map[mem][page];
+
+if (mp->host == NULL && mp->rd == zero_page)
+{
+     if ((mp->own = calloc(1, 256)) == NULL)
+     {
+          printf("No memory for a page\n");
+          exit(0);
+     }
+     mp->host = mp->rd = mp->own;
+     if (mp->type == PG_RAM)
+          mp->wr = mp->own;
+     if (mem == PROG)
+          block_invalidate_page(page);
+}
+return mp->host;
+}
+
+#ifdef IMAGE_FILES
+/* Image files
+   - -P and -D put the pages of a file in place of memory[] from address 0
+     up. Pages past the end of the file stay in memory[]
+   - shared (default): PROG is mapped read only, so its pages act as ROM 
+     and one copy serves every machine; DATA is mapped read-write, so 
+     stores go to the file and can be looked at after the run
+   - private (-C): both are copy-on-write, stores stay in the process
+   - the loader writes s-records through the map, so S1 records over a 
+     read only image are not seen
+*/
+char *mem_image[2];    /* -P and -D files */
+int image_private;     /* -C */
+
+/* map file name over mem - FALSE if it cannot be mapped */
+int mem_map_file(enum MEM mem, char *name, int private)
+{
+int fd, page, rw;
+struct stat st;
+BYTE *p;
+
+rw = private || mem == DATA;
+if ((fd = open(name, (rw && !private) ? O_RDWR : O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+{
+     printf("Cannot open image %s\n", name);
+     return FALSE;
+}
+if (st.st_size == 0 || st.st_size > PD_MEMSZ)
+{
+     printf("Image %s must be 1 to %d bytes\n", name, PD_MEMSZ);
+     close(fd);
+     return FALSE;
+}
+p = mmap(NULL, st.st_size, rw ? PROT_READ|PROT_WRITE : PROT_READ, 
+         private ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+close(fd);
+if (p == MAP_FAILED)
+{
+     printf("Cannot map image %s\n", name);
+     return FALSE;
+}
+z8->mem_file[mem] = p;
+z8->mem_file_len[mem] = st.st_size;
+for (page=0; page<(st.st_size + 255)>>8; page++)
+{
+     z8->mem_map[mem][page].type = rw ? PG_RAM : PG_ROM;
+     z8->mem_map[mem][page].rd = p + (page<<8);
+     z8->mem_map[mem][page].wr = z8->mem_map[mem][page].host = rw ? p + (page<<8) : NULL;
+     z8->mem_map[mem][page].dev = NULL;
+     if (mem == PROG)
+          block_invalidate_page(page);
+}
+return TRUE;
+}
+#endif
+
+/* access to a device page, or a write to anything but RAM in use - kept 
+   out of bus() so RAM and ROM accesses stay short */
+void bus_page(struct mem_page *mp, WORD mar, BYTE *mbr, enum RDWR rdwr, enum MEM mem)
+{
+if (rdwr == RD)
+   *mbr = mp->dev ? mp->dev(mar, 0, RD) : 0xFF;
+else if (mp->dev)
+   mp->dev(mar, *mbr, WR);
+else if (mp->type == PG_RAM && mem_page_host(mem, MSBY(mar))) /* first store to a sparse page */
+{
+   mp->wr[LSBY(mar)] = *mbr;
+   z8->page_dirty[mem][MSBY(mar)] = TRUE;
+}
+}
 
 void bus(WORD mar, BYTE *mbr, enum RDWR rdwr, enum MEM mem)
 {
@@ -432,12 +823,19 @@ void bus(WORD mar, BYTE *mbr, enum RDWR rdwr, enum MEM mem)
    - rdwr - 1-bit read/write indication (RD or WR)
    - mem - 1-bit memory to access (PROG or DATA)
    Does not check for valid rdwr or mem values
+   The memory map says where the page of mar is
 */
+struct mem_page *mp = &z8->mem_map[mem][MSBY(mar)];
 
-if (rdwr == RD)
-   *mbr = memory[mem][mar];
-else /* Assume WR */
-   memory[mem][mar] = *mbr;
+if (rdwr == RD && mp->rd)
+   *mbr = mp->rd[LSBY(mar)];
+else if (rdwr == WR && mp->wr)
+{
+   mp->wr[LSBY(mar)] = *mbr;
+   z8->page_dirty[mem][MSBY(mar)] = TRUE;
+}
+else /* ROM write, hole or device */
+   bus_page(mp, mar, mbr, rdwr, mem);
 
 #ifdef DIAGNOSTICS
 printf("Bus: %04x %01x %01x %01x\n", mar, *mbr, rdwr, mem);
@@ -491,6 +889,7 @@ for (h=0; h<=0x0f; h++)
 	}
 }
 #ifdef OPC_ARRAY_TEST
+if (!batch)
 for (h=0; h<=0x0f; h++)
 {
 	for(l=0; l<=0x0f; l++)
@@ -505,1153 +904,3121 @@ for (h=0; h<=0x0f; h++)
 /***************************************************************************/
 
 
-struct cache_line cache_mem[CACHE_SIZE]; // cache mem
 
-/* cache called on access to program memory
-assertains if target destination is in the cache
-YES - *HIT* returns destination contents and update cache
-NO - *MISS* store contents of cache_line, retrieve target from primary memory
-			update cache, and return to CPU
-*/ 
-void cache (WORD mar, BYTE* mbr, enum RDWR rdwr)
-{
-	int i;
-	BYTE cache_addr = 0; // address of the target address in cache memory
-	struct cache_line temp; // holds cache_mem element to be read/ returned
-	
-	#ifdef DIRECT_MAPPING
-	// formula maps a specific primary address to thesame cache_addr every time
-	cache_addr = mar%CACHE_SIZE;
-	#ifdef TEST_CACHE
-	printf("Cache_addr is: %x \n", cache_addr);
-	#endif
-	#endif 
-	
-	#ifdef ASSOCIATIVE
-	/* do a linear search through the cache_mem
-	if found assign to temp,
-	else assign the least recently used cache_line to temp */
-	for(i=0, i<CACHE_SIZE; i++)
-	{
-		if(cache_mem[i].addr == mar)
-		{
-			//retrieve index of cache_line
-			cache_addr = i;
-			break; // break out of for loop once match is found
-		}
-		else if (cache_mem[i].cls.lru == 0x00){
-			//retrieve index of least recently used
-			cache_addr = i;
-		}
-	}
-	#ifdef TEST_CACHE
-	printf("Cache_addr is: %x \n", cache_addr);
-	#endif
-	#endif
-	
-	/* retrieve cache line */
-	temp = cache_mem[cache_addr];
-	
-	#ifdef ASSOCIATIVE
-	//decrement all younger elements and make cache_line most recently used 
-	for(i=0; i<CACHE_SIZE; i++)
-	{
-		if(cache_mem[i].cls.lru > temp.cls.lru)
-		{
-			cache_mem[i].cls.lru--;
-		}
-	}
-	temp.cls.lru = 0x31; // assign most recent
-	#endif
+/* Cache
+   - program memory accesses go through the L1I cache, data memory 
+     accesses (LDE, stack) through L1D, and either goes on to L2 (if 
+     there is one) and then to primary memory through bus(). Any level 
+     may be left out - with no data side cache, data memory accesses go
+     straight to bus() as before
+   - each level is an N-way set associative cache of cfg->size bytes in 
+     lines of cfg->line bytes. One way is direct mapped, size/line ways 
+     fully associative. L2 holds PROG and DATA lines side by side
+   - the line of an address lives in set (address / line) % sets (PROG 
+     and DATA addresses follow on from each other). Within a set an 
+     empty line is filled first, otherwise cfg->replace picks the line:
+     least recently used (lru), tree pseudo LRU (plru), first in first 
+     out (fifo), random or least frequently used (lfu)
+   - each set is a circular list of its lines from the most recently used
+     (mru[]) on through older. Under lru using a line moves it to the 
+     front and the victim is the line before the front, so neither walks
+     the set. The other policies move a line to the front only when it 
+     is filled - the list is in fill order, which is fifo, and empty 
+     lines stay at the back
+   - plru keeps ways - 1 bits per set in repl[] as a binary tree over the
+     ways, each pointing to the half used less recently. lfu counts the
+     uses of each line in repl[] since it was filled and replaces the 
+     least used, the earliest filled of those
+   - with more than CACHE_SCAN_WAYS ways where[] gives the line holding 
+     each address (line no. + 1, 0 - not cached) instead of searching 
+     the set
+   - WT writes every store to the next level, WB only when a dirty line
+     is replaced. Without write allocate a store that misses goes 
+     straight to the next level and leaves the cache alone
+   - every access to a level adds its latency to sys_clock, every 
+     transfer between the caches and primary memory mem_latency. Block
+     and JIT code and lane vector steps use code read ahead of time, not
+     fetched through the caches - with any latency (cache_timed) the 
+     table engine runs instead of them and lanes step one at a time, so
+     sys_clock is the same whichever engine was asked for
+   - a level with a write buffer (cfg->buf_depth) puts the stores it 
+     writes on (WT, no write allocate) in the buffer instead of waiting
+     for the next level. The bytes still go on at once - the buffer 
+     keeps the lines waiting and when each will have been written, 
+     cfg->drain cycles (or what the write cost) after the one before. 
+     A store only waits when the buffer is full, for its oldest entry. 
+     With cfg->combine a store to a line already waiting (not the one 
+     being written) joins its entry
+   - the defines in Z8_IE.h give the default L1I (no L1D or L2, no 
+     latencies), -K others
+*/
+#define POW2(x)     ((x) && !((x) & ((x) - 1)))
+#define CACHE_KEYS(c)  (2 * PD_MEMSZ / (c)->cfg->line) /* line addresses of PROG and DATA */
+#define CACHE_KEY(c, mem, addr)  (((unsigned) (mem) * PD_MEMSZ + (addr)) >> (c)->cfg->line_bits)
+#define CACHE_REPL(cfg)  ((cfg)->replace == CP_PLRU || (cfg)->replace == CP_LFU) /* repl[] kept */
+#define CACHE_PROG_CFG  (cache_cfg[L1I].size ? &cache_cfg[L1I] \
+                         : cache_cfg[L2].size ? &cache_cfg[L2] : NULL) /* first program memory level */
 
-	if(cache_mem[cache_addr].addr == mar) /* HIT */
-	{
-		#ifdef TEST_CACHE
-		printf("Primary addr: %x , Cache_mem[].addr: %x; HIT \n", mar, cache_mem[cache_addr].addr);
-		#endif
-		
-		if(rdwr==RD)
-		{
-			*mbr = temp.content; // returns value of cache_mem[cache_addr]
-			cache_mem[cache_addr] = temp; // for consistency lru
-		}
-		
-		else{ //assumes WR
-			temp.content = *mbr;
-			#ifdef WB
-			/* write back */
-			temp.cls.dirty = 1; // indicate it has been written to
-			#endif
-			#ifdef WT
-			/* write through */
-			/* write to primary memory for cache consistency */
-			bus(mar, mbr, WR, PROG);
-			#endif
-			cache_mem[cache_addr]=temp; // writes value to cache_mem
-			#ifdef CONSISTENCY
-			printf(	"             addr cont  lru dirty \n"
-					"Primary mem: %4x  %2x 	--  -- \n", mar, memory[PROG][mar]);
-			printf(	"Cache mem  : %4x  %2x   %2x  %1x ", temp.addr, temp.content, temp.cls.lru, temp.cls.dirty);
-			#endif
-		}
-	}
-	else{ /* MISS */
-		#ifdef TEST_CACHE
-		printf("Primary addr: %x , Cache_addr: %x; MISS \n", mar, cache_mem[cache_addr].addr);
-		#endif
-		
-		#ifdef WB
-		if(temp.cls.dirty == 1)
-		{
-			/* cache line has been written to 
-			write back to primary mem to maintain cache consistency */
-			bus(temp.addr, &temp.content, WR, PROG);
-			#ifdef CONSISTENCY
-			printf("Write back to primary memory for consistency \n ");
-			printf(	"Cache mem  : %4x  %2x   %2x  %1x ", temp.addr, temp.content, temp.cls.lru, temp.cls.dirty);
-			printf(" Primary mem: %4x  %2x \n", temp.addr, mem[PROG][temp.addr]);
-			#endif
-		}
-		#endif
-		/* if RD */
-		if (rdwr == RD)
-		{
-			/* retrieve mem contents from primary memory */
-			bus(mar, &temp.content, RD, PROG);
-			temp.addr = mar; // assign cache_line address<- primary mem addr
-			temp.cls.dirty = 0;
-			/* temp.cls.lru set to most recent in #ifdef ASSOCIATIVE above */
-			*mbr = temp.content;
-			cache_mem[cache_addr]= temp; // write new cache line to cache_mem
-		}
-		else{ /* assume WR */
-			/* overwrite cache loc with new values */
-			temp.addr = mar;
-			temp.content = *mbr;
-			#ifdef WB 
-			/* indicate cache location has been written to */
-			temp.cls.dirty = 1;
-			#endif
-			#ifdef WT
-			/* write through to primary memory */
-			bus(temp.addr, &temp.content, WR, PROG);
-			#endif
-			/* store new cach_line in cache mem  */
-			cache_mem[cache_addr]= temp;
-		}
-		#ifdef CONSISTENCY
-		printf(	"             addr cont  lru dirty \n"
-				"Primary mem: %4x  %2x 	--  -- \n", mar, memory[PROG][mar]);
-		printf(	"Cache mem  : %4x  %2x   %2x  %1x ", temp.addr, temp.content, temp.cls.lru, temp.cls.dirty);
-		#endif
-	}
-#ifdef DIAGNOSTICS
-printf("CACHE: %04x %01x %01x %01x\n", mar, *mbr, rdwr, PROG);
+struct cache_config cache_cfg[CACHE_LEVELS] = {
+	[L1I] = {.size = CACHE_SIZE, .line = 1,
+#ifdef ASSOCIATIVE
+	         .ways = CACHE_SIZE, .sets = 1,
+#else /* DIRECT_MAPPING */
+	         .ways = 1, .sets = CACHE_SIZE,
 #endif
-	
-}	
+#ifdef WB
+	         .write_back = TRUE,
+#else
+	         .write_back = FALSE,
+#endif
+	         .write_alloc = TRUE, .replace = CP_LRU},
+	[L1D] = {.size = 0, .line = 1, .ways = 1, .sets = 1, .write_alloc = TRUE, .replace = CP_LRU},
+	[L2]  = {.size = 0, .line = 1, .ways = 1, .sets = 1, .write_alloc = TRUE, .replace = CP_LRU} };
+unsigned mem_latency;   /* cycles per transfer to or from primary memory */
+char *cache_name[CACHE_LEVELS] = {"l1i", "l1d", "l2"};
+char *cache_policy_name[CACHE_POLICIES] = {"lru", "plru", "fifo", "random", "lfu"};
+struct prefetch_config prefetch_cfg = {PF_NONE, 1};
+char *prefetch_name[PREFETCH_KINDS] = {"none", "next", "stride"};
 
-void veiw_cache (void)
+/* the number in the len characters at p into *n - FALSE (*n unchanged)
+   if there is anything else */
+int cache_number(char *p, size_t len, unsigned *n)
 {
-	int i;
-	printf ("loc addr cont  lru dirty \n");
-	for (i = 0; i<CACHE_SIZE; i++)
-	{
-		printf("%2d  %4x  %2x   %2x   %1x \n", i, cache_mem[i].addr, cache_mem[i].content, cache_mem[i].cls.lru, cache_mem[i].cls.dirty);
-	}
-}
+char *end;
+unsigned long v;
 
-void cache_mem_init()
-{
-	BYTE i;
-	for (i=0; i<CACHE_SIZE; i++)
-	{
-		cache_mem[i].addr = 0xffff;
-		cache_mem[i].content = 0xff;
-		cache_mem[i].cls.dirty = 0;
-		cache_mem[i].cls.lru = i;
-	}
+if (len == 0 || *p < '0' || *p > '9')
+     return FALSE;
+v = strtoul(p, &end, 0);
+if (end != p + len)
+     return FALSE;
+*n = v;
+return TRUE;
 }
 
-BYTE prog_mem_fetch()
+int cache_configure(char *spec)
 {
-/* Call bus to access next location in program memory
-   Use PC -- increment PC after access (points to next inst or next byte in 
-   current instruction)
-   Returns location as byte (mbr)
-*/
-BYTE mbr;  /* Memory buffer register */
+/* set a level from spec 
+   "[i:|d:|2:]size,line,ways[,wt|wb][,wa|nwa][,lat=n][,policy][,buf=n][,drain=n][,wc|nwc]"
+   - L1I unless another is named, 0 ways is fully associative and a size
+   of 0 leaves the level out. "mem:n" sets mem_latency, "pf:none|next|
+   stride[,n]" the prefetcher. FALSE (nothing 
+   changed) if spec is not a cache */
+struct cache_config c;
+enum CACHE_LEVEL lv = L1I;
+char *p = spec;
+size_t len;
+unsigned i, n;
 
-////////////changes//////////////////
-cache(pc, &mbr, RD);
-////////////////////////////////////
-//bus(pc, &mbr, RD, PROG);
-
-pc = pc + 1;
-#ifdef PCwatch
-printf("Program counter is : %x \n", pc);
-#endif
-return mbr;
+if (strncmp(p, "mem:", 4) == 0)
+{
+     if (!cache_number(p + 4, strlen(p + 4), &n))
+          return FALSE;
+     mem_latency = n;
+     return TRUE;
 }
-
-BYTE read_dm(WORD addr)
+if (strncmp(p, "pf:", 3) == 0)
 {
-/* Call bus to access addr location in the data memory 
-return content of the memory location as BYTE 
-*/
-BYTE mbr; /* Memory buffer register */
-
-bus(addr, &mbr, RD, DATA);
-
-return mbr;
+     p += 3;
+     for (i=0; i<PREFETCH_KINDS; i++)
+          if (strncmp(p, prefetch_name[i], strlen(prefetch_name[i])) == 0)
+               break;
+     if (i == PREFETCH_KINDS)
+          return FALSE;
+     p += strlen(prefetch_name[i]);
+     n = 1;
+     if (*p == ',' && !cache_number(p + 1, strlen(p + 1), &n))
+          return FALSE;
+     if ((*p && *p != ',') || n == 0 || n > 64)
+          return FALSE;
+     prefetch_cfg.kind = i;
+     prefetch_cfg.degree = n;
+     return TRUE;
 }
-
-BYTE write_dm(WORD addr, BYTE dat)
+if (strncmp(p, "i:", 2) == 0 || strncmp(p, "d:", 2) == 0 || strncmp(p, "2:", 2) == 0)
 {
-/*Call bus to access addr location in data memory
- writes a BYTE dat to it
- returns the byte that was written for consistency 
- and error checking */
- BYTE mbr;
- 
- bus(addr, &dat, WR, DATA);
- bus(addr, &mbr, RD, DATA);
- 
-return mbr;	
+     lv = (*p == 'i') ? L1I : (*p == 'd') ? L1D : L2;
+     p += 2;
+}
+c = cache_cfg[lv];
+c.write_alloc = TRUE;
+c.replace = CP_LRU;
+c.buf_depth = 0;
+c.drain = 0;
+c.combine = TRUE;
+c.size = strtoul(p, &p, 0);
+if (c.size == 0 && *p == '\0')
+{
+     cache_cfg[lv].size = 0;
+     return TRUE;
+}
+if (*p++ != ',')
+     return FALSE;
+c.line = strtoul(p, &p, 0);
+if (*p++ != ',')
+     return FALSE;
+c.ways = strtoul(p, &p, 0);
+while (*p == ',')
+{
+     len = strcspn(++p, ",");
+     if (len == 2 && strncmp(p, "wt", 2) == 0)
+          c.write_back = FALSE;
+     else if (len == 2 && strncmp(p, "wb", 2) == 0)
+          c.write_back = TRUE;
+     else if (len == 2 && strncmp(p, "wa", 2) == 0)
+          c.write_alloc = TRUE;
+     else if (len == 3 && strncmp(p, "nwa", 3) == 0)
+          c.write_alloc = FALSE;
+     else if (len > 4 && strncmp(p, "lat=", 4) == 0)
+     {
+          if (!cache_number(p + 4, len - 4, &c.latency))
+               return FALSE;
+     }
+     else if (len > 4 && strncmp(p, "buf=", 4) == 0)
+     {
+          if (!cache_number(p + 4, len - 4, &c.buf_depth))
+               return FALSE;
+     }
+     else if (len > 6 && strncmp(p, "drain=", 6) == 0)
+     {
+          if (!cache_number(p + 6, len - 6, &c.drain))
+               return FALSE;
+     }
+     else if (len == 2 && strncmp(p, "wc", 2) == 0)
+          c.combine = TRUE;
+     else if (len == 3 && strncmp(p, "nwc", 3) == 0)
+          c.combine = FALSE;
+     else
+     {
+          for (i=0; i<CACHE_POLICIES; i++)
+               if (len == strlen(cache_policy_name[i]) && strncmp(p, cache_policy_name[i], len) == 0)
+                    break;
+          if (i == CACHE_POLICIES)
+               return FALSE;
+          c.replace = i;
+     }
+     p += len;
+}
+if (*p || !POW2(c.size) || c.size > PD_MEMSZ || !POW2(c.line) || c.line > 256 
+    || c.line > c.size)
+     return FALSE;
+if (c.ways == 0)
+     c.ways = c.size / c.line;
+if (!POW2(c.ways) || c.ways > c.size / c.line)
+     return FALSE;
+c.sets = c.size / c.line / c.ways;
+for (c.line_bits=0; (1u << c.line_bits) < c.line; c.line_bits++)
+     ;
+cache_cfg[lv] = c;
+return TRUE;
 }
 
+/* make line n the most recently used of set s of c */
+void cache_touch(struct cache *c, unsigned s, WORD n)
+{
+struct cache_line *cl = &c->lines[n];
+WORD mru = c->mru[s], lru = c->lines[mru].newer;
 
-BYTE read_pm(WORD addr)
-{/* calls bus to read addr location in program memory
-returns a BYTE which is the memory location content
-*/
- 
-BYTE mbr;
-/////////////changes/////////////
-cache(addr, &mbr, RD);
-////////////////////////////////
-
-//bus(addr, &mbr, RD, PROG);
-return mbr;
+if (n == mru)
+     return;
+if (n != lru)
+{
+     /* unlink, then put back between the least and most recently used */
+     c->lines[cl->newer].older = cl->older;
+     c->lines[cl->older].newer = cl->newer;
+     cl->older = mru;
+     cl->newer = lru;
+     c->lines[lru].older = n;
+     c->lines[mru].newer = n;
+}
+c->mru[s] = n; /* the least recently used just moves round */
 }
 
+/* the line of set s of c a miss replaces */
+WORD cache_victim(struct cache *c, unsigned s)
+{
+unsigned ways = c->cfg->ways, node, i, *r;
+WORD first = s * ways, n = c->lines[c->mru[s]].newer, m;
 
-/* calls bus to write value to addr in program memory 
-returns the byte that was written for consistency and error checking
-*/
-BYTE write_pm(WORD addr, BYTE value)
+if (!c->lines[n].cls.valid || ways == 1)
+     return n;
+switch (c->cfg->replace)
 {
-BYTE mbr;
-///////////changes////////////////////
-cache(addr, &value, WR);
-cache(addr, &mbr, RD);
-/////////////////////////////////////
-//bus(addr, &value, WR, PROG);
-//bus(addr, &mbr, RD, PROG);
-return mbr;
+case CP_PLRU:
+     /* down the tree the way the bits point */
+     r = &c->repl[first];
+     for (node=1; node<ways; )
+          node = 2 * node + r[node];
+     return first + node - ways;
+case CP_RANDOM:
+     c->seed ^= c->seed << 13;
+     c->seed ^= c->seed >> 17;
+     c->seed ^= c->seed << 5;
+     return first + (c->seed & (ways - 1));
+case CP_LFU:
+     /* from the earliest filled on - ties keep the earlier */
+     for (i=1, m=c->lines[n].newer; i<ways; i++, m=c->lines[m].newer)
+          if (c->repl[m] < c->repl[n])
+               n = m;
+     return n;
+default: /* CP_LRU, CP_FIFO - the back of the list */
+     return n;
+}
 }
 
-/* get address of destination in register memory
-and returns the dest addr and the source value 
-Increments system clock by number_of_cycles as per addressing mode
-number_of_cycles is thesame for all instructions that call the function 
-*/
-BYTE get_args(BYTE lnib, BYTE* dest)
+/* line n of set s of c was used (and filled if fill) - for policies other
+   than lru */
+void cache_use(struct cache *c, unsigned s, WORD n, int fill)
 {
-BYTE src;
-BYTE dst;
-#ifdef get_args_TEST
-printf("Get ARGS called \n");
-#endif
-switch(lnib){
-case 0x02: /* r_r */
-dst= prog_mem_fetch();
-src =dst;
-src = read_rm(RPBLK|(LSN(src))); // source's value is the content of reg_mem
-dst = RPBLK|MSN(dst); // destination's address is the working register
-/* increment system clock */
-sys_clock += 0x06; /* increments sys_clock by number of cycles = 0x06 */
-break;
+unsigned ways = c->cfg->ways, node;
 
-case 0x03: /* r_Ir*/
-dst = prog_mem_fetch();
-src=dst;
-src = read_rm(RPBLK|(read_rm(RPBLK|LSN(src)))); // source's value is the content of the location the adrress is pointing to
-dst = RPBLK|MSN(dst); // destination address is a working register
-/* increment system clock */
-sys_clock += 0x06; // 6 cycles 
-break;
+if (fill)
+     cache_touch(c, s, n);
+if (c->cfg->replace == CP_PLRU)
+{
+     /* point each node above n at the other half */
+     for (node = n - s * ways + ways; node > 1; node >>= 1)
+          c->repl[s * ways + (node >> 1)] = !(node & 1);
+}
+else if (c->cfg->replace == CP_LFU)
+{
+     if (fill)
+          c->repl[n] = 0;
+     c->repl[n]++;
+}
+}
 
-case 0x04: /* R_R */
-src = read_rm(prog_mem_fetch());
-dst = prog_mem_fetch();
-/* increment system clock */
-sys_clock += 0x0A; // 10 cycles
-break;
+void cache_move(struct cache *c, enum MEM mem, WORD addr, BYTE *buf, unsigned len, enum RDWR rdwr)
+{
+/* move len bytes between buf and addr on of mem through level c (NULL - 
+   primary memory) a line of c at a time. The bytes are in one 256 byte
+   page */
+unsigned n, i;
+struct mem_page *mp;
 
-case 0x05: /* R_IR */
-src = read_rm(read_rm(prog_mem_fetch()));
-dst = prog_mem_fetch();
-/* increment system clock */
-sys_clock += 0x0A; // 10 cycles
-break;
+if (c == NULL)
+{
+     mp = &z8->mem_map[mem][MSBY(addr)];
+     if (rdwr == RD && mp->rd)
+          memcpy(buf, &mp->rd[LSBY(addr)], len);
+     else
+          for (i=0; i<len; i++)
+               bus(addr + i, &buf[i], rdwr, mem);
+     sys_clock += mem_latency;
+     return;
+}
+for (; len; addr += n, buf += n, len -= n)
+{
+     n = c->cfg->line - (addr & (c->cfg->line - 1));
+     if (n > len)
+          n = len;
+     cache_access(c, mem, addr, buf, n, rdwr);
+}
+}
 
-case 0x06: /* R_NUM*/
-dst = prog_mem_fetch();
-src = prog_mem_fetch();
-/* increment system clock */
-sys_clock +=0x0A; // 10 cycles
-break;
+/* write n bytes at addr of mem on from c through its write buffer */
+void cache_buffer(struct cache *c, enum MEM mem, WORD addr, BYTE *buf, unsigned n)
+{
+struct write_buffer *wb = &c->wbuf;
+unsigned depth = c->cfg->buf_depth, key = CACHE_KEY(c, mem, addr), i;
+unsigned long now, cost;
 
-case 0x07: /* IR_NUM */
-dst = read_rm(prog_mem_fetch());
-src = prog_mem_fetch();
-/* increment system clock */
-sys_clock +=0x0A; // 10 cycles
-break;
+/* the entries written by now leave */
+while (wb->count && wb->done[wb->head] <= sys_clock)
+{
+     wb->head = (wb->head + 1) % depth;
+     wb->count--;
+}
+c->stat.buffered++;
+c->stat.occupancy += wb->count;
+if (wb->count > c->stat.occupancy_max)
+     c->stat.occupancy_max = wb->count;
+now = sys_clock;
+if (c->cfg->combine)
+     for (i=1; i<wb->count; i++) /* the head is being written */
+          if (wb->key[(wb->head + i) % depth] == key)
+          {
+               c->stat.combined++;
+               cache_move(c->next, mem, addr, buf, n, WR);
+               sys_clock = now;
+               return;
+          }
+if (wb->count == depth)
+{
+     /* full - wait for the oldest */
+     c->stat.buf_stalls++;
+     c->stat.stall_cycles += wb->done[wb->head] - now;
+     now = sys_clock = wb->done[wb->head];
+     wb->head = (wb->head + 1) % depth;
+     wb->count--;
+}
+cache_move(c->next, mem, addr, buf, n, WR);
+cost = c->cfg->drain ? c->cfg->drain : sys_clock - now;
+sys_clock = now;
+/* written after the entry before it */
+i = (wb->head + wb->count) % depth;
+wb->key[i] = key;
+wb->done[i] = (wb->count ? wb->done[(i + depth - 1) % depth] : now) + cost;
+wb->count++;
 }
 
-#ifdef get_args_TEST
-printf("Dst reg : %2x, src value: %2x \n", dst, src);
-#endif
+/* the line of the ways of set holding base of mem, NULL - none */
+struct cache_line *cache_find(struct cache_line *set, unsigned ways, enum MEM mem, WORD base)
+{
+	unsigned i;
 
-*dest = dst; // pass location of dst in reg_mem
-return src;	// return the value of source obtained from reg_mem
+	for (i=0; i<ways; i++)
+		if (set[i].cls.valid && set[i].addr == base && set[i].mem == mem)
+			return &set[i];
+	return NULL;
 }
 
-/*	get dst address for instructions with 0 and 1 low nib DEC, RLC, SWAP etc 
-returns dst index
-Increments sys_clock by base value of 6 cycles	*/
-BYTE get_args_2(BYTE lnib)
+/* the byte at addr of mem as the first of level c on (NULL - primary 
+   memory) to hold it has it - no latency, counters or LRU changes */
+void cache_peek(struct cache *c, enum MEM mem, WORD addr, BYTE *buf)
 {
-	BYTE ans;
-	#ifdef get_args_2_TEST
-	printf(" low nibble is : %2x \n", lnib);
-	#endif
-	switch (lnib)
+	WORD base;
+	unsigned i, s;
+	struct cache_line *cl;
+
+	for (; c; c = c->next)
 	{
-		case 0x00:	// R
-		ans = prog_mem_fetch();
-		break;
-		
-		case 0x01:	//IR
-		ans = read_rm(prog_mem_fetch());
-		break;
+		base = addr & ~(c->cfg->line - 1);
+		s = CACHE_KEY(c, mem, addr) & (c->cfg->sets - 1);
+		if (c->where)
+			cl = (i = c->where[CACHE_KEY(c, mem, addr)]) ? &c->lines[i - 1] : NULL;
+		else
+			cl = cache_find(&c->lines[s * c->cfg->ways], c->cfg->ways, mem, base);
+		if (cl)
+		{
+			*buf = c->data[(cl - c->lines) * c->cfg->line + (addr - base)];
+			return;
+		}
 	}
-	/* increment system clock */
-	sys_clock +=6; // 6 cycles 
-#ifdef get_args_2_TEST
-printf("Dst reg : %2x \n", ans);
+	bus(addr, buf, RD, mem);
+}
+
+/* put the line at base of mem in set s of c, in place of the line 
+   cfg->replace picks (written back first if dirty) - its bytes read from
+   the next level if load */
+struct cache_line *cache_fill(struct cache *c, enum MEM mem, WORD base, unsigned s, int load)
+{
+	unsigned line = c->cfg->line;
+	struct cache_line *cl = &c->lines[cache_victim(c, s)];
+	BYTE *data = &c->data[(cl - c->lines) * line];
+
+	if (cl->cls.valid)
+		c->stat.evictions++;
+	if (cl->cls.valid && cl->cls.dirty)
+	{
+		/* cache line has been written to 
+		write back to the next level to maintain cache consistency */
+		c->stat.write_backs++;
+		cache_move(c->next, cl->mem, cl->addr, data, line, WR);
+	}
+	if (cl->cls.valid && cl->cls.pref)
+		c->pf->unused++;
+	if (c->where)
+	{
+		if (cl->cls.valid)
+			c->where[CACHE_KEY(c, cl->mem, cl->addr)] = 0;
+		c->where[CACHE_KEY(c, mem, base)] = cl - c->lines + 1;
+	}
+	if (load)
+		cache_move(c->next, mem, base, data, line, RD);
+	cl->addr = base;
+	cl->mem = mem;
+	cl->cls.valid = 1;
+	cl->cls.dirty = 0;
+	cl->cls.pref = 0;
+	return cl;
+}
+
+/* cache access - n bytes at addr of mem, all in one line of c
+assertains if target destination is in the cache
+YES - *HIT* returns destination contents and update cache
+NO - *MISS* write back the line replaced if dirty, retrieve the target 
+			line from the next level, update cache, and return to CPU
+*/ 
+void cache_access(struct cache *c, enum MEM mem, WORD addr, BYTE *buf, unsigned n, enum RDWR rdwr)
+{
+	unsigned i, line = c->cfg->line;
+	WORD base = addr & ~(line - 1); // address of the line
+	unsigned key = CACHE_KEY(c, mem, addr);
+	unsigned s = key & (c->cfg->sets - 1); // set of addr
+	struct cache_line *set = &c->lines[s * c->cfg->ways], *cl = NULL; // its line
+	BYTE *data;
+	int fill = FALSE, used = FALSE;
+
+	sys_clock += c->cfg->latency;
+	if (c->where)
+	{
+		if ((i = c->where[key]) != 0)
+			cl = &c->lines[i - 1];
+	}
+	else
+		for (i=0; i<c->cfg->ways; i++)
+			if (set[i].cls.valid && set[i].addr == base && set[i].mem == mem)
+			{
+				cl = &set[i];
+				break;
+			}
+	if (c->det)
+		cache_classify(c, key, cl == NULL);
+
+	if (cl == NULL) /* MISS */
+	{
+		#ifdef TEST_CACHE
+		printf("Primary addr: %x , Cache set: %x; MISS \n", addr, s);
+		#endif
+		if (rdwr == RD)
+			c->stat.rd_misses++;
+		else
+			c->stat.wr_misses++;
+		if (rdwr == WR && !c->cfg->write_alloc)
+		{
+			if (c->cfg->buf_depth)
+				cache_buffer(c, mem, addr, buf, n);
+			else
+				cache_move(c->next, mem, addr, buf, n, WR);
+			return;
+		}
+		fill = TRUE;
+		/* retrieve the line from the next level - not when all of it 
+		   is about to be overwritten */
+		cl = cache_fill(c, mem, base, s, rdwr == RD || n < line);
+	}
+	else{ /* HIT */
+		#ifdef TEST_CACHE
+		printf("Primary addr: %x , Cache_mem[].addr: %x; HIT \n", addr, cl->addr);
+		#endif
+		if (rdwr == RD)
+			c->stat.rd_hits++;
+		else
+			c->stat.wr_hits++;
+		if (cl->cls.pref)
+		{
+			cache_prefetch_used(c, cl - c->lines);
+			used = TRUE;
+		}
+	}
+
+	data = &c->data[(cl - c->lines) * line + (addr - base)];
+	if (rdwr == RD)
+	{
+		if (n == 1)
+			*buf = *data;
+		else
+			memcpy(buf, data, n);
+	}
+	else{ //assumes WR
+		if (n == 1)
+			*data = *buf;
+		else
+			memcpy(data, buf, n);
+		if (c->cfg->write_back)
+			cl->cls.dirty = 1; // indicate it has been written to
+		else if (c->cfg->buf_depth)
+			cache_buffer(c, mem, addr, buf, n); // write through the buffer
+		else
+			cache_move(c->next, mem, addr, buf, n, WR); // write through to the next level
+		#ifdef CONSISTENCY
+		printf(	"             addr cont  lru dirty \n"
+				"Primary mem: %4x  %2x 	--  -- \n", addr, 
+				z8->mem_map[mem][MSBY(addr)].rd ? z8->mem_map[mem][MSBY(addr)].rd[LSBY(addr)] : 0xFF);
+		printf(	"Cache mem  : %4x  %2x   %2x  %1x ", addr, *data, cl->older, cl->cls.dirty);
+		#endif
+	}
+	if (c->cfg->replace == CP_LRU)
+		cache_touch(c, s, cl - c->lines);
+	else
+		cache_use(c, s, cl - c->lines, fill);
+	if (c->pf && (fill || used) && mem == PROG && rdwr == RD)
+		cache_prefetch(c, addr);
+}
+
+/* cache called on access to program memory */
+void cache (WORD mar, BYTE* mbr, enum RDWR rdwr)
+{
+	if (z8->cache_prof)
+		cache_profile(mar);
+	if (z8->cache_top[PROG])
+		cache_access(z8->cache_top[PROG], PROG, mar, mbr, 1, rdwr);
+	else
+		bus(mar, mbr, rdwr, PROG);
+#ifdef DIAGNOSTICS
+printf("CACHE: %04x %01x %01x %01x\n", mar, *mbr, rdwr, PROG);
 #endif
-	return ans;
 }
 
+/* Cache engines
+   - prog_mem_fetch() and read_pm() read program memory through 
+     cache_fetch, chosen once the caches are configured from engines 
+     made for each geometry and replacement policy, like op_table's 
+     handlers are made for each operand mode
+   - an engine looks for mar in its set with the ways known when it was
+     made (or through where[]), and on a hit does what the policy does
+     to a line used. Everything else - misses, write backs, write 
+     buffers, the next levels - is cache_access() as before, so the 
+     write policy (which only acts there) needs no engines of its own
+   - with no cache in front of program memory the engine is a read of 
+     the page. -M, -R, the prefetcher and the cache traces go through 
+     cache() every time
+*/
+BYTE (*cache_fetch)(WORD);
+int cache_timed;     /* a latency or drain time is set - fetches cost cycles */
 
+#define CACHE_HIT_LRU(c, s, n)    cache_touch(c, s, n)
+#define CACHE_HIT_NONE(c, s, n)   /* fifo, random - a hit changes nothing */
+#define CACHE_HIT_USE(c, s, n)    cache_use(c, s, n, FALSE)
 
-/* function does the addition of a dst and src 
- all flag manipulations are performed in the function
- a1 holds destination value
- a2 holds source value 
- a3 is 1, for ADD with carry OR 0 for not with carry 
- */
-BYTE adder (BYTE a1, BYTE a2, BYTE a3)
+/* fetch through a cache of ways lines per set (ways <= CACHE_SCAN_WAYS) */
+#define CACHE_ENGINE_SCAN(name, ways, hit) \
+BYTE cache_fetch_##name(WORD mar) \
+{ \
+	struct cache *c = z8->cache_top[PROG]; \
+	unsigned s = (mar >> c->cfg->line_bits) & (c->cfg->sets - 1), i; \
+	WORD base = mar & ~(c->cfg->line - 1); \
+	struct cache_line *set = &c->lines[s * (ways)]; \
+	BYTE mbr; \
+	for (i=0; i<(ways); i++) \
+		if (set[i].cls.valid && set[i].addr == base && set[i].mem == PROG) \
+		{ \
+			sys_clock += c->cfg->latency; \
+			c->stat.rd_hits++; \
+			hit(c, s, s * (ways) + i); \
+			return c->data[(s * (ways) + i) * c->cfg->line + (mar - base)]; \
+		} \
+	cache_access(c, PROG, mar, &mbr, 1, RD); \
+	return mbr; \
+}
+
+/* fetch through a cache with where[] */
+#define CACHE_ENGINE_WHERE(name, hit) \
+BYTE cache_fetch_##name(WORD mar) \
+{ \
+	struct cache *c = z8->cache_top[PROG]; \
+	unsigned n = c->where[mar >> c->cfg->line_bits]; /* PROG keys come first */ \
+	BYTE mbr; \
+	if (n--) \
+	{ \
+		sys_clock += c->cfg->latency; \
+		c->stat.rd_hits++; \
+		hit(c, (mar >> c->cfg->line_bits) & (c->cfg->sets - 1), n); \
+		return c->data[n * c->cfg->line + (mar & (c->cfg->line - 1))]; \
+	} \
+	cache_access(c, PROG, mar, &mbr, 1, RD); \
+	return mbr; \
+}
+
+#define CACHE_ENGINES(pol, hit) \
+CACHE_ENGINE_SCAN(1_##pol, 1, hit) \
+CACHE_ENGINE_SCAN(2_##pol, 2, hit) \
+CACHE_ENGINE_SCAN(4_##pol, 4, hit) \
+CACHE_ENGINE_WHERE(n_##pol, hit)
+
+CACHE_ENGINES(lru, CACHE_HIT_LRU)
+CACHE_ENGINES(none, CACHE_HIT_NONE)
+CACHE_ENGINES(use, CACHE_HIT_USE)
+
+/* engines by policy, then ways 1, 2, 4, more */
+BYTE (*cache_engine[CACHE_POLICIES][4])(WORD) = {
+	{cache_fetch_1_lru, cache_fetch_2_lru, cache_fetch_4_lru, cache_fetch_n_lru},
+	{cache_fetch_1_use, cache_fetch_2_use, cache_fetch_4_use, cache_fetch_n_use},     /* CP_PLRU */
+	{cache_fetch_1_none, cache_fetch_2_none, cache_fetch_4_none, cache_fetch_n_none}, /* CP_FIFO */
+	{cache_fetch_1_none, cache_fetch_2_none, cache_fetch_4_none, cache_fetch_n_none}, /* CP_RANDOM */
+	{cache_fetch_1_use, cache_fetch_2_use, cache_fetch_4_use, cache_fetch_n_use} };   /* CP_LFU */
+
+/* no cache - the page, or bus() for devices and holes */
+BYTE cache_fetch_off(WORD mar)
 {
-	BYTE ans;
-	CARRY_BYTE temp;
-	temp = a1+a2+a3;
-	ans = temp;	
-	
-	/************* SET FLAGS ***************/
-	/* carry */
-	carry = (CARRY(temp)>>8); // determine if there is a carry */
-	write_rm(FLAGS, FLAG_C(carry));		// set carry 
-	
-	/* zero */
-	zero = ZERO(ans);
-	write_rm(FLAGS, FLAG_Z(zero));
-	
-	/* sign */
-	sign = SIGN(ans);
-	write_rm(FLAGS, FLAG_S(sign));
-	
-	/* overflow */
-	overflow = (SIGN(a1) != sign);
-	write_rm(FLAGS, FLAG_V(overflow));
-	
-	/* decimal adjust */
-	decimal_adjust=0;
-	write_rm(FLAGS, FLAG_D(decimal_adjust));
-	
-	/* half carry */
-	half_carry = (HALF_CARRY(ans)!=HALF_CARRY(a1));
-	write_rm(FLAGS, FLAG_H(half_carry));
-	
-#ifdef adder_TEST
-	printf ("result of %2x + %2x (with carry = %2x): %x \n", a1, a2, a3, ans);
-	printf ("FLAGS : %x \n", read_rm(FLAGS));
+	struct mem_page *mp = &z8->mem_map[PROG][MSBY(mar)];
+	BYTE mbr;
+
+	if (mp->rd)
+		return mp->rd[LSBY(mar)];
+	bus(mar, &mbr, RD, PROG);
+	return mbr;
+}
+
+/* every fetch through cache() */
+BYTE cache_fetch_any(WORD mar)
+{
+	BYTE mbr;
+
+	cache(mar, &mbr, RD);
+	return mbr;
+}
+
+/* set cache_fetch for cache_cfg[] - before the first machine runs */
+void cache_engine_select()
+{
+	struct cache_config *cfg = CACHE_PROG_CFG;
+	unsigned lv;
+
+	cache_timed = mem_latency != 0;
+	for (lv=0; lv<CACHE_LEVELS; lv++)
+		if (cache_cfg[lv].size && (cache_cfg[lv].latency || cache_cfg[lv].drain))
+			cache_timed = TRUE;
+
+#if defined(DIAGNOSTICS) || defined(TEST_CACHE)
+	cache_fetch = cache_fetch_any;
+#else
+	if (cache_profiling || cache_reporting || (prefetch_cfg.kind && cfg))
+		cache_fetch = cache_fetch_any;
+	else if (cfg == NULL)
+		cache_fetch = cache_fetch_off;
+	else if (cfg->ways > CACHE_SCAN_WAYS)
+		cache_fetch = cache_engine[cfg->replace][3];
+	else
+		cache_fetch = cache_engine[cfg->replace][cfg->ways == 1 ? 0 : cfg->ways == 2 ? 1 : 2];
 #endif
-	return ans;
 }
 
-/* function does subtraction of src from dst
-all flag manipulations are done in the function
-a1 holds the value of destination 
-a2 holds the value of src 
-a3 holds carry for subtractions with carry 
-returns the result of subtraction
+/* Instruction prefetch
+   - with -K pf:next,n a miss of the first program memory level (L1I, or
+     L2 without one) loads the n lines after the missing one into it, 
+     and so does the first use of a line the prefetcher loaded - the 
+     lines keep coming ahead of straight line code. -K pf:stride,n only
+     prefetches along the stride of the last two misses (and prefetched
+     lines used), n strides on, when it was the same both times
+   - a line already in the cache, or in a page that is not memory (a 
+     device would see the read), is not prefetched
+   - prefetches do not hold the CPU up. Each one takes as long as its 
+     fill would, after the one before it, and sys_clock at which it will
+     be loaded is kept with the line. A fetch of the line before then 
+     waits for it (late)
+   - issued, useful (used before replaced), unused (replaced first), late
+     and the cycles waited are counted for -R: accuracy is useful of 
+     issued, coverage useful of the misses it would have had (useful +
+     read misses), timeliness not late of useful
 */
-BYTE subber (BYTE a1, BYTE a2, BYTE a3)
+/* addr of c was missed or a prefetched line used - prefetch the lines 
+   expected next */
+void cache_prefetch(struct cache *c, WORD addr)
 {
-	BYTE ans;
-	CARRY_BYTE temp;
-	temp = a1 - a2 - a3;
-	ans = temp;
-	#ifdef flags_test
-	printf ("result : %x \n", ans);
-	#endif
-	/************* SET FLAGS ***************/
-	/* carry */
-	carry = !(CARRY(temp)>>8); // determine if there is a carry
-	
-#ifdef flags_test
-printf("carry is %x \n", carry);
-#endif
-	write_rm(FLAGS, FLAG_C(carry));		// set carry 
-	
-	/* zero */
-	zero = ZERO(ans);
-	write_rm(FLAGS, FLAG_Z(zero));
-#ifdef flags_test
-printf("zero is %x \n", zero);
-#endif
-
-	/* sign */
-	sign = SIGN(ans);
-	write_rm(FLAGS, FLAG_S(sign));
-#ifdef flags_test
-printf("sign is %x \n", sign);
-#endif
-	
-	/* overflow */
-	overflow = (SIGN(a1) != sign);
-	write_rm(FLAGS, FLAG_V(overflow));
-#ifdef flags_test
-	printf("Overflow is : %2x \n", overflow);
-#endif
-	/* decimal adjust */
-	decimal_adjust=0x01;
-	write_rm(FLAGS, FLAG_D(decimal_adjust));
-#ifdef flags_test
-printf ("decimal adjust is : %x \n", decimal_adjust);
-#endif
-	
-	/* half carry */
-	half_carry = !(HALF_CARRY(ans)!=HALF_CARRY(a1));
-#ifdef flags_test
-printf("half carry is : %x \n", half_carry);
-#endif
+	struct prefetch *pf = c->pf;
+	unsigned bits = c->cfg->line_bits, mask = (PD_MEMSZ >> bits) - 1;
+	unsigned x = addr >> bits, step = 1, k, y, s;
+	unsigned long now, cost;
+	WORD base;
+	struct cache_line *cl;
 
-	write_rm(FLAGS, FLAG_H(half_carry));	
-#ifdef flags_test
-printf( "FLAGS : %x \n", read_rm(FLAGS));
-#endif
-	return ans;
+	if (prefetch_cfg.kind == PF_STRIDE)
+	{
+		step = (x - pf->last) & mask;
+		pf->last = x;
+		if (step != pf->stride || step == 0)
+		{
+			pf->stride = step;
+			return;
+		}
+	}
+	for (k=1; k<=prefetch_cfg.degree; k++)
+	{
+		y = (x + k * step) & mask;
+		base = y << bits;
+		s = y & (c->cfg->sets - 1);
+		if (z8->mem_map[PROG][MSBY(base)].rd == NULL
+		    || (c->where ? c->where[y] != 0 : cache_find(&c->lines[s * c->cfg->ways], c->cfg->ways, PROG, base) != NULL))
+			continue;
+		now = sys_clock;
+		cl = cache_fill(c, PROG, base, s, TRUE);
+		cost = sys_clock - now;
+		sys_clock = now;
+		if (c->cfg->replace == CP_LRU)
+			cache_touch(c, s, cl - c->lines);
+		else
+			cache_use(c, s, cl - c->lines, TRUE);
+		cl->cls.pref = 1;
+		pf->issued++;
+		pf->busy = (pf->busy > now ? pf->busy : now) + cost;
+		pf->ready[cl - c->lines] = pf->busy;
+	}
 }
 
-/* adjust_dec function called by the decimal adjust (DA) instruction
-sets all affected flags in function 
-a1 holds the destination value 
-returns the value of the adjusted dst */
-BYTE adjust_dec(BYTE a1)
+/* line n of c, loaded by the prefetcher, is used for the first time */
+void cache_prefetch_used(struct cache *c, unsigned n)
 {
-BYTE ans;
-CARRY_BYTE temp;
-BYTE numb; // number to be added to BYTE 
+	struct prefetch *pf = c->pf;
 
-switch (half_carry){
-case 0x00:
-if(LSN(a1)<=0x09){ //unsigned char no need to check for lower bound of 0
-	switch(carry){
-	case 0x00: 
-	if (MSN(a1)<=0x09)
+	c->lines[n].cls.pref = 0;
+	pf->useful++;
+	if (pf->ready[n] > sys_clock)
 	{
-		numb =0x00;
-	}else{ /*MSN : A-F */
-		numb =0x06;
-	}
-	break;
-	
-	case 0x01:
-	if(MSN(a1)<=0x02){
-		numb =0x60;
-	}
-	else if(MSN(a1)>=0x07 && MSN(a1)<=0x0F){
-		numb =0XA0;
+		pf->late++;
+		pf->late_cycles += pf->ready[n] - sys_clock;
+		sys_clock = pf->ready[n];
 	}
-	break;
+}
+
+void veiw_cache (void)
+{
+	unsigned i, j, lv;
+	struct cache *c;
+
+	for (lv=0; lv<CACHE_LEVELS; lv++)
+	{
+		if ((c = &z8->caches[lv])->lines == NULL)
+			continue;
+		printf ("%s\nloc addr v older dirty cont \n", cache_name[lv]);
+		for (i = 0; i<c->cfg->size / c->cfg->line; i++)
+		{
+			printf("%2d  %4x  %1x  %4x   %1x   ", i, c->lines[i].addr, c->lines[i].cls.valid, c->lines[i].older, c->lines[i].cls.dirty);
+			for (j = 0; j<c->cfg->line; j++)
+				printf(" %2x", c->data[i * c->cfg->line + j]);
+			printf("\n");
+		}
 	}
 }
-else /* LSN : A-F*/
+
+void cache_mem_init()
 {
-	switch(carry){
-		case 0x00:
-		if(MSN(a1)<=0x08){
-			numb = 0x06;
+	/* empty caches of cache_cfg[] - allocated for the machine the first time */
+	unsigned i, way, lines, lv;
+	struct cache *c;
+
+	for (lv=0; lv<CACHE_LEVELS; lv++)
+	{
+		c = &z8->caches[lv];
+		c->cfg = &cache_cfg[lv];
+		if (c->cfg->size == 0)
+			continue;
+		lines = c->cfg->size / c->cfg->line;
+		if (c->lines == NULL && ((c->lines = calloc(lines, sizeof(struct cache_line))) == NULL
+		                         || (c->data = calloc(1, c->cfg->size)) == NULL
+		                         || (c->mru = calloc(c->cfg->sets, sizeof(WORD))) == NULL
+		                         || (CACHE_REPL(c->cfg) && (c->repl = calloc(lines, sizeof(unsigned))) == NULL)
+		                         || (c->cfg->buf_depth 
+		                             && ((c->wbuf.key = calloc(c->cfg->buf_depth, sizeof(unsigned))) == NULL
+		                                 || (c->wbuf.done = calloc(c->cfg->buf_depth, sizeof(unsigned long))) == NULL))
+		                         || (c->cfg->ways > CACHE_SCAN_WAYS 
+		                             && (c->where = calloc(CACHE_KEYS(c), sizeof(unsigned))) == NULL)))
+		{
+			printf("No memory for the cache\n");
+			exit(0);
 		}
-		else{
-			numb = 0x66;
+		for (i=0; i<lines; i++)
+		{
+			/* line 0 of each set is used first */
+			way = i % c->cfg->ways;
+			c->lines[i].addr = 0;
+			c->lines[i].mem = PROG;
+			c->lines[i].cls.valid = 0;
+			c->lines[i].cls.dirty = 0;
+			c->lines[i].cls.pref = 0;
+			c->lines[i].older = i - way + (way + c->cfg->ways - 1) % c->cfg->ways;
+			c->lines[i].newer = i - way + (way + 1) % c->cfg->ways;
 		}
-		break;
-		case 0x01:
-		if(MSN(a1)<=0x02){
-			numb =0x66;
+		for (i=0; i<c->cfg->sets; i++)
+			c->mru[i] = i * c->cfg->ways + c->cfg->ways - 1;
+		memset(c->data, 0xff, c->cfg->size);
+		if (c->where)
+			memset(c->where, 0, CACHE_KEYS(c) * sizeof(unsigned));
+		if (c->repl)
+			memset(c->repl, 0, lines * sizeof(unsigned));
+		c->seed = 2463534242u; /* the same random victims every run */
+		c->wbuf.head = c->wbuf.count = 0;
+		memset(&c->stat, 0, sizeof(c->stat));
+		if (cache_reporting)
+			cache_detail_init(c);
+	}
+	c = z8->caches[L2].lines ? &z8->caches[L2] : NULL;
+	z8->caches[L1I].next = z8->caches[L1D].next = c;
+	z8->cache_top[PROG] = z8->caches[L1I].lines ? &z8->caches[L1I] : c;
+	z8->cache_top[DATA] = z8->caches[L1D].lines ? &z8->caches[L1D] : c;
+	if (prefetch_cfg.kind && (c = z8->cache_top[PROG]) != NULL)
+	{
+		lines = c->cfg->size / c->cfg->line;
+		if (c->pf == NULL && ((c->pf = malloc(sizeof(struct prefetch))) == NULL
+		                      || (c->pf->ready = malloc(lines * sizeof(unsigned long))) == NULL))
+		{
+			printf("No memory for the prefetcher\n");
+			exit(0);
 		}
-		break;
+		memset(c->pf->ready, 0, lines * sizeof(unsigned long));
+		c->pf->busy = 0;
+		c->pf->last = c->pf->stride = 0;
+		c->pf->issued = c->pf->useful = c->pf->late = c->pf->late_cycles = c->pf->unused = 0;
 	}
+	if (cache_profiling)
+		cache_profile_init();
 }
-break;
 
-case 0x01:
-if(LSN(a1)<=0x03){	
-switch (carry){	
-case 0x00:
-if(MSN(a1)<=0x09){
-	numb =0x06;
-}
-else{
-	numb = 0x66;
-}
-break;
+/* write the dirty lines of every level back, L1 before L2, so primary 
+   memory (and an image file mapped on it) holds every store - sys_clock,
+   the counters and -R's detail stay as the run left them. The write 
+   buffers have nothing left to write and are emptied */
+void cache_flush()
+{
+	unsigned long clock = sys_clock;
+	struct cache_stats stat[CACHE_LEVELS];
+	struct cache_detail *det[CACHE_LEVELS];
+	unsigned i, lines, lv;
+	struct cache *c;
 
-case 0x01:
-if(MSN(a1)>=0x03){
-	numb = 0x66;
-}
-break;	
+	for (lv=0; lv<CACHE_LEVELS; lv++)
+	{
+		stat[lv] = z8->caches[lv].stat;
+		det[lv] = z8->caches[lv].det;
+		z8->caches[lv].det = NULL;
+	}
+	for (lv=0; lv<CACHE_LEVELS; lv++)
+	{
+		if ((c = &z8->caches[lv])->lines == NULL)
+			continue;
+		lines = c->cfg->size / c->cfg->line;
+		for (i=0; i<lines; i++)
+			if (c->lines[i].cls.valid && c->lines[i].cls.dirty)
+			{
+				cache_move(c->next, c->lines[i].mem, c->lines[i].addr, 
+				           &c->data[i * c->cfg->line], c->cfg->line, WR);
+				c->lines[i].cls.dirty = 0;
+			}
+	}
+	for (lv=0; lv<CACHE_LEVELS; lv++)
+	{
+		z8->caches[lv].stat = stat[lv];
+		z8->caches[lv].det = det[lv];
+		z8->caches[lv].wbuf.count = 0;
+	}
+	sys_clock = clock;
 }
+
+void cache_free()
+{
+	unsigned lv;
+	struct cache *c;
+
+	for (lv=0; lv<CACHE_LEVELS; lv++)
+	{
+		c = &z8->caches[lv];
+		free(c->lines);
+		free(c->data);
+		free(c->mru);
+		free(c->where);
+		free(c->repl);
+		free(c->wbuf.key);
+		free(c->wbuf.done);
+		if (c->pf)
+		{
+			free(c->pf->ready);
+			free(c->pf);
+		}
+		if (c->det)
+		{
+			free(c->det->older);
+			free(c->det->state);
+			free(c->det->misses_at);
+			free(c->det);
+		}
+	}
+	if (z8->cache_prof)
+	{
+		free(z8->cache_prof->older[0]);
+		free(z8->cache_prof->seen);
+		free(z8->cache_prof);
+	}
 }
 
-else if(LSN(a1)>= 0x06 && LSN(a1)<=0x0F){
-switch (carry){
-case 0x00:
-if (MSN(a1)<=0x08){
-	numb = 0xFA;
+/* bytes of cache state a snapshot holds */
+size_t cache_state_len()
+{
+	unsigned lv;
+	size_t len = 0;
+	struct cache_config *cfg = CACHE_PROG_CFG;
+
+	for (lv=0; lv<CACHE_LEVELS; lv++)
+		if (cache_cfg[lv].size)
+			len += cache_cfg[lv].size / cache_cfg[lv].line 
+			       * (sizeof(struct cache_line) + (CACHE_REPL(&cache_cfg[lv]) ? sizeof(unsigned) : 0))
+			       + cache_cfg[lv].sets * sizeof(WORD) + cache_cfg[lv].size + sizeof(unsigned)
+			       + cache_cfg[lv].buf_depth * (sizeof(unsigned) + sizeof(unsigned long)) 
+			       + 2 * sizeof(unsigned);
+	if (prefetch_cfg.kind && cfg)
+		len += (cfg->size / cfg->line + 1) * sizeof(unsigned long) + 2 * sizeof(unsigned);
+	return len;
 }
-break;
-case 0x01:
-if(MSN(a1)>= 0x06 && MSN(a1)<= 0x0F){
-	numb = 0x9A;
+
+/* copy the caches and the prefetcher to or from (restore) a snapshot's 
+   buf - where[] is redone from the lines */
+void cache_state(char *buf, int restore)
+{
+	unsigned i, lines, lv;
+	size_t len[9];
+	char *part[9];
+	struct cache *c;
+
+	for (lv=0; lv<CACHE_LEVELS; lv++)
+	{
+		if ((c = &z8->caches[lv])->lines == NULL)
+			continue;
+		lines = c->cfg->size / c->cfg->line;
+		part[0] = (char *) c->lines; len[0] = lines * sizeof(struct cache_line);
+		part[1] = (char *) c->mru; len[1] = c->cfg->sets * sizeof(WORD);
+		part[2] = (char *) c->data; len[2] = c->cfg->size;
+		part[3] = (char *) c->repl; len[3] = c->repl ? lines * sizeof(unsigned) : 0;
+		part[4] = (char *) &c->seed; len[4] = sizeof(unsigned);
+		part[5] = (char *) c->wbuf.key; len[5] = c->cfg->buf_depth * sizeof(unsigned);
+		part[6] = (char *) c->wbuf.done; len[6] = c->cfg->buf_depth * sizeof(unsigned long);
+		part[7] = (char *) &c->wbuf.head; len[7] = sizeof(unsigned);
+		part[8] = (char *) &c->wbuf.count; len[8] = sizeof(unsigned);
+		for (i=0; i<lines && restore && c->where; i++)
+			if (c->lines[i].cls.valid)
+				c->where[CACHE_KEY(c, c->lines[i].mem, c->lines[i].addr)] = 0;
+		for (i=0; i<9; buf += len[i], i++)
+			if (len[i] == 0)
+				continue; /* no repl[] (lru, fifo, random) or write buffer */
+			else if (restore)
+				memcpy(part[i], buf, len[i]);
+			else
+				memcpy(buf, part[i], len[i]);
+		for (i=0; i<lines && restore && c->where; i++)
+			if (c->lines[i].cls.valid)
+				c->where[CACHE_KEY(c, c->lines[i].mem, c->lines[i].addr)] = i + 1;
+	}
+	if ((c = z8->cache_top[PROG]) == NULL || c->pf == NULL)
+		return;
+	lines = c->cfg->size / c->cfg->line;
+	part[0] = (char *) c->pf->ready; len[0] = lines * sizeof(unsigned long);
+	part[1] = (char *) &c->pf->busy; len[1] = sizeof(unsigned long);
+	part[2] = (char *) &c->pf->last; len[2] = sizeof(unsigned);
+	part[3] = (char *) &c->pf->stride; len[3] = sizeof(unsigned);
+	for (i=0; i<4; buf += len[i], i++)
+		if (restore)
+			memcpy(part[i], buf, len[i]);
+		else
+			memcpy(buf, part[i], len[i]);
 }
-break;
+
+/* Cache report (-R)
+   - the counters in each level's stat are kept for every run. -R also 
+     sorts the misses by cause and by instruction and prints them all at
+     the end of the run
+   - a miss is compulsory the first time its line is used, a capacity 
+     miss if a fully associative LRU cache of as many lines would have 
+     missed as well (the line is not in det's stack) and a conflict
+     miss otherwise
+*/
+#define CACHE_REPORT_PCS 10   /* instructions with the most misses shown */
+
+int cache_reporting;     /* -R */
+
+void cache_detail_init(struct cache *c)
+{
+	unsigned keys = CACHE_KEYS(c);
+
+	if (c->det == NULL)
+	{
+		if ((c->det = calloc(1, sizeof(struct cache_detail))) == NULL
+		    || (c->det->older = malloc(2 * keys * sizeof(unsigned))) == NULL
+		    || (c->det->state = malloc(keys)) == NULL
+		    || (c->det->misses_at = malloc(PD_MEMSZ * sizeof(unsigned long))) == NULL)
+		{
+			printf("No memory for the cache report\n");
+			exit(0);
+		}
+		c->det->newer = c->det->older + keys;
+	}
+	c->det->count = 0;
+	memset(c->det->state, 0, keys);
+	memset(c->det->misses_at, 0, PD_MEMSZ * sizeof(unsigned long));
 }
+
+/* sort out an access to line x of c (a miss if miss) and move x to the 
+   top of the fully associative stack */
+void cache_classify(struct cache *c, unsigned x, int miss)
+{
+	struct cache_detail *det = c->det;
+	unsigned lru;
+
+	if (miss)
+	{
+		if (!(det->state[x] & CD_SEEN))
+			c->stat.compulsory++;
+		else if (det->state[x] & CD_HELD)
+			c->stat.conflict++;
+		else
+			c->stat.capacity++;
+		det->misses_at[z8->inst_pc]++;
+	}
+	if (det->state[x] & CD_HELD)
+	{
+		if (det->head == x)
+			return;
+		/* take x out - the stack below the tail is not followed */
+		if (det->tail == x)
+			det->tail = det->newer[x];
+		else{
+			det->newer[det->older[x]] = det->newer[x];
+			det->older[det->newer[x]] = det->older[x];
+		}
+	}
+	else{
+		if (det->count == c->cfg->size / c->cfg->line)
+		{
+			/* full - the least recently used line drops out */
+			lru = det->tail;
+			det->state[lru] &= ~CD_HELD;
+			det->tail = det->newer[lru];
+			det->count--;
+		}
+		if (det->count++ == 0)
+			det->head = det->tail = x;
+		det->state[x] |= CD_SEEN | CD_HELD;
+	}
+	if (det->head != x)
+	{
+		det->older[x] = det->head;
+		det->newer[det->head] = x;
+		det->head = x;
+	}
 }
-break;
+
+/* counters of each level for the run on out, then the instructions with 
+   the most misses - tag naming the run (if any) */
+void cache_report(FILE *out, char *tag)
+{
+	unsigned long shown[CACHE_REPORT_PCS];
+	unsigned i, n, at, lv;
+	WORD best[CACHE_REPORT_PCS];
+	struct cache *c;
+
+	if (!cache_reporting)
+		return;
+#ifdef CORPUS_RUNNER
+	flockfile(out);
+#endif
+	for (lv=0; lv<CACHE_LEVELS; lv++)
+	{
+		if ((c = &z8->caches[lv])->lines == NULL)
+			continue;
+		fprintf(out, "cache: %s%slevel=%s size=%u line=%u ways=%u policy=%s alloc=%s replace=%s latency=%u "
+		        "rd_hits=%lu rd_misses=%lu wr_hits=%lu wr_misses=%lu write_backs=%lu evictions=%lu "
+		        "compulsory=%lu capacity=%lu conflict=%lu\n",
+		        tag ? tag : "", tag ? " " : "", cache_name[lv], c->cfg->size, c->cfg->line, c->cfg->ways,
+		        c->cfg->write_back ? "wb" : "wt", c->cfg->write_alloc ? "wa" : "nwa", 
+		        cache_policy_name[c->cfg->replace], c->cfg->latency,
+		        c->stat.rd_hits, c->stat.rd_misses, c->stat.wr_hits, c->stat.wr_misses,
+		        c->stat.write_backs, c->stat.evictions, 
+		        c->stat.compulsory, c->stat.capacity, c->stat.conflict);
+		/* insertion sort into the few kept */
+		for (at=0, n=0; at<PD_MEMSZ; at++)
+		{
+			if (c->det->misses_at[at] == 0 
+			    || (n == CACHE_REPORT_PCS && c->det->misses_at[at] <= shown[n-1]))
+				continue;
+			for (i = (n < CACHE_REPORT_PCS) ? n++ : n-1; i>0 && shown[i-1] < c->det->misses_at[at]; i--)
+			{
+				shown[i] = shown[i-1];
+				best[i] = best[i-1];
+			}
+			shown[i] = c->det->misses_at[at];
+			best[i] = at;
+		}
+		for (i=0; i<n; i++)
+			fprintf(out, "cache_pc: %s%slevel=%s pc=%04x misses=%lu\n", tag ? tag : "", tag ? " " : "", 
+			        cache_name[lv], best[i], shown[i]);
+		if (c->cfg->buf_depth)
+			fprintf(out, "cache_buf: %s%slevel=%s depth=%u drain=%u combine=%s buffered=%lu combined=%lu "
+			        "stalls=%lu stall_cycles=%lu avg_occupancy=%.2f max_occupancy=%lu\n", 
+			        tag ? tag : "", tag ? " " : "", cache_name[lv], c->cfg->buf_depth, c->cfg->drain,
+			        c->cfg->combine ? "wc" : "nwc", c->stat.buffered, c->stat.combined, 
+			        c->stat.buf_stalls, c->stat.stall_cycles, 
+			        c->stat.buffered ? (double) c->stat.occupancy / c->stat.buffered : 0.0,
+			        c->stat.occupancy_max);
+	}
+	if ((c = z8->cache_top[PROG]) != NULL && c->pf)
+	{
+		fprintf(out, "cache_pf: %s%slevel=%s kind=%s degree=%u issued=%lu useful=%lu unused=%lu late=%lu "
+		        "late_cycles=%lu accuracy=%.3f coverage=%.3f timeliness=%.3f\n",
+		        tag ? tag : "", tag ? " " : "", cache_name[c - z8->caches], prefetch_name[prefetch_cfg.kind],
+		        prefetch_cfg.degree, c->pf->issued, c->pf->useful, c->pf->unused, c->pf->late,
+		        c->pf->late_cycles, 
+		        c->pf->issued ? (double) c->pf->useful / c->pf->issued : 0.0,
+		        c->pf->useful ? (double) c->pf->useful / (c->pf->useful + c->stat.rd_misses) : 0.0,
+		        c->pf->useful ? (double) (c->pf->useful - c->pf->late) / c->pf->useful : 0.0);
+	}
+	fprintf(out, "cache: %s%slevel=mem latency=%u\n", tag ? tag : "", tag ? " " : "", mem_latency);
+#ifdef CORPUS_RUNNER
+	funlockfile(out);
+#endif
 }
 
-temp = a1 + numb;
-ans =  temp;
+/* Stack distance profile (-M)
+   - every address cache() is asked for is also put through Mattson's 
+     stack algorithm: each set keeps its lines most recently used first
+     and the distance of an access is the number of other lines of its
+     set used since the last access to its line. An LRU cache of that 
+     many sets hits exactly when it has more ways than the distance, so 
+     one run gives the hits of every associativity
+   - distances are kept for 1, 2, 4 .. 2^(PROFILE_SETS-1) sets of lines of
+     cache_cfg[L1I].line bytes. Finding a line costs its distance, at most 
+     PROFILE_DEPTH steps
+   - like cache(), only sees what goes through it - the block and JIT 
+     engines fetch predecoded instructions without it
+*/
+#define PROF_NONE   ((unsigned) -1)
 
-/************* SET FLAGS ***************/
-/* carry */
-carry = (CARRY(temp)>>8); // determine if there is a carry */
-write_rm(FLAGS, FLAG_C(carry));		// set carry 
+int cache_profiling;     /* -M */
 
-/* zero */
-zero = ZERO(ans);
-write_rm(FLAGS, FLAG_Z(zero));
+/* empty profile for the machine */
+void cache_profile_init()
+{
+	unsigned k, lines = PD_MEMSZ / cache_cfg[L1I].line;
 
-/* sign */
-sign = SIGN(ans);
-write_rm(FLAGS, FLAG_S(sign));
+	if (z8->cache_prof == NULL)
+	{
+		if ((z8->cache_prof = calloc(1, sizeof(struct stack_prof))) == NULL
+		    || (z8->cache_prof->older[0] = malloc(2 * PROFILE_SETS * lines * sizeof(unsigned))) == NULL
+		    || (z8->cache_prof->seen = malloc(lines)) == NULL)
+		{
+			printf("No memory for the stack distance profile\n");
+			exit(0);
+		}
+		for (k=0; k<PROFILE_SETS; k++)
+		{
+			z8->cache_prof->older[k] = z8->cache_prof->older[0] + 2 * k * lines;
+			z8->cache_prof->newer[k] = z8->cache_prof->older[k] + lines;
+		}
+	}
+	z8->cache_prof->refs = z8->cache_prof->cold = 0;
+	memset(z8->cache_prof->hist, 0, sizeof(z8->cache_prof->hist));
+	memset(z8->cache_prof->head, 0xff, sizeof(z8->cache_prof->head)); /* PROF_NONE */
+	memset(z8->cache_prof->seen, 0, lines);
+}
 
-return ans;
+void cache_profile(WORD mar)
+{
+	struct stack_prof *prof = z8->cache_prof;
+	unsigned x = mar / cache_cfg[L1I].line, k, d, y, *head;
+	int first = !prof->seen[x];
+
+	prof->seen[x] = TRUE;
+	prof->refs++;
+	if (first)
+		prof->cold++;
+	for (k=0; k<PROFILE_SETS; k++)
+	{
+		head = &prof->head[(1 << k) - 1 + (x & ((1 << k) - 1))];
+		if (!first)
+		{
+			for (d=0, y=*head; d<PROFILE_DEPTH && y != x; d++)
+				y = prof->older[k][y];
+			prof->hist[k][d]++;
+			if (d == 0)
+				continue; /* on top already */
+			/* take x out of the stack - it is not on top */
+			prof->older[k][prof->newer[k][x]] = prof->older[k][x];
+			if (prof->older[k][x] != PROF_NONE)
+				prof->newer[k][prof->older[k][x]] = prof->newer[k][x];
+		}
+		/* and put it on top */
+		prof->older[k][x] = *head;
+		prof->newer[k][x] = PROF_NONE;
+		if (*head != PROF_NONE)
+			prof->newer[k][*head] = x;
+		*head = x;
+	}
 }
 
-/* function handles condition codes and returns 0x01 and 0x00 for true and false respectively
-a1 holds the condition code value 
-called by JP and JR to check condition
+/* hits and misses of every write allocate LRU cache of the profiled 
+   sets and up to PROFILE_DEPTH ways, one line each on out - tag naming 
+   the run (if any) */
+void cache_profile_report(FILE *out, char *tag)
+{
+	unsigned k, d, ways;
+	unsigned long hits;
+
+	if (z8->cache_prof == NULL)
+		return;
+#ifdef CORPUS_RUNNER
+	flockfile(out);
+#endif
+	fprintf(out, "stack: %s%sline=%u refs=%lu cold=%lu\n", tag ? tag : "", tag ? " " : "",
+	        cache_cfg[L1I].line, z8->cache_prof->refs, z8->cache_prof->cold);
+	for (k=0; k<PROFILE_SETS; k++)
+		for (ways=1, hits=0, d=0; ways<=PROFILE_DEPTH && (ways << k) * cache_cfg[L1I].line <= PD_MEMSZ; ways<<=1)
+		{
+			for (; d<ways; d++)
+				hits += z8->cache_prof->hist[k][d];
+			fprintf(out, "stack: %s%ssets=%u ways=%u bytes=%u hits=%lu misses=%lu\n", 
+			        tag ? tag : "", tag ? " " : "", 1 << k, ways, 
+			        (ways << k) * cache_cfg[L1I].line, hits, z8->cache_prof->refs - hits);
+		}
+#ifdef CORPUS_RUNNER
+	funlockfile(out);
+#endif
+}
+
+BYTE prog_mem_fetch()
+{
+/* Call bus to access next location in program memory
+   Use PC -- increment PC after access (points to next inst or next byte in 
+   current instruction)
+   Returns location as byte (mbr)
 */
-BYTE cond_handler(BYTE a1)
+BYTE mbr;  /* Memory buffer register */
+
+if (z8->fetch_ops)
 {
-BYTE ans;
-/* extracting the bits */
-carry = (read_rm(FLAGS) & 0x80) >>7;
-zero  = (read_rm(FLAGS) & 0x40) >>6;
-sign  = (read_rm(FLAGS) & 0x20) >>5;
-overflow = (read_rm(FLAGS) & 0x10) >>4;
-switch(a1){
-	case 0x00: /* always false */
-	ans = 0x00;
-	break;
-	
-	case 0x01: /* (S XOR V) = 1*/
-	ans = (sign^overflow)==0;
-	break;
-	
-	case 0x02: /*(Z OR (S XOR V))=1 */
-	ans = (zero|(sign^overflow))==1;
-	break;
-	
-	case 0x03: /* (C OR Z) =1*/
-	ans = ((carry | zero)==1);
-	break;
-	
-	case 0x04: /* V=1 */
-	ans = (overflow ==1);
-	break;
-	
-	case 0x05: /* S = 1*/
-	ans=(sign==1);
-	break;
-	
-	case 0x06: /* Z ==1*/
-	ans = (zero==1);
-	break;
-	
-	case 0x07: /* C==1 */
-	ans = (carry==1);
-	break;
-	
-	case 0x08: /* always true */
-	ans = 0x01;
-	break;
-	
-	case 0x09: /* (S XOR V) =0 */
-	ans = (sign^overflow)==0;
-	break;
-	
-	case 0x0A: /* (Z OR (S XOR V)) = 0 */	
-	ans = (zero|(sign^overflow))==0;
-	break;
-	
-	case 0x0B: /* ((C=0) AND (Z=0)) =1 */
-	ans = ((carry==0)&(zero==0))==1;
-	break;
-	
-	case 0x0C: /* V=0 */
-	ans = (overflow==0);
-	break;
-	
-	case 0x0D: /* S = 0 */
-	ans = (sign==0);
-	break;
-	
-	case 0x0E: /* Z = 0 */
-	ans = (zero ==0);
-	break;
-	
-	case 0x0F: /* C = 0 */
-	ans = (carry==0);
-	break;
+	/* executing a predecoded instruction - operands already fetched */
+	mbr = *z8->fetch_ops++;
+	pc = pc + 1;
+	return mbr;
 }
 
-sys_clock +=10;
-#ifdef JUMP
-if(ans)
+////////////changes//////////////////
+mbr = cache_fetch(pc);
+////////////////////////////////////
+//bus(pc, &mbr, RD, PROG);
+
+pc = pc + 1;
+#ifdef PCwatch
+printf("Program counter is : %x \n", pc);
+#endif
+return mbr;
+}
+
+BYTE read_dm(WORD addr)
 {
-	printf("condition is true \n");
+/* Call bus (through the data caches, if any) to access addr location in
+the data memory 
+return content of the memory location as BYTE 
+*/
+BYTE mbr; /* Memory buffer register */
+
+if (z8->cache_top[DATA])
+     cache_access(z8->cache_top[DATA], DATA, addr, &mbr, 1, RD);
+else
+     bus(addr, &mbr, RD, DATA);
+
+return mbr;
 }
-else{
-	printf("condition is false \n");
+
+#ifdef CHECKED_WRITES
+/* read back a store of value to addr - from the cache that holds it, 
+   else primary memory, without counting as an access */
+void store_check(enum MEM mem, WORD addr, BYTE value)
+{
+BYTE mbr;
+
+cache_peek(z8->cache_top[mem], mem, addr, &mbr);
+z8->store_checks++;
+if (mbr != value)
+     z8->store_errors++;
 }
 #endif
-return ans;
+
+BYTE write_dm(WORD addr, BYTE dat)
+{
+/*Call bus (through the data caches, if any) to access addr location in
+ data memory - writes a BYTE dat to it
+ returns the byte written
+ CHECKED_WRITES reads it back and counts a mismatch (ROM, 
+ hole or device) in store_errors */
+ if (z8->cache_top[DATA])
+     cache_access(z8->cache_top[DATA], DATA, addr, &dat, 1, WR);
+ else
+     bus(addr, &dat, WR, DATA);
+#ifdef CHECKED_WRITES
+ store_check(DATA, addr, dat);
+#endif
+ 
+return dat;	
 }
 
 
-/* Interrupt Group functions */
+BYTE read_pm(WORD addr)
+{/* calls bus to read addr location in program memory
+returns a BYTE which is the memory location content
+*/
+ 
+BYTE mbr;
+/////////////changes/////////////
+mbr = cache_fetch(addr);
+////////////////////////////////
 
-/* handling priorrity for interrupts of group A
-returns the index of the interrupt vector with the higher priority 
-returns ff if the IRQ bit of the both interrupts in the group is not set */
-BYTE group_A()
+//bus(addr, &mbr, RD, PROG);
+return mbr;
+}
+
+
+/* calls bus to write value to addr in program memory 
+returns the byte written - CHECKED_WRITES reads it back
+*/
+BYTE write_pm(WORD addr, BYTE value)
 {
-	BYTE ans = 0xff;
-#ifdef DEBUG
-printf("Group A \n");
-#endif
-	if(BIT_5(reg_mem[IPR].content))
-	{
-		/*call IRQ3 first 
-		call IRQ5 */
-		if (IRQ3 & reg_mem[IRQ].content)
-		//IRQ3 is set
-			ans = 0x03;
-		else if(IRQ5 & reg_mem[IRQ].content)
-		//IRQ5 is set
-			ans = 0x05;
-#ifdef DEBUG 
-printf(" IRQ3 > IRQ5 \n");
-#endif
-	}
-	else{
-		/* call IRQ5 first 
-		call IRQ3
-		*/
-		if(IRQ5 & reg_mem[IRQ].content)
-		//IRQ5 is set
-			ans = 0x05;
-		else if (IRQ3 & reg_mem[IRQ].content)
-		//IRQ3 is set
-			ans = 0x03;
-#ifdef DEBUG
-printf(" IRQ5 > IRQ3 \n");
+block_invalidate(addr); /* addr may hold predecoded code */
+z8->pm_writes++;
+///////////changes////////////////////
+cache(addr, &value, WR);
+#ifdef CHECKED_WRITES
+store_check(PROG, addr, value);
 #endif
-	}
-	return ans;
+/////////////////////////////////////
+//bus(addr, &value, WR, PROG);
+return value;
 }
 
-/* handling priorrity for interrupts of group B */
-BYTE group_B()
+/* operand fetch for the two operand instructions, one function per
+addressing mode. Each returns the source value, passes back the destination
+address in reg_mem and increments sys_clock as per addressing mode.
+Called by get_args() and directly by the table dispatch handlers */
+BYTE args_r_r(BYTE* dest)
 {
-	BYTE ans=0xff;
-#ifdef DEBUG
-printf("Group B \n");
-#endif
-	if (BIT_2(reg_mem[IPR].content))
-	{
-		/* call IRQ0 first 
-		call IRQ2
-		*/
-		if (IRQ0 & reg_mem[IRQ].content)
-		{// if IRQ0 bit is set
-			ans = 0x00; // IRQ0
-		}
-		else if (IRQ2 & reg_mem[IRQ].content){
-			ans = 0x02; //IRQ2
-		}
-#ifdef DEBUG 
-printf(" IRQ0 > IRQ2 \n");
-#endif
-	}
-	else {
-		/* call IRQ2 
-		call IRQ0
-		*/
-		if (IRQ2 & reg_mem[IRQ].content){
-			ans = 0x02; //IRQ2
-		}
-		else if (IRQ0 & reg_mem[IRQ].content)
-		{// if IRQ0 bit is set
-			ans = 0x00; // IRQ0
-		}
-#ifdef DEBUG 
-printf(" IRQ2 > IRQ0 \n");
-#endif
-	}
-	return ans;
+BYTE src;
+BYTE dst;
+dst= prog_mem_fetch();
+src =dst;
+src = WORK_RD(LSN(src)); // source's value is the content of reg_mem
+dst = RPBLK|MSN(dst); // destination's address is the working register
+/* increment system clock */
+sys_clock += 0x06; /* increments sys_clock by number of cycles = 0x06 */
+*dest = dst;
+return src;
 }
 
-/* handling priority for interrupts of group C */
-BYTE group_C()
+BYTE args_r_Ir(BYTE* dest)
 {
-	BYTE ans = 0xff; 
-#ifdef DEBUG
-printf("Group C \n");
-#endif
-	if(BIT_1(reg_mem[IPR].content))
-	{
-		/* call IRQ4 first 
-		call IRQ1
-		*/
-		if (IRQ4 & reg_mem[IRQ].content){
-			ans = 0x04; //IRQ4
-		}
-		else if (IRQ1 & reg_mem[IRQ].content)
-		{// if IRQ0 bit is set
-			ans = 0x01; // IRQ1
-		}
-	#ifdef DEBUG 
-	printf("IRQ4 > IRQ1 \n");
-	#endif
-	}
-	else {
-		/* call IRQ1 first 
-		then call IRQ4 
-		*/
-		if (IRQ1 & reg_mem[IRQ].content)
-		{// if IRQ0 bit is set
-			ans = 0x01; // IRQ1
-		}
-		else if (IRQ4 & reg_mem[IRQ].content){
-			ans = 0x04; //IRQ4
-		} 
-	#ifdef DEBUG 
-	printf(" IRQ1 > IRQ4 \n");
-	#endif
-	}
-	return ans;
+BYTE src;
+BYTE dst;
+dst = prog_mem_fetch();
+src=dst;
+src = read_rm(RPBLK|WORK_RD(LSN(src))); // source's value is the content of the location the adrress is pointing to
+dst = RPBLK|MSN(dst); // destination address is a working register
+/* increment system clock */
+sys_clock += 0x06; // 6 cycles 
+*dest = dst;
+return src;
 }
 
-/* Polling function 
-returns the byte of the most */
-BYTE polling()
+BYTE args_R_R(BYTE* dest)
 {
-BYTE retval; // holds the return value
-BYTE prt1, prt2,prt3; // holds byte from lowest to highest priority
-BYTE temp;
-temp = BIT_4(reg_mem[IPR].content)<<2|BIT_3(reg_mem[IPR].content)<<1|BIT_0(reg_mem[IPR].content);
-switch(temp)
+BYTE src;
+src = read_rm(prog_mem_fetch());
+*dest = prog_mem_fetch();
+/* increment system clock */
+sys_clock += 0x0A; // 10 cycles
+return src;
+}
+
+BYTE args_R_IR(BYTE* dest)
 {
-	case 0x00:	/* reserved */
-	#ifdef DEBUG 
-	printf(" RESERVED 1 \n");
-	#endif	
-	break;
-	
-	case 0x01: 	/* c>a>b */
-	prt3=group_C();
-	prt2=group_A();
-	prt1=group_B();
-	break;
-	
-	case 0x02: /* A>B>C */
-	prt3=group_A();
-	prt2=group_B();
-	prt1=group_C();
-	break;
-	
-	case 0x03: /* A>C>B */
-	prt3=group_A();
-	prt2=group_C();
-	prt1=group_B();
-	break;
-	
-	case 0x04: /* B>C>A */
-	prt3=group_B();
-	prt2=group_C();
-	prt1=group_A();
-	break;
-	
-	case 0x05: /* C>B>A */
-	prt3=group_C();
-	prt2=group_B();
-	prt1=group_A();
-	break;
-	
-	case 0x06: /* B>A>C */
-	prt3=group_B();
-	prt2=group_A();
-	prt1=group_C();
-	break;
-	
-	case 0x07: /* reserved */
-	
-	#ifdef DEBUG 
-	printf("RESERVED 2 \n");
-	#endif
-		
-	break;
+BYTE src;
+src = read_rm(read_rm(prog_mem_fetch()));
+*dest = prog_mem_fetch();
+/* increment system clock */
+sys_clock += 0x0A; // 10 cycles
+return src;
 }
 
-if ((BIT_7(reg_mem[IPR].content) | BIT_6(reg_mem[IPR].content))==0){
-	/* reserved */
-	#ifdef DEBUG
-	printf("RESERVED 3 \n");
-	#endif
+BYTE args_R_IM(BYTE* dest)
+{
+*dest = prog_mem_fetch();
+/* increment system clock */
+sys_clock +=0x0A; // 10 cycles
+return prog_mem_fetch();
 }
-/* if prt3 does not hold ff, retval= prt3, else if prt2 does not hold ff , retval = prt2, else retval = prt3 */
-if(prt3 != 0xff)
-retval = prt3;
-else if(prt2 != 0xff)
-retval = prt2;
-else
-retval = prt1;
 
-return retval;
+BYTE args_IR_IM(BYTE* dest)
+{
+*dest = read_rm(prog_mem_fetch());
+/* increment system clock */
+sys_clock +=0x0A; // 10 cycles
+return prog_mem_fetch();
 }
 
- 
-/* VEIW MEMORY */
+/* get address of destination in register memory
+and returns the dest addr and the source value 
+Increments system clock by number_of_cycles as per addressing mode
+number_of_cycles is thesame for all instructions that call the function 
+*/
+BYTE get_args(BYTE lnib, BYTE* dest)
+{
+BYTE src;
+BYTE dst;
+#ifdef get_args_TEST
+printf("Get ARGS called \n");
+#endif
+switch(lnib){
+case 0x02: /* r_r */
+src = args_r_r(&dst);
+break;
 
-test_prog()
+case 0x03: /* r_Ir*/
+src = args_r_Ir(&dst);
+break;
+
+case 0x04: /* R_R */
+src = args_R_R(&dst);
+break;
+
+case 0x05: /* R_IR */
+src = args_R_IR(&dst);
+break;
+
+case 0x06: /* R_NUM*/
+src = args_R_IM(&dst);
+break;
+
+case 0x07: /* IR_NUM */
+src = args_IR_IM(&dst);
+break;
+}
+
+#ifdef get_args_TEST
+printf("Dst reg : %2x, src value: %2x \n", dst, src);
+#endif
+
+*dest = dst; // pass location of dst in reg_mem
+return src;	// return the value of source obtained from reg_mem
+}
+
+/* get dst address for the single operand instructions, R and IR modes 
+Increments sys_clock by base value of 6 cycles */
+BYTE args_R()
 {
-	#ifdef VEIW_PROG_MEM
-	printf(" program counter holds : %x \n", pc);
-	int laddr = pc;
-	int i;
-	for (i=0; i<0x27; i++)
-	{
-		printf(" PROG mem loc %x contains %x BYTE \n", laddr, memory[PROG][laddr]);
-		laddr++;
-	}
+	/* increment system clock */
+	sys_clock +=6; // 6 cycles 
+	return prog_mem_fetch();
+}
+
+BYTE args_IR()
+{
+	/* increment system clock */
+	sys_clock +=6; // 6 cycles 
+	return read_rm(prog_mem_fetch());
+}
+
+/*	get dst address for instructions with 0 and 1 low nib DEC, RLC, SWAP etc 
+returns dst index
+Increments sys_clock by base value of 6 cycles	*/
+BYTE get_args_2(BYTE lnib)
+{
+	BYTE ans;
+	#ifdef get_args_2_TEST
+	printf(" low nibble is : %2x \n", lnib);
 	#endif
-	#ifdef VEIW_STACK
-	printf("stack holds : ");
-	WORD i;
-	for (i=SP; (i!= 0 )&&(i<0xffff); i++)
+	switch (lnib)
 	{
-		printf("%2x ", read_dm(i));
+		case 0x00:	// R
+		ans = args_R();
+		break;
+		
+		case 0x01:	//IR
+		ans = args_IR();
+		break;
 	}
-	printf("%2x ", read_dm(i));
-	printf("\n");
-	#endif
+#ifdef get_args_2_TEST
+printf("Dst reg : %2x \n", ans);
+#endif
+	return ans;
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////
-
-void run_machine()
-{
-/* Z8 machine emulator
-   instruction fetch, decode, and execute 
-*/
-BYTE inst;       /* Current instruction */
-BYTE src;        /* SRC operand - read if needed */
-BYTE dst;        /* DST operand - read if needed */
-BYTE regval;	 /* temp to emulate OR instruction */
-BYTE high_nib;   /* MS nibble of instruction */
-BYTE low_nib;    /* LS nibble of instruction */
-int running;     /* TRUE until STOP instruction */
-int sanity;      /* Limit on number of instruction cycles */
-WORD dest;		 /*	for 16 bit addressing, in case on DA, IRR and @IRR */
-WORD temp;
-running = TRUE;
-sanity = 0;
 
-BYTE tcount; // number of true instruction 
-BYTE fcount; // number of false instructions
-BYTE cexec; // 1 execute true part 0 exec false part
-BYTE tempflags; // temp variable to hold the flag until the emulator is done excuting conditional statements
 
-#ifdef IE_TEST
-write_rm(IMR, INT_ENA | IRQ0); /* PORT 0 interrupts allowed */
-write_rm(IRQ, 0);              /* No pending interrupt requests */
+/* function does the addition of a dst and src 
+ all flag manipulations are performed in the function
+ a1 holds destination value
+ a2 holds source value 
+ a3 is 1, for ADD with carry OR 0 for not with carry 
+ */
+BYTE adder (BYTE a1, BYTE a2, BYTE a3)
+{
+	BYTE ans;
+	CARRY_BYTE temp;
+	temp = a1+a2+a3;
+	ans = temp;	
+	
+#ifdef LAZY_FLAGS
+	carry = (CARRY(temp)>>8);
+	half_carry = (HALF_CARRY(ans)!=HALF_CARRY(a1));
+	z8->lazy_op = LAZY_ADD;
+	z8->lazy_a1 = a1;
+	z8->lazy_ans = ans;
+	z8->lazy_temp = temp;
+	return ans;
+#endif
+	/************* SET FLAGS ***************/
+	/* carry */
+	carry = (CARRY(temp)>>8); // determine if there is a carry */
+	write_rm(FLAGS, FLAG_C(carry));		// set carry 
+	
+	/* zero */
+	zero = ZERO(ans);
+	write_rm(FLAGS, FLAG_Z(zero));
+	
+	/* sign */
+	sign = SIGN(ans);
+	write_rm(FLAGS, FLAG_S(sign));
+	
+	/* overflow */
+	overflow = (SIGN(a1) != sign);
+	write_rm(FLAGS, FLAG_V(overflow));
+	
+	/* decimal adjust */
+	decimal_adjust=0;
+	write_rm(FLAGS, FLAG_D(decimal_adjust));
+	
+	/* half carry */
+	half_carry = (HALF_CARRY(ans)!=HALF_CARRY(a1));
+	write_rm(FLAGS, FLAG_H(half_carry));
+	
+#ifdef adder_TEST
+	printf ("result of %2x + %2x (with carry = %2x): %x \n", a1, a2, a3, ans);
+	printf ("FLAGS : %x \n", read_rm(FLAGS));
 #endif
+	return ans;
+}
 
-while (running && sanity < 30)
+/* function does subtraction of src from dst
+all flag manipulations are done in the function
+a1 holds the value of destination 
+a2 holds the value of src 
+a3 holds carry for subtractions with carry 
+returns the result of subtraction
+*/
+BYTE subber (BYTE a1, BYTE a2, BYTE a3)
 {
-#ifdef IE_TEST
-printf("Time: %02d  IRQ: %02x\n", sys_clock, reg_mem[IRQ] . content);
+	BYTE ans;
+	CARRY_BYTE temp;
+	temp = a1 - a2 - a3;
+	ans = temp;
+	#ifdef flags_test
+	printf ("result : %x \n", ans);
+	#endif
+#ifdef LAZY_FLAGS
+	carry = !(CARRY(temp)>>8);
+	half_carry = !(HALF_CARRY(ans)!=HALF_CARRY(a1));
+	z8->lazy_op = LAZY_SUB;
+	z8->lazy_a1 = a1;
+	z8->lazy_ans = ans;
+	z8->lazy_temp = temp;
+	return ans;
+#endif
+	/************* SET FLAGS ***************/
+	/* carry */
+	carry = !(CARRY(temp)>>8); // determine if there is a carry
+	
+#ifdef flags_test
+printf("carry is %x \n", carry);
+#endif
+	write_rm(FLAGS, FLAG_C(carry));		// set carry 
+	
+	/* zero */
+	zero = ZERO(ans);
+	write_rm(FLAGS, FLAG_Z(zero));
+#ifdef flags_test
+printf("zero is %x \n", zero);
 #endif
 
-     
-/* Get next instruction and extract nibbles */
-#ifdef WATCH
-printf("Program counter holds : %x \n", pc);
+	/* sign */
+	sign = SIGN(ans);
+	write_rm(FLAGS, FLAG_S(sign));
+#ifdef flags_test
+printf("sign is %x \n", sign);
 #endif
-     inst = prog_mem_fetch();
-     high_nib = MSN(inst);
-     low_nib = LSN(inst);
-     
-     /* Check for special cases: 
-        - lnib: 0x08 through 0x0E - r or cc in hnib 
-        - lnib: 0x0F - no-operand instructions */
-     if (low_nib >= 0x08)
-     {
-          /* LD through INC and some no-operand instructions */
-          switch(low_nib)
-          {
-          case 0x08: /* LD dst , src  r,R */
-          dst = RPBLK | high_nib;
-          src = read_rm(prog_mem_fetch()); // src value
-          /*dst <-- src*/
-          write_rm(dst, src);
-          sys_clock +=6; // 6 cycles 
-          break;
-          
-		  case 0x09: /* LD dst, src  R,r */
-		  src = read_rm(RPBLK|high_nib);
-		  dst = prog_mem_fetch();
-		  /*dst <-- src*/
-		  write_rm(dst, src);
-		  sys_clock +=6; // 6 cycles
-		  break;
-		  	
-		  case 0x0A: /* DJNZ r, dst */
-               dst = prog_mem_fetch();
-               src = RPBLK|high_nib;
-               regval = read_rm(src);
-               regval -= 1;
-               if (regval != 0)
-               {
-               	/* Reg != 0 -- repeat loop */
-               /* Signed extend dst to 16 bits if -ve */
-               pc = pc + SIGN_EXT(dst);
-               #ifdef JUMP
-	  			printf("pc after jump is : %x \n", pc);
-	  			printf("contents of prog mem(pc) is %x \n", read_pm(pc));
-	  			#endif
-	  			/***********IF ADDITION *************/
-				tcount =0;
-				fcount=0;
-				cexec=0;
-				#ifdef IF_TEST
-                printf("flow of control tcount: %x fcount: %x cexec: %x \n", tcount, fcount, cexec);
-                #endif
-				/***********************************/ 
-               sys_clock +=2;
-               }
-                write_rm(src, regval);
-                sys_clock +=10; // total of 12 cycles if JUMP is taken 
-               break;
-               
-		  case 0x0B: /* JR cc,RA */
-		  		dst = prog_mem_fetch(); // RA
-		  		if(cond_handler(high_nib)){
-		  			#ifdef JUMP
-		  			printf("pc before jump is : %x \n", pc);
-		  			printf("contents of prog mem(pc) is %x \n", read_pm(pc));
-		  			#endif
-		  			pc = pc + SIGN_EXT(dst);
-		  			#ifdef JUMP
-		  			printf( "JUMP TAKEN: "
-					  		"dst = %x , pc = %x \n", dst, pc);
-					  		printf("contents of prog mem(pc) is %x \n", read_pm(pc));
-					#endif
-					/***********IF ADDITION *************/
-					tcount =0;
-					fcount=0;
-					cexec=0;
-					#ifdef IF_TEST
-	                printf("flow of control tcount: %x fcount: %x cexec: %x \n", tcount, fcount, cexec);
-	                #endif
-					/***********************************/ 
-		  			sys_clock += 2; // total of 12 cycles if jump is taken 
-		  		}
-		  	   break;
-               
-          case 0x0C: /* LD dst, IMM */
-               dst = prog_mem_fetch();
-               write_rm((RPBLK|high_nib), dst);
-               sys_clock +=6; // 6 cycles 
-               break;
-               
+	
+	/* overflow */
+	overflow = (SIGN(a1) != sign);
+	write_rm(FLAGS, FLAG_V(overflow));
+#ifdef flags_test
+	printf("Overflow is : %2x \n", overflow);
+#endif
+	/* decimal adjust */
+	decimal_adjust=0x01;
+	write_rm(FLAGS, FLAG_D(decimal_adjust));
+#ifdef flags_test
+printf ("decimal adjust is : %x \n", decimal_adjust);
+#endif
+	
+	/* half carry */
+	half_carry = !(HALF_CARRY(ans)!=HALF_CARRY(a1));
+#ifdef flags_test
+printf("half carry is : %x \n", half_carry);
+#endif
+
+	write_rm(FLAGS, FLAG_H(half_carry));	
+#ifdef flags_test
+printf( "FLAGS : %x \n", read_rm(FLAGS));
+#endif
+	return ans;
+}
+
+/* adjust_dec function called by the decimal adjust (DA) instruction
+sets all affected flags in function 
+a1 holds the destination value 
+returns the value of the adjusted dst */
+BYTE adjust_dec(BYTE a1)
+{
+BYTE ans;
+CARRY_BYTE temp;
+BYTE numb = 0; // number to be added to BYTE - 0 for combinations not in the table
+
+switch (half_carry){
+case 0x00:
+if(LSN(a1)<=0x09){ //unsigned char no need to check for lower bound of 0
+	switch(carry){
+	case 0x00: 
+	if (MSN(a1)<=0x09)
+	{
+		numb =0x00;
+	}else{ /*MSN : A-F */
+		numb =0x06;
+	}
+	break;
+	
+	case 0x01:
+	if(MSN(a1)<=0x02){
+		numb =0x60;
+	}
+	else if(MSN(a1)>=0x07 && MSN(a1)<=0x0F){
+		numb =0XA0;
+	}
+	break;
+	}
+}
+else /* LSN : A-F*/
+{
+	switch(carry){
+		case 0x00:
+		if(MSN(a1)<=0x08){
+			numb = 0x06;
+		}
+		else{
+			numb = 0x66;
+		}
+		break;
+		case 0x01:
+		if(MSN(a1)<=0x02){
+			numb =0x66;
+		}
+		break;
+	}
+}
+break;
+
+case 0x01:
+if(LSN(a1)<=0x03){	
+switch (carry){	
+case 0x00:
+if(MSN(a1)<=0x09){
+	numb =0x06;
+}
+else{
+	numb = 0x66;
+}
+break;
+
+case 0x01:
+if(MSN(a1)>=0x03){
+	numb = 0x66;
+}
+break;	
+}
+}
+
+else if(LSN(a1)>= 0x06 && LSN(a1)<=0x0F){
+switch (carry){
+case 0x00:
+if (MSN(a1)<=0x08){
+	numb = 0xFA;
+}
+break;
+case 0x01:
+if(MSN(a1)>= 0x06 && MSN(a1)<= 0x0F){
+	numb = 0x9A;
+}
+break;
+}
+}
+break;
+}
+
+temp = a1 + numb;
+ans =  temp;
+
+/************* SET FLAGS ***************/
+/* carry */
+carry = (CARRY(temp)>>8); // determine if there is a carry */
+write_rm(FLAGS, FLAG_C(carry));		// set carry 
+
+/* zero */
+zero = ZERO(ans);
+write_rm(FLAGS, FLAG_Z(zero));
+
+/* sign */
+sign = SIGN(ans);
+write_rm(FLAGS, FLAG_S(sign));
+
+return ans;
+}
+
+/* condition code a1 against flags value f - returns 0x01 and 0x00 for 
+true and false respectively */
+BYTE cond_true(BYTE a1, BYTE f)
+{
+BYTE ans;
+BYTE c, z, s, v; /* C, Z, S and V bits */
+/* extracting the bits */
+c = (f & 0x80) >>7;
+z  = (f & 0x40) >>6;
+s  = (f & 0x20) >>5;
+v = (f & 0x10) >>4;
+switch(a1){
+	case 0x00: /* always false */
+	ans = 0x00;
+	break;
+	
+	case 0x01: /* (S XOR V) = 1*/
+	ans = (s^v)==0;
+	break;
+	
+	case 0x02: /*(Z OR (S XOR V))=1 */
+	ans = (z|(s^v))==1;
+	break;
+	
+	case 0x03: /* (C OR Z) =1*/
+	ans = ((c | z)==1);
+	break;
+	
+	case 0x04: /* V=1 */
+	ans = (v ==1);
+	break;
+	
+	case 0x05: /* S = 1*/
+	ans=(s==1);
+	break;
+	
+	case 0x06: /* Z ==1*/
+	ans = (z==1);
+	break;
+	
+	case 0x07: /* C==1 */
+	ans = (c==1);
+	break;
+	
+	case 0x08: /* always true */
+	ans = 0x01;
+	break;
+	
+	case 0x09: /* (S XOR V) =0 */
+	ans = (s^v)==0;
+	break;
+	
+	case 0x0A: /* (Z OR (S XOR V)) = 0 */	
+	ans = (z|(s^v))==0;
+	break;
+	
+	case 0x0B: /* ((C=0) AND (Z=0)) =1 */
+	ans = ((c==0)&(z==0))==1;
+	break;
+	
+	case 0x0C: /* V=0 */
+	ans = (v==0);
+	break;
+	
+	case 0x0D: /* S = 0 */
+	ans = (s==0);
+	break;
+	
+	case 0x0E: /* Z = 0 */
+	ans = (z ==0);
+	break;
+	
+	case 0x0F: /* C = 0 */
+	ans = (c==0);
+	break;
+}
+
+return ans;
+}
+
+/* function handles condition codes and returns 0x01 and 0x00 for true and false respectively
+a1 holds the condition code value 
+called by JP and JR to check condition
+*/
+BYTE cond_handler(BYTE a1)
+{
+BYTE ans;
+/* extracting the bits */
+carry = (read_rm(FLAGS) & 0x80) >>7;
+zero  = (read_rm(FLAGS) & 0x40) >>6;
+sign  = (read_rm(FLAGS) & 0x20) >>5;
+overflow = (read_rm(FLAGS) & 0x10) >>4;
+ans = cond_true(a1, reg_mem[FLAGS]);
+
+sys_clock +=10;
+#ifdef JUMP
+if (batch)
+	;
+else if(ans)
+{
+	printf("condition is true \n");
+}
+else{
+	printf("condition is false \n");
+}
+#endif
+return ans;
+}
+
+
+/* Interrupt Group functions */
+
+/* handling priorrity for interrupts of group A
+returns the index of the interrupt vector with the higher priority 
+returns ff if the IRQ bit of the both interrupts in the group is not set */
+BYTE group_A()
+{
+	BYTE ans = 0xff;
+#ifdef DEBUG
+printf("Group A \n");
+#endif
+	if(BIT_5(reg_mem[IPR]))
+	{
+		/*call IRQ3 first 
+		call IRQ5 */
+		if (IRQ3 & reg_mem[IRQ])
+		//IRQ3 is set
+			ans = 0x03;
+		else if(IRQ5 & reg_mem[IRQ])
+		//IRQ5 is set
+			ans = 0x05;
+#ifdef DEBUG 
+printf(" IRQ3 > IRQ5 \n");
+#endif
+	}
+	else{
+		/* call IRQ5 first 
+		call IRQ3
+		*/
+		if(IRQ5 & reg_mem[IRQ])
+		//IRQ5 is set
+			ans = 0x05;
+		else if (IRQ3 & reg_mem[IRQ])
+		//IRQ3 is set
+			ans = 0x03;
+#ifdef DEBUG
+printf(" IRQ5 > IRQ3 \n");
+#endif
+	}
+	return ans;
+}
+
+/* handling priorrity for interrupts of group B */
+BYTE group_B()
+{
+	BYTE ans=0xff;
+#ifdef DEBUG
+printf("Group B \n");
+#endif
+	if (BIT_2(reg_mem[IPR]))
+	{
+		/* call IRQ0 first 
+		call IRQ2
+		*/
+		if (IRQ0 & reg_mem[IRQ])
+		{// if IRQ0 bit is set
+			ans = 0x00; // IRQ0
+		}
+		else if (IRQ2 & reg_mem[IRQ]){
+			ans = 0x02; //IRQ2
+		}
+#ifdef DEBUG 
+printf(" IRQ0 > IRQ2 \n");
+#endif
+	}
+	else {
+		/* call IRQ2 
+		call IRQ0
+		*/
+		if (IRQ2 & reg_mem[IRQ]){
+			ans = 0x02; //IRQ2
+		}
+		else if (IRQ0 & reg_mem[IRQ])
+		{// if IRQ0 bit is set
+			ans = 0x00; // IRQ0
+		}
+#ifdef DEBUG 
+printf(" IRQ2 > IRQ0 \n");
+#endif
+	}
+	return ans;
+}
+
+/* handling priority for interrupts of group C */
+BYTE group_C()
+{
+	BYTE ans = 0xff; 
+#ifdef DEBUG
+printf("Group C \n");
+#endif
+	if(BIT_1(reg_mem[IPR]))
+	{
+		/* call IRQ4 first 
+		call IRQ1
+		*/
+		if (IRQ4 & reg_mem[IRQ]){
+			ans = 0x04; //IRQ4
+		}
+		else if (IRQ1 & reg_mem[IRQ])
+		{// if IRQ0 bit is set
+			ans = 0x01; // IRQ1
+		}
+	#ifdef DEBUG 
+	printf("IRQ4 > IRQ1 \n");
+	#endif
+	}
+	else {
+		/* call IRQ1 first 
+		then call IRQ4 
+		*/
+		if (IRQ1 & reg_mem[IRQ])
+		{// if IRQ0 bit is set
+			ans = 0x01; // IRQ1
+		}
+		else if (IRQ4 & reg_mem[IRQ]){
+			ans = 0x04; //IRQ4
+		} 
+	#ifdef DEBUG 
+	printf(" IRQ1 > IRQ4 \n");
+	#endif
+	}
+	return ans;
+}
+
+/* Polling function 
+returns the byte of the most */
+BYTE polling()
+{
+BYTE retval; // holds the return value
+BYTE prt1, prt2,prt3; // holds byte from lowest to highest priority
+BYTE temp;
+temp = BIT_4(reg_mem[IPR])<<2|BIT_3(reg_mem[IPR])<<1|BIT_0(reg_mem[IPR]);
+switch(temp)
+{
+	case 0x00:	/* reserved */
+	#ifdef DEBUG 
+	printf(" RESERVED 1 \n");
+	#endif	
+	break;
+	
+	case 0x01: 	/* c>a>b */
+	prt3=group_C();
+	prt2=group_A();
+	prt1=group_B();
+	break;
+	
+	case 0x02: /* A>B>C */
+	prt3=group_A();
+	prt2=group_B();
+	prt1=group_C();
+	break;
+	
+	case 0x03: /* A>C>B */
+	prt3=group_A();
+	prt2=group_C();
+	prt1=group_B();
+	break;
+	
+	case 0x04: /* B>C>A */
+	prt3=group_B();
+	prt2=group_C();
+	prt1=group_A();
+	break;
+	
+	case 0x05: /* C>B>A */
+	prt3=group_C();
+	prt2=group_B();
+	prt1=group_A();
+	break;
+	
+	case 0x06: /* B>A>C */
+	prt3=group_B();
+	prt2=group_A();
+	prt1=group_C();
+	break;
+	
+	case 0x07: /* reserved */
+	
+	#ifdef DEBUG 
+	printf("RESERVED 2 \n");
+	#endif
+		
+	break;
+}
+
+if ((BIT_7(reg_mem[IPR]) | BIT_6(reg_mem[IPR]))==0){
+	/* reserved */
+	#ifdef DEBUG
+	printf("RESERVED 3 \n");
+	#endif
+}
+/* if prt3 does not hold ff, retval= prt3, else if prt2 does not hold ff , retval = prt2, else retval = prt3 */
+if(prt3 != 0xff)
+retval = prt3;
+else if(prt2 != 0xff)
+retval = prt2;
+else
+retval = prt1;
+
+return retval;
+}
+
+ 
+/* VEIW MEMORY */
+
+test_prog()
+{
+	#ifdef VEIW_PROG_MEM
+	printf(" program counter holds : %x \n", pc);
+	int laddr = pc;
+	int i;
+	for (i=0; i<0x27; i++)
+	{
+		printf(" PROG mem loc %x contains %x BYTE \n", laddr, memory[PROG][laddr]);
+		laddr++;
+	}
+	#endif
+	#ifdef VEIW_STACK
+	printf("stack holds : ");
+	WORD i;
+	for (i=SP; (i!= 0 )&&(i<0xffff); i++)
+	{
+		printf("%2x ", read_dm(i));
+	}
+	printf("%2x ", read_dm(i));
+	printf("\n");
+	#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+
+/* IF extension state (tcount, fcount, cexec, tempflags) is kept in the
+   machine so that every dispatch engine and the end of cycle IF handling 
+   see the same values */
+enum DISPATCH dispatch = DISPATCH_SWITCH; /* selected in main() */
+
+/* a taken jump, call or loop ends any IF sequence in progress */
+void if_reset()
+{
+	/***********IF ADDITION *************/
+	tcount =0;
+	fcount=0;
+	cexec=0;
+	#ifdef IF_TEST
+	if (!batch)
+	printf("flow of control tcount: %x fcount: %x cexec: %x \n", tcount, fcount, cexec);
+	#endif
+	/***********************************/ 
+}
+
+/*********************** INSTRUCTIONS *****************************************/
+/* One function per instruction (or per instruction group sharing operand
+   decoding). Both dispatch engines call these, so the architectural 
+   behaviour does not depend on the engine selected.
+   inst holds the opcode, the PC points to the first operand byte */
+
+/* two operand instructions - dst is a register address, src a value */
+void alu_add(BYTE dst, BYTE src)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	write_rm(dst, adder(regval, src, 0)); //  0 no carry 
+	//flags are implicitly set in the adder function
+}
+
+void alu_adc(BYTE dst, BYTE src)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	write_rm(dst, adder (regval, src, carry)); // + carry 
+}
+
+void alu_sub(BYTE dst, BYTE src)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	write_rm(dst, subber (regval, src, 0)); // 0: no carry 
+}
+
+void alu_sbc(BYTE dst, BYTE src)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	write_rm(dst, subber (regval, src, carry)); // - carry
+	//flags are set implicitly in subber function 
+}
+
+void alu_or(BYTE dst, BYTE src)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	regval = regval|src;
+	/* set flags */
+#ifdef LAZY_FLAGS
+	flags_logic(regval);
+#else
+	write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
+	write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
+	write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+#endif
+}
+
+void alu_and(BYTE dst, BYTE src)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	regval = regval&src;
+	/* set flags */
+#ifdef LAZY_FLAGS
+	flags_logic(regval);
+#else
+	write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
+	write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
+	write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+#endif
+}
+
+void alu_tcm(BYTE dst, BYTE src)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	regval = ~regval&src;
+	/* set flags */
+#ifdef LAZY_FLAGS
+	flags_logic(regval);
+#else
+	write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
+	write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
+	write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+#endif
+}
+
+void alu_tm(BYTE dst, BYTE src)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	regval = regval&src;
+	/* set flags */
+#ifdef LAZY_FLAGS
+	flags_logic(regval);
+#else
+	write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
+	write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
+	write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+#endif
+}
+
+void alu_cp(BYTE dst, BYTE src)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	subber(regval, src, 0);
+	//flags are set implicitly in the function
+}
+
+void alu_xor(BYTE dst, BYTE src)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	write_rm(dst, regval^src);
+	/* set flags */
+#ifdef LAZY_FLAGS
+	flags_logic(regval);
+#else
+	write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
+	write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
+	write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+#endif
+}
+
+void alu_ld(BYTE dst, BYTE src)
+{
+	/* dst <--src */
+	write_rm(dst, src);
+}
+
+/* single operand instructions - dst is a register address */
+void unary_dec(BYTE dst)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	sign = SIGN(regval); // store value incase of overflow
+	regval--;
+	write_rm(dst, regval);
+	//set flags
+	write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
+	write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+	write_rm(FLAGS, FLAG_V(sign != SIGN(regval))); // set overflow flag		          	
+}
+
+void unary_rlc(BYTE dst)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	sign = SIGN(regval);
+	regval= (regval*2)+carry;
+	write_rm(dst, regval);
+	carry = sign>>7;
+	/* Set flags */
+	write_rm(FLAGS, FLAG_C(carry));
+	write_rm(FLAGS, FLAG_S(SIGN(regval)));
+	write_rm(FLAGS, FLAG_Z(ZERO(regval)));
+	write_rm(FLAGS, (FLAG_V(SIGN(regval))==sign));
+}
+
+void unary_inc(BYTE dst)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	sign = SIGN(regval);
+	regval+=1;
+	write_rm(dst, regval);
+	//set flags
+	write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
+	write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+	write_rm(FLAGS, FLAG_V(sign != SIGN(regval))); // set overflow flag
+}
+
+void unary_da(BYTE dst)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	write_rm( dst, adjust_dec(regval));
+	sys_clock+=2; // total of 8 cycles
+	// flags are set implicitly in the adjust_dec function
+}
+
+void unary_pop(BYTE dst)
+{
+	BYTE regval;
+	sp =SP; // stack pointer
+	/* dst <--@SP */
+	
+	if(SPLOC == 0)
+	{ // Stack is in data memory 
+		regval= read_dm(sp++);
+		write_rm(dst, regval);
+		/* SP <-- SP+1	*/
+	    write_rm(SPH, MSBY(sp));
+		
+	}
+	else{ // stack is in Reg-mem
+		regval = read_rm(sp++);
+		write_rm(dst, regval);
+	}
+    /* SP <--- Sp+1 */
+	write_rm(SPL,LSBY(sp));
+	sys_clock += 4; // total of 10 cycles
+}
+
+void unary_com(BYTE dst)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	regval = ~regval;
+	write_rm(dst, regval);
+	/* set flags */
+	write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
+	write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+	write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
+}
+
+/* lnib is 0x01 for the IR addressing mode */
+void unary_push(BYTE dst, BYTE lnib)
+{
+	BYTE regval;
+	/* SP <-- SP-1 */
+	sp =SP-0x01;
+	write_rm(SPL, LSBY(sp));
+	/*@SP <-- src */				
+	regval = read_rm(dst);
+	if (SPLOC == 0){ //stack is in data memory
+	
+	write_dm(sp, regval);
+	write_rm(SPH, MSBY(sp));
+	sys_clock += 2; // 2 extra cycles for external stack
+	}else{	// stack is in register mermory
+	write_rm(SPL, regval);
+	}
+	
+	/* increment system clock */
+	if (lnib == 0x01)
+	{
+		sys_clock +=2; // 2 extra cycles for IR address mode
+	}
+	
+	sys_clock +=4; // total base value of 10 cycles
+}
+
+void unary_decw(BYTE dst)
+{
+	BYTE regval;
+	WORD dest;
+	// ADDRESSING MODE IS RR for low_nib =0, IR for low nib = 1
+	/* get 16 bit destination value */
+	dest = read_rm(dst++)<<8;
+	regval = read_rm(dst);
+	dest = dest|regval;
+	sign = SIGN(MSBY(dest)); // store sign value for overflow check
+	dest--; // dest = dest -1
+	write_rm(dst--, LSBY(dest)); // writes lo byte to memory
+	write_rm(dst, MSBY(dest)); //  writes hi byte to memory 
+	
+	//set flags
+	write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
+	write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+	write_rm(FLAGS, FLAG_V(sign != SIGN(regval))); // set overflow flag
+	sys_clock += 4; // total of 10 cycles
+}
+
+void unary_rl(BYTE dst)
+{
+	BYTE regval;
+	regval = read_rm(dst);
+	sign = SIGN(regval);
+	/* C <-- dst(7) */
+	carry = sign>>7;
+	write_rm(dst ,(regval*2)+ carry);
+	/* set flags */
+	write_rm(FLAGS, FLAG_C(carry));
+	write_rm(FLAGS, FLAG_S(SIGN(regval)));
+	write_rm(FLAGS,FLAG_Z(ZERO(regval)));
+	write_rm(FLAGS,FLAG_V(SIGN(regval)==sign));
+}
+
+void unary_incw(BYTE dst)
+{
+	BYTE regval;
+	WORD dest;
+	// ADDRESSING MODE IS RR for low_nib =0, IR for low nib = 1
+	/* get 16 bit destination value */
+	
+	dest = read_rm(dst++)<<8;
+	regval = read_rm(dst);
+	dest = dest|regval;
+	sign = SIGN(MSBY(dest)); // store sign value for overflow check
+	dest++; // dest = dest +1
+	write_rm(dst--, LSBY(dest)); // writes lo byte to memory
+	write_rm(dst, MSBY(dest)); //  writes hi byte to memory 
+	
+	//set flags
+	write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
+	write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+	write_rm(FLAGS, FLAG_V(sign != SIGN(regval))); // set overflow flag
+	
+	/* increment sys_clock */
+	sys_clock +=4; // total of 10 cycles
+}
+
+void unary_clr(BYTE dst)
+{
+	write_rm(dst, 0);
+}
+
+void unary_rrc(BYTE dst)
+{
+	BYTE regval;
+	BYTE src;
+	regval = read_rm(dst); // temp to hold content of dst reg
+	sign = SIGN(regval);
+	src = LSB(regval); // hold value of carry temporarily
+	write_rm(dst, (regval/2)+(carry<<7));
+	carry = src;
+	/* Set flags */
+	regval = read_rm(dst);
+	write_rm(FLAGS, FLAG_C(carry));
+	write_rm(FLAGS, FLAG_S(SIGN(regval)));
+	write_rm(FLAGS, FLAG_Z(ZERO(regval)));
+	write_rm(FLAGS, FLAG_V(SIGN(regval)==sign));					
+}
+
+void unary_sra(BYTE dst)
+{
+	BYTE src;
+	sign= SIGN(read_rm(dst)); 
+	carry = LSB(read_rm(dst));
+	write_rm(dst, (read_rm(dst)/2) + sign);
+	/* set flags */
+	src = read_rm(dst);
+	write_rm(FLAGS, FLAG_C(carry));
+	write_rm(FLAGS, FLAG_S(SIGN(src)));
+	write_rm(FLAGS, FLAG_Z(ZERO(src)));
+	write_rm(FLAGS, FLAG_V(SIGN(0)));	// always zero
+}
+
+void unary_rr(BYTE dst)
+{
+	BYTE src;
+	src = read_rm(dst); // uses src as a temp
+	sign = SIGN(src);
+	carry = LSB(src);
+	write_rm(dst,(src/2)+(carry<<7));
+	/* Set flags */
+	src = read_rm(dst);
+	write_rm(FLAGS, FLAG_C(carry));
+	write_rm(FLAGS, FLAG_S(SIGN(src)));
+	write_rm(FLAGS, FLAG_Z(ZERO(src)));
+	write_rm(FLAGS, FLAG_V(SIGN(src)==sign));
+}
+
+void unary_swap(BYTE dst)
+{
+	BYTE src;
+	src = read_rm(dst);
+	write_rm(dst, (LSN(src)<<4)|MSN(src));
+	/* set flags */
+	write_rm(FLAGS, FLAG_S(SIGN(read_rm(dst))));
+	write_rm(FLAGS, FLAG_Z(ZERO(read_rm(dst))));
+	sys_clock +=2; // total of 8 cycles 
+}
+
+/* r or cc in the high nibble, lnib: 0x08 through 0x0E */
+void op_ld_r_R(BYTE inst) /* LD dst , src  r,R */
+{
+	BYTE dst;
+	BYTE src;
+	dst = MSN(inst);
+	src = read_rm(prog_mem_fetch()); // src value
+	/*dst <-- src*/
+	WORK_WR(dst, src);
+	sys_clock +=6; // 6 cycles 
+}
+
+void op_ld_R_r(BYTE inst) /* LD dst, src  R,r */
+{
+	BYTE dst;
+	BYTE src;
+	src = WORK_RD(MSN(inst));
+	dst = prog_mem_fetch();
+	/*dst <-- src*/
+	write_rm(dst, src);
+	sys_clock +=6; // 6 cycles
+}
+
+void op_djnz(BYTE inst) /* DJNZ r, dst */
+{
+	BYTE dst;
+	BYTE src;
+	BYTE regval;
+	dst = prog_mem_fetch();
+	src = MSN(inst);
+	regval = WORK_RD(src);
+	regval -= 1;
+	if (regval != 0)
+	{
+		/* Reg != 0 -- repeat loop */
+		/* Signed extend dst to 16 bits if -ve */
+		pc = pc + SIGN_EXT(dst);
+		#ifdef JUMP
+		if (!batch)
+		{
+			printf("pc after jump is : %x \n", pc);
+			printf("contents of prog mem(pc) is %x \n", read_pm(pc));
+		}
+		#endif
+		if_reset();
+		sys_clock +=2;
+	}
+	WORK_WR(src, regval);
+	sys_clock +=10; // total of 12 cycles if JUMP is taken 
+}
+
+void op_jr(BYTE inst) /* JR cc,RA */
+{
+	BYTE dst;
+	dst = prog_mem_fetch(); // RA
+	if(cond_handler(MSN(inst))){
+		#ifdef JUMP
+		if (!batch)
+		{
+			printf("pc before jump is : %x \n", pc);
+			printf("contents of prog mem(pc) is %x \n", read_pm(pc));
+		}
+		#endif
+		pc = pc + SIGN_EXT(dst);
+		#ifdef JUMP
+		if (!batch)
+		{
+			printf( "JUMP TAKEN: "
+			  		"dst = %x , pc = %x \n", dst, pc);
+			printf("contents of prog mem(pc) is %x \n", read_pm(pc));
+		}
+		#endif
+		if_reset();
+		sys_clock += 2; // total of 12 cycles if jump is taken 
+	}
+}
+
+void op_ld_r_IM(BYTE inst) /* LD dst, IMM */
+{
+	BYTE dst;
+	dst = prog_mem_fetch();
+	WORK_WR(MSN(inst), dst);
+	sys_clock +=6; // 6 cycles 
+}
+
+void op_jp(BYTE inst) /* JP cc, DA */
+{
+	WORD dest;
+	/* get DA */
+	dest = (prog_mem_fetch() <<8);
+	dest|=(prog_mem_fetch());
+	if(cond_handler(MSN(inst))){
+		// condition code is true
+		/* PC <-- dst */
+		pc = dest;
+		#ifdef JUMP
+		if (!batch)
+		printf("JUMP TAKEN, NEW PC = %x \n", pc);
+		#endif
+		if_reset();
+		sys_clock += 2; // total of 12 cycles if jump is taken
+	}
+}
+
+void op_inc_r(BYTE inst) /* INC dst */
+{
+	BYTE dst;
+	BYTE regval;
+	dst = MSN(inst);
+	regval = WORK_RD(dst);
+	sign = SIGN(regval);
+	regval += 1;
+	WORK_WR(dst, regval);
+	/* Update flags */
+	write_rm(FLAGS, FLAG_Z(regval == 0));
+	write_rm(FLAGS, FLAG_S(SIGN(regval)));
+	write_rm(FLAGS, FLAG_V(SIGN(regval) != sign)); 
+	
+	sys_clock +=6; // 6 cycles
+}
+
+/* lnib: 0x0F - no-operand instructions (and IF) */
+void op_if(BYTE inst) /* IF instuction */
+{
+	BYTE dst;
+	BYTE src;
+	BYTE regval;
+	/* fetch next byte */
+	dst = prog_mem_fetch();
+	regval = MSN(dst); // condition code
+	src = LSN(dst);
+	dst = src>>2;
+	tcount = dst&0x03; // retrieve tt
+	fcount = src&0x03; // retrieve ff
+	cexec = cond_handler(regval); // holds 1 if condition is true, and 0 if false
+	/* store flags in temp variable */
+	tempflags = read_rm(FLAGS);
+	#ifdef IF_TEST
+	if (!batch)
+	{
+		printf(" dst : %x, src: %x \n", dst, src);
+		printf("If encountered, tcount %x, fcount: %x : cond : %x \n", tcount, fcount, cexec);
+	}
+	#endif	
+}
+
+void op_stop(BYTE inst) /* STOP - added instruction - not on opcode map */
+{
+	running = FALSE;
+}
+
+void op_halt(BYTE inst) /* HALT system and wait for interrupt */
+{
+	if (!batch)
+		printf("Halt system and check for interrupts! \n");
+}
+
+void op_di(BYTE inst) /* DI disable interrupts */
+{
+	if (!batch)
+		printf(" Interrupts disabled \n");
+	write_rm(IMR, IMR_7(0)); // IMR(7) <--0 
+	sys_clock += 6;
+}
+
+void op_ei(BYTE inst) /* EI Enable interrupts */
+{
+	if (!batch)
+		printf("Interrupts enabled \n ");
+	/* IMR(7) <--1  */
+	write_rm(IMR, IMR_7(0x01));
+	sys_clock +=6; // 6 cycles
+}
+
+void op_ret(BYTE inst) /*RET */
+{
+	sp = SP;
+	if (SPLOC == 0){ // stack is in data memory
+		pc = (read_dm(sp++)<<8)|read_dm(sp++);
+		write_rm(SPL, LSBY(sp));
+		write_rm(SPH, MSBY(sp));
+	}else{ //stack is in reg_mem
+		pc = read_rm(sp++)<<8|read_rm(sp++);
+		write_rm(SPL, LSBY(sp));
+	}
+	sys_clock +=14; // 14 cycles 
+}
+
+void op_iret(BYTE inst) /* IRET */
+{
+	sp = SP;
+	if (SPLOC ==0) { // stack is in data memory 
+		/* FLAGS <-- @SP */
+	write_rm(FLAGS, read_dm(sp++));
+	/* PC <-- @SP	*/
+	pc = (read_dm(sp++)<<8)|read_dm(sp++);
+	/* SP <-- SP +2 */
+	write_rm(SPL, LSBY(sp));
+	write_rm(SPH, MSBY(sp));
+	}
+	else{ // stack in reg mem
+	/* FLAGS <-- @SP */
+	write_rm(FLAGS, read_rm(sp++));
+	/* PC <-- @SP	*/
+	pc = (read_rm(sp++)<<8)|read_rm(sp++);
+	/* SP <-- SP +2 */
+	write_rm(SPL, LSBY(sp));
+	}
+	/* IMR(7) <--1  */
+	write_rm(IMR, IMR_7(0x01)); // enable interupts 
+	/* increment system clock */
+	sys_clock +=16; // 16 cycles
+}
+
+void op_rcf(BYTE inst) /* RCF */
+{
+	carry =0;
+	write_rm(FLAGS, FLAG_C(carry));
+	sys_clock +=6; // 6 cycles 
+}
+
+void op_scf(BYTE inst) /* SCF */
+{
+	carry = 0x01; //C<--1
+	write_rm(FLAGS, FLAG_C(carry));
+	if (!batch)
+		printf("carry is set \n");
+	sys_clock +=6; // cycles
+}
+
+void op_ccf(BYTE inst) /* CCF */
+{
+	carry = !carry;
+	write_rm(FLAGS, FLAG_C(carry));
+	sys_clock+=0x06; // 6 cycles
+}
+
+void op_nop(BYTE inst) /* NOP */
+{
+	sys_clock +=6; // 6 cycles
+}
+
+/* opcodes that are not emulated - consume no operands */
+void op_none(BYTE inst)
+{
+}
+
+void op_jp_IRR(BYTE inst) /* JP dst IRR */
+{
+	BYTE dst;
+	BYTE regval;
+	WORD dest;
+	dst = prog_mem_fetch(); // get next memory location
+	/* get 16 Bit destination */
+	regval = read_rm(dst++);
+	dest = regval<<8;
+	regval = read_rm(dst);
+	dest = dest|regval;
+	/*PC <--dst */
+	pc=dest;
+	if_reset();
+	/* increment system clock */
+	sys_clock +=8; // 8 cycles 
+}
+
+void op_srp(BYTE inst) /* SRP IMM */
+{
+	BYTE dst;
+	dst = prog_mem_fetch(); // get next memory location
+	write_rm(RP, LSN(dst));
+	if (!batch)
+		printf(" RP Is set to : %x \n", read_rm(RP));
+	sys_clock +=6; // 6 cycles
+}
+
+void op_lde_r_Irr(BYTE inst) /* LDE (dst, src) r, Irr */
+{
+	BYTE dst;
+	BYTE src;
+	WORD dest;
+	dst = prog_mem_fetch();
+	src = RPBLK|LSN(dst);
+	dst = RPBLK|MSN(dst);
+	/* obtain 16 bit address of source in data mem */
+	dest = (read_rm(src++)<<8)|read_rm(src);
+	/* dst <-- src */
+	write_rm(dst, read_dm(dest));
+	sys_clock +=12; //12 cycles 
+}
+
+void op_ldei_Ir_Irr(BYTE inst) /* LDEI (dst, src) Ir, Irr */
+{
+	BYTE dst;
+	BYTE src;
+	WORD dest;
+	dst = prog_mem_fetch();
+	src = RPBLK|LSN(dst);
+	dst = read_rm(RPBLK|MSN(dst));
+	/* obtain 16 bit address of source in data mem */
+	dest = (read_rm(src++)<<8)|read_rm(src++);
+	/* dst <-- src */
+	write_rm(dst++, read_dm(dest)); 
+	sys_clock +=18; //18 cycles 
+}
+
+void op_lde_Irr_r(BYTE inst) /* LDE (dst, src) Irr, r */
+{
+	BYTE dst;
+	BYTE src;
+	WORD dest;
+	dst = prog_mem_fetch();
+	src = RPBLK|MSN(dst);
+	dst = RPBLK|LSN(dst);
+	/* obtain 16 bit address of source in data mem */
+	dest = (read_rm(src++)<<8)|read_rm(src);
+	/* dst <-- src */
+	write_rm(dst, read_dm(dest));
+	sys_clock += 12; //12 cycles 
+}
+
+void op_ldei_Irr_Ir(BYTE inst) /* LDEI (dst, src) Irr, Ir */
+{
+	BYTE dst;
+	BYTE src;
+	WORD dest;
+	dst = prog_mem_fetch();
+	src = RPBLK|MSN(dst);
+	dst = read_rm(RPBLK|LSN(dst));
+	/* obtain 16 bit address of source in prog mem */
+	dest = (read_rm(src++)<<8)|read_rm(src++);
+	/* dst <-- src */
+	write_rm(dst++, read_dm(dest));
+	sys_clock +=18; //18 cycles
+}
+
+void op_ldc_r_Irr(BYTE inst) /* LDC (dst, src) r, Irr */
+{
+	BYTE dst;
+	BYTE src;
+	BYTE regval;
+	WORD dest;
+	dst = prog_mem_fetch();
+	src = RPBLK|LSN(dst);
+	dst = RPBLK|MSN(dst);
+	/* obtain 16 bit address of source in prog mem */
+	regval = read_rm(src);
+	dest = read_rm(RPBLK|(regval++))<<8;
+	dest |= read_rm(RPBLK|(regval));
+	/* destination now holds target addr in program mem */
+	/* get source value */
+	src = read_pm(dest);
+	/* dst <-- src */
+	write_rm(dst, src);
+	sys_clock +=12; // 12 cycles  			
+}
+
+void op_ldci_Ir_Irr(BYTE inst) /* LDCI (dst, src) Ir, Irr */
+{
+	BYTE dst;
+	BYTE src;
+	BYTE regval;
+	WORD dest;
+	WORD temp;
+	/* loading from program memory into register memory */
+	dst = prog_mem_fetch();
+	src = RPBLK|LSN(dst);
+	dst = RPBLK|MSN(dst);
+	/* obtain 16 bit address of source in prog mem */
+	regval = read_rm(src);
+	dest = read_rm(RPBLK|(regval++))<<8;
+	dest |= read_rm(RPBLK|(regval++));
+	temp = dest +1; // rr<-- rr+1
+	regval = MSBY(temp); 
+	write_rm(src++, regval);
+	regval = LSBY(temp);
+	write_rm(src, regval);
+	/* destination now holds target addr in program mem
+	and Irr in reg_mem now points to the succeeding register pair */
+	/* get source value */
+	src = read_pm(dest);
+	/* get dst addr in reg_mem */
+	regval = read_rm(dst);
+	write_rm(dst, (regval+1)); // r<-- r+1
+	/* dst <-- src */
+	dst = RPBLK|regval;
+	write_rm(dst, src); 
+	sys_clock +=18; //18 cycles 
+}
+
+void op_ld_r_X(BYTE inst) /*LD (dst, src) : r, X	*/
+{
+	BYTE dst;
+	BYTE src;
+	dst = RPBLK|MSN(prog_mem_fetch());
+	src = prog_mem_fetch();
+	write_rm(dst, read_rm(src+dst));
+	sys_clock += 10; // 10 cycles 
+}
+
+void op_ldc_Irr_r(BYTE inst) /* LDC (dst, src): Irr, r */
+{
+	BYTE dst;
+	BYTE src;
+	BYTE regval;
+	WORD dest;
+	dst = prog_mem_fetch();
+	src = RPBLK|MSN(dst);
+	dst = RPBLK|LSN(dst);
+	/* obtain 16 bit address of destination in prog mem */
+	regval = read_rm(dst);
+	dest = read_rm(RPBLK|(regval++))<<8;
+	dest |= read_rm(RPBLK|(regval));
+	/* PROG_MEM[dest] <-- src */
+	write_pm(dest, src);
+	sys_clock +=12; //12 cycles 
+}
+
+void op_ldci_Irr_Ir(BYTE inst) /* LDCI (dst, src) Irr, Ir */
+{
+	BYTE dst;
+	BYTE src;
+	BYTE regval;
+	WORD dest;
+	WORD temp;
+	/* load from reg_mem to program memory 
+	  and increment r and rr	*/
+	dst = prog_mem_fetch(); // get operands
+	src = RPBLK|MSN(dst);
+	dst = RPBLK|LSN(dst);
+	/* obtain 16 bit address of destination in prog mem */
+	regval = read_rm(dst);
+	dest = read_rm(RPBLK|(regval++))<<8;
+	dest |= read_rm(RPBLK|(regval++));
+	temp = dest +1; // rr<-- rr+1
+	regval = MSBY(temp);
+	write_rm(dst++, regval);
+	regval = LSBY(temp);
+	write_rm(dst, regval);
+	/* destination now holds target addr in program mem
+	and Irr in reg_mem now points to the succeeding register pair */
+	/* get source value */
+	regval = read_rm(src);
+	dst = read_rm(RPBLK|(regval++)); // source value
+	write_rm(src, regval); // r<--r+1
+	src = dst; // src now holds source value
+	/* PROG_MEM[dest] <-- src */
+	write_pm(dest, src);
+	sys_clock +=18; // 18 cycles 
+}
+
+void op_call_IRR(BYTE inst) /* CALL (dst) IRR	*/
+{
+	BYTE dst;
+	WORD dest;
+	/* get destination */
+	dst = prog_mem_fetch();
+	dest = (read_rm(dst++))<<8;
+	dest = (dest|read_rm(dst));
+	/* SP <-- SP-2 */
+	sp = SP;
+	sp =-0x02;
+	/* updating the SP */
+	write_rm(SPL, LSBY(sp));
+	if(SPLOC == 0){ // stack is in data memory
+	write_rm(SPH, MSBY(sp));
+	/* @SP <-- PC */
+	write_dm(sp++, MSBY(pc));
+	write_dm(sp++, LSBY(pc));
+	}else{	// stack is in register memory 
+	/* @SP <-- PC */
+	write_rm(sp++, MSBY(pc));
+	write_rm(sp++, LSBY(pc));
+	}
+	/* PC <-- dst */
+	pc = dest;
+	if_reset();
+	sys_clock +=20; // 20 cycles
+}
+
+void op_call_DA(BYTE inst) /* CALL (dst) DA 	*/
+{
+	BYTE dst;
+	WORD dest;
+	/* get destination */
+	dst = prog_mem_fetch();
+	dest = dst<<8;
+	dst = prog_mem_fetch();
+	dest = (dest|dst);
+	/* SP <-- SP-2 */
+	sp = SP;
+	sp =-0x02;
+	write_rm(SPL, LSBY(sp));
+	if(SPLOC==0){ // stack is in data mem
+		write_rm(SPH, MSBY(sp));
+		/* @SP <-- PC */
+		write_dm( sp++, MSBY(pc));
+		write_dm(sp, LSBY(pc));	
+	}else{// stack is in reg mem
+	/* @SP <-- PC */
+		write_rm( sp++, MSBY(pc));
+		write_rm(sp, LSBY(pc));	
+		#ifdef VEIW_STACK
+		printf(" stack holds : lo: %2x hi: %2x \n", read_rm(sp--), read_rm(sp));
+		#endif							
+	}
+	/* PC <-- dst */
+	pc = dest;
+	/*increment system clock */
+	sys_clock +=20; // 20 cycles
+	if_reset();
+	#ifdef VEIW_MEM
+	printf("pc holds : %4x \n", pc);
+	#endif
+}
+
+void op_ld_X_r(BYTE inst) /* LD X,r	*/
+{
+	BYTE dst;
+	BYTE src;
+	src = RPBLK|MSN(prog_mem_fetch()); // fetch register r
+	dst = prog_mem_fetch();    // fetch offset X
+	// dst <- reg_mem[R + offset]
+	write_rm(dst, read_rm(src+dst));
+	sys_clock +=10; //10 cycles 
+}
+
+void op_ld_Ir_r(BYTE inst) /* LD (dst, src) Ir, r */
+{
+	BYTE dst;
+	BYTE src;
+	dst = prog_mem_fetch();
+	src = WORK_RD(LSN(dst));
+	dst = WORK_RD(MSN(dst));
+	write_rm(dst, src);	// dst <-- src
+	sys_clock +=6; // 6 cycles 
+}
+
+void op_ld_IR_R(BYTE inst) /* LD (dst, src) IR, R */
+{
+	BYTE dst;
+	BYTE src;
+	BYTE regval;
+	src = prog_mem_fetch(); //get IR
+	regval = read_rm(src);  // regval <-- reg_mem{IR] i.e  
+	src = read_rm(regval);  // src = reg_mem[R]
+	dst = prog_mem_fetch();
+	write_rm(dst, src);
+	sys_clock +=10; // 10 cycles
+}
+
+/*********************** SWITCH DISPATCH ***********************************/
+/* decode the instruction by its nibbles with a nested switch 
+   inst has been fetched, PC points to the next byte */
+void exec_switch(BYTE inst)
+{
+BYTE src;        /* SRC operand - read if needed */
+BYTE dst;        /* DST operand - read if needed */
+BYTE high_nib;   /* MS nibble of instruction */
+BYTE low_nib;    /* LS nibble of instruction */
+
+     high_nib = MSN(inst);
+     low_nib = LSN(inst);
+     
+     /* Check for special cases: 
+        - lnib: 0x08 through 0x0E - r or cc in hnib 
+        - lnib: 0x0F - no-operand instructions */
+     if (low_nib >= 0x08)
+     {
+          /* LD through INC and some no-operand instructions */
+          switch(low_nib)
+          {
+          case 0x08: /* LD dst , src  r,R */
+               op_ld_r_R(inst);
+               break;
+          
+          case 0x09: /* LD dst, src  R,r */
+               op_ld_R_r(inst);
+               break;
+               
+          case 0x0A: /* DJNZ r, dst */
+               op_djnz(inst);
+               break;
+               
+          case 0x0B: /* JR cc,RA */
+               op_jr(inst);
+               break;
+               
+          case 0x0C: /* LD dst, IMM */
+               op_ld_r_IM(inst);
+               break;
+               
           case 0x0D: /* JP cc, DA */
-          		/* get DA */
-          		dest = (prog_mem_fetch() <<8);
-				dest|=(prog_mem_fetch());
-        	   if(cond_handler(high_nib)){
-        	   	// condition code is true
-        	   	/* PC <-- dst */
-        	   	pc = dest;
-        	   	#ifdef JUMP
-        	   	printf("JUMP TAKEN, NEW PC = %x \n", pc);
-        	   	#endif
-	    	   	/***********IF ADDITION *************/
-				tcount =0;
-				fcount=0;
-				cexec=0;
-				#ifdef IF_TEST
-                printf("flow of control tcount: %x fcount: %x cexec: %x \n", tcount, fcount, cexec);
-                #endif
-				/***********************************/ 
-        	   	sys_clock += 2; // total of 12 cycles if jump is taken
-        	   }
+               op_jp(inst);
                break;
               
           case 0x0E: /* INC dst */
-               dst = RPBLK | high_nib;
-               regval = read_rm(dst);
-               sign = SIGN(regval);
-               regval += 1;
-               write_rm(dst, regval);
-               /* Update flags */
-               write_rm(FLAGS, FLAG_Z(regval == 0));
-               write_rm(FLAGS, FLAG_S(SIGN(regval)));
-               write_rm(FLAGS, FLAG_V(SIGN(regval) != sign)); 
-               
-               sys_clock +=6; // 6 cycles
+               op_inc_r(inst);
                break;
                
           case 0x0F: /* STOP .. NOP */     
                switch (high_nib)
                {
                case 0x01: /* IF instuction */
-               /* fetch next byte */
-               dst = prog_mem_fetch();
-               regval = MSN(dst); // condition code
-               src = LSN(dst);
-               dst = src>>2;
-               tcount = dst&0x03; // retrieve tt
-               fcount = src&0x03; // retrieve ff
-               cexec = cond_handler(regval); // holds 1 if condition is true, and 0 if false
-               /* store flags in temp variable */
-               tempflags = read_rm(FLAGS);
-               #ifdef IF_TEST
-               printf(" dst : %x, src: %x \n", dst, src);
-               printf("If encountered, tcount %x, fcount: %x : cond : %x \n", tcount, fcount, cexec);
-			   #endif	
+               op_if(inst);
                break;
                case 0x06: /* STOP - added instruction - not on opcode map */
-                    running = FALSE;
+               op_stop(inst);
                break;
                
                case 0x07: /* HALT system and wait for interrupt */
-               printf("Halt system and check for interrupts! \n");
+               op_halt(inst);
                break;
                
                case 0x08: /* DI disable interrupts */
-               printf(" Interrupts disabled \n");
-               write_rm(IMR, IMR_7(0)); // IMR(7) <--0 
-               sys_clock += 6;
+               op_di(inst);
                break;
                
                case 0x09: /* EI Enable interrupts */
-               printf("Interrupts enabled \n ");
-               /* IMR(7) <--1  */
-               write_rm(IMR, IMR_7(0x01));
-               sys_clock +=6; // 6 cycles
+               op_ei(inst);
                break;
                
                case 0x0A: /*RET */
-               sp = SP;
-               if (SPLOC == 0){ // stack is in data memory
-	               pc = (read_dm(sp++)<<8)|read_dm(sp++);
-	               write_rm(SPL, LSBY(sp));
-	               write_rm(SPH, MSBY(sp));
-               }else{ //stack is in reg_mem
-               	pc = read_rm(sp++)<<8|read_rm(sp++);
-               	write_rm(SPL, LSBY(sp));
-               }
-               sys_clock +=14; // 14 cycles 
+               op_ret(inst);
                break;
                
                case 0x0B: /* IRET */
-               sp = SP;
-               if (SPLOC ==0) { // stack is in data memory 
-               	/* FLAGS <-- @SP */
-               write_rm(FLAGS, read_dm(sp++));
-               /* PC <-- @SP	*/
-               pc = (read_dm(sp++)<<8)|read_dm(sp++);
-               /* SP <-- SP +2 */
-               write_rm(SPL, LSBY(sp));
-               write_rm(SPH, MSBY(sp));
-               }
-               else{ // stack in reg mem
-               /* FLAGS <-- @SP */
-               write_rm(FLAGS, read_rm(sp++));
-               /* PC <-- @SP	*/
-               pc = (read_rm(sp++)<<8)|read_rm(sp++);
-               /* SP <-- SP +2 */
-               write_rm(SPL, LSBY(sp));
-               }
-               /* IMR(7) <--1  */
-               write_rm(IMR, IMR_7(0x01)); // enable interupts 
-               /* increment system clock */
-               sys_clock +=16; // 16 cycles
+               op_iret(inst);
                break;
                
                case 0x0C: /* RCF */
-               carry =0;
-               write_rm(FLAGS, FLAG_C(carry));
-               sys_clock +=6; // 6 cycles 
+               op_rcf(inst);
                break;
                
                case 0x0D: /* SCF */
-               carry = 0x01; //C<--1
-               write_rm(FLAGS, FLAG_C(carry));
-               printf("carry is set \n");
-               sys_clock +=6; // cycles
+               op_scf(inst);
                break;
                
                case 0x0E: /* CCF */
-               carry = !carry;
-               write_rm(FLAGS, FLAG_C(carry));
-               sys_clock+=0x06; // 6 cycles
+               op_ccf(inst);
                break;
                
                case 0x0F: /* NOP */
-               sys_clock +=6; // 6 cycles
+               op_nop(inst);
                break;
                }
                break;
@@ -1669,81 +4036,47 @@ printf("Program counter holds : %x \n", pc);
           	switch (high_nib)
           	{
           		case 0x00: // ADD
-          		regval = read_rm(dst);
-          		write_rm(dst, adder(regval, src, 0)); //  0 no carry 
-          		//flags are implicitly set in the adder function
+          		alu_add(dst, src);
           		break;
           		
           		case 0x01: // ADC
-          		regval = read_rm(dst);
-          		write_rm(dst, adder (regval, src, carry)); // + carry 
+          		alu_adc(dst, src);
           		break;
           		
           		case 0x02: // SUB
-          		regval = read_rm(dst);
-          		write_rm(dst, subber (regval, src, 0)); // 0: no carry 
+          		alu_sub(dst, src);
           		break;
           		
           		case 0x03: //SUBC 
-          		regval = read_rm(dst);
-          		write_rm(dst, subber (regval, src, carry)); // - carry
-				//flags are set implicitly in subber function 
+          		alu_sbc(dst, src);
           		break;
           		
           		case 0x04: //OR
-          		regval = read_rm(dst);
-          		regval = regval|src;
-          		/* set flags */
-          		write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
-          		write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
-          		write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+          		alu_or(dst, src);
           		break;
           		
           		case 0x05: //AND
-          		regval = read_rm(dst);
-          		regval = regval&src;
-          		/* set flags */
-          		write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
-          		write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
-          		write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+          		alu_and(dst, src);
           		break;
           		
           		case 0x06: // TCM
-          		regval = read_rm(dst);
-          		regval = ~regval&src;
-          		/* set flags */
-          		write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
-          		write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
-          		write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+          		alu_tcm(dst, src);
           		break;
           		
           		case 0x07: //TM
-          		regval = read_rm(dst);
-          		regval = regval&src;
-          		/* set flags */
-          		write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
-          		write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
-          		write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+          		alu_tm(dst, src);
           		break;
           		
           		case 0x0A: //CP
-          		regval = read_rm(dst);
-          		subber(regval, src, 0);
-          		//flags are set implicitly in the function
+          		alu_cp(dst, src);
           		break;
           		
           		case 0x0B: //XOR 
-          		regval = read_rm(dst);
-          		write_rm(dst, regval^src);
-          		/* set flags */
-          		write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
-          		write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
-          		write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
+          		alu_xor(dst, src);
           		break;
           		
           		case 0x0E: //LD
-          		/* dst <--src */
-          		write_rm(dst, src);
+          		alu_ld(dst, src);
           		break;
           	}
           }
@@ -1751,36 +4084,11 @@ printf("Program counter holds : %x \n", pc);
           	// handles special cases
           	if (high_nib ==0x03)
           	{
-          		switch(high_nib)
-          		{
-          			case 0x03: // JP & SRP
-          			dst = prog_mem_fetch(); // get next memory location
-          			if(low_nib == 0x00){ // JP dst IRR
-          				/* get 16 Bit destination */
-          				regval = read_rm(dst++);
-          				dest = regval<<8;
-          				regval = read_rm(dst);
-          				dest = dest|regval;
-          				/*PC <--dst */
-          				pc=dest;
-          				/***********IF ADDITION *************/
-						tcount =0;
-						fcount=0;
-						cexec=0;
-						#ifdef IF_TEST
-		                printf("flow of control tcount: %x fcount: %x cexec: %x \n", tcount, fcount, cexec);
-		                #endif
-						/***********************************/ 
-          				/* increment system clock */
-          				sys_clock +=8; // 8 cycles 
-          			}else if (low_nib== 0x01){ // SRP IMM
-			          	write_rm(RP, LSN(dst));
-			          	printf(" RP Is set to : %x \n", read_rm(RP));
-			          	sys_clock +=6; // 6 cycles
-          			}
-          			break;
+          		if(low_nib == 0x00){ // JP dst IRR
+          			op_jp_IRR(inst);
+          		}else if (low_nib== 0x01){ // SRP IMM
+          			op_srp(inst);
           		}
-          		
           	}else{
           		/* The same addressing mode 
 				  call get_args_2() to retrieve dst
@@ -1792,212 +4100,65 @@ printf("Program counter holds : %x \n", pc);
 		          switch (high_nib)
 		          {
 		          	case 0x00: // DEC
-		          	regval = read_rm(dst);
-		          	sign = SIGN(regval); // store value incase of overflow
-		          	regval--;
-		          	write_rm(dst, regval);
-		          	//set flags
-	          		write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
-	          		write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
-	          		write_rm(FLAGS, FLAG_V(sign != SIGN(regval))); // set overflow flag		          	
+		          	unary_dec(dst);
 		          	break;
 		          	
-		          	
 		          	case 0x01: //RLC
-		          	regval = read_rm(dst);
-		          	sign = SIGN(regval);
-		          	regval= (regval*2)+carry;
-		          	write_rm(dst, regval);
-		          	carry = sign>>7;
-		          	/* Set flags */
-					write_rm(FLAGS, FLAG_C(carry));
-					write_rm(FLAGS, FLAG_S(SIGN(regval)));
-					write_rm(FLAGS, FLAG_Z(ZERO(regval)));
-					write_rm(FLAGS, (FLAG_V(SIGN(regval))==sign));
-		          	
+		          	unary_rlc(dst);
 		          	break;
 		          	
 		          	case 0x02: //INC
-		          	regval = read_rm(dst);
-		          	sign = SIGN(regval);
-		          	regval+=1;
-		          	write_rm(dst, regval);
-		          	//set flags
-	          		write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
-	          		write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
-	          		write_rm(FLAGS, FLAG_V(sign != SIGN(regval))); // set overflow flag
+		          	unary_inc(dst);
 		          	break;
 		          	
 		          	case 0x04:	//DA
-		          	regval = read_rm(dst);
-		          	write_rm( dst, adjust_dec(regval));
-		          	sys_clock+=2; // total of 8 cycles
-		          	// flags are set implicitly in the adjust_dec function
+		          	unary_da(dst);
 					break;
 					
 					case 0x05:	//POP
-					sp =SP; // stack pointer
-					/* dst <--@SP */
-					
-					if(SPLOC == 0)
-					{ // Stack is in data memory 
-						regval= read_dm(sp++);
-						write_rm(dst, regval);
-						/* SP <-- SP+1	*/
-					    write_rm(SPH, MSBY(sp));
-						
-					}
-					else{ // stack is in Reg-mem
-						regval = read_rm(sp++);
-						write_rm(dst, regval);
-					}
-                    /* SP <--- Sp+1 */
-					write_rm(SPL,LSBY(sp));
-					sys_clock += 4; // total of 10 cycles
+					unary_pop(dst);
 					break;
 					
 					case 0x06: //COM
-					regval = read_rm(dst);
-					regval = ~regval;
-					write_rm(dst, regval);
-					/* set flags */
-	          		write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
-	          		write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
-	          		write_rm(FLAGS, FLAG_V(0)); // reset overflow flag to zero
-					
+					unary_com(dst);
 					break;
 					
 					case 0x07:	//PUSH
-					/* SP <-- SP-1 */
-					sp =SP-0x01;
-					write_rm(SPL, LSBY(sp));
-					/*@SP <-- src */				
-					regval = read_rm(dst);
-					if (SPLOC == 0){ //stack is in data memory
-					
-					write_dm(sp, regval);
-					write_rm(SPH, MSBY(sp));
-					sys_clock += 2; // 2 extra cycles for external stack
-					}else{	// stack is in register mermory
-					write_rm(SPL, regval);
-					}
-					
-					/* increment system clock */
-					if (low_nib == 0x01)
-					{
-						sys_clock +=2; // 2 extra cycles for IR address mode
-					}
-					
-					sys_clock +=4; // total base value of 10 cycles
+					unary_push(dst, low_nib);
 					break;
 					
 					case 0x08: // DECW
-					// ADDRESSING MODE IS RR for low_nib =0, IR for low nib = 1
-					/* get 16 bit destination value */
-					dest = read_rm(dst++)<<8;
-					regval = read_rm(dst);
-					dest = dest|regval;
-					sign = SIGN(MSBY(dest)); // store sign value for overflow check
-					dest--; // dest = dest -1
-					write_rm(dst--, LSBY(dest)); // writes lo byte to memory
-					write_rm(dst, MSBY(dest)); //  writes hi byte to memory 
-					
-		          	//set flags
-	          		write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
-	          		write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
-	          		write_rm(FLAGS, FLAG_V(sign != SIGN(regval))); // set overflow flag
-	          		sys_clock += 4; // total of 10 cycles
+					unary_decw(dst);
           			break;
 					
 					case 0x09:	//RL
-					regval = read_rm(dst);
-					sign = SIGN(regval);
-					/* C <-- dst(7) */
-					carry = sign>>7;
-					write_rm(dst ,(regval*2)+ carry);
-					/* set flags */
-					write_rm(FLAGS, FLAG_C(carry));
-					write_rm(FLAGS, FLAG_S(SIGN(regval)));
-					write_rm(FLAGS,FLAG_Z(ZERO(regval)));
-					write_rm(FLAGS,FLAG_V(SIGN(regval)==sign));
+					unary_rl(dst);
 					break;
 					
-					
 					case 0x0A: // INCW
-					// ADDRESSING MODE IS RR for low_nib =0, IR for low nib = 1
-					/* get 16 bit destination value */
-					
-					dest = read_rm(dst++)<<8;
-					regval = read_rm(dst);
-					dest = dest|regval;
-					sign = SIGN(MSBY(dest)); // store sign value for overflow check
-					dest++; // dest = dest +1
-					write_rm(dst--, LSBY(dest)); // writes lo byte to memory
-					write_rm(dst, MSBY(dest)); //  writes hi byte to memory 
-					
-		          	//set flags
-	          		write_rm(FLAGS, FLAG_Z(ZERO(regval))); // set zero flag
-	          		write_rm(FLAGS, FLAG_S(SIGN(regval))); // set signed flag
-	          		write_rm(FLAGS, FLAG_V(sign != SIGN(regval))); // set overflow flag
-	          		
-	          		/* increment sys_clock */
-	          		sys_clock +=4; // total of 10 cycles
+					unary_incw(dst);
           			break;
 					
 					case 0x0B:	//CLR
-					write_rm(dst, 0);
+					unary_clr(dst);
 					break;
 					
 					case 0x0C:	//RRC
-					regval = read_rm(dst); // temp to hold content of dst reg
-		          	sign = SIGN(regval);
-		          	src = LSB(regval); // hold value of carry temporarily
-		          	write_rm(dst, (regval/2)+(carry<<7));
-		          	carry = src;
-		          	/* Set flags */
-		          	regval = read_rm(dst);
-					write_rm(FLAGS, FLAG_C(carry));
-					write_rm(FLAGS, FLAG_S(SIGN(regval)));
-					write_rm(FLAGS, FLAG_Z(ZERO(regval)));
-					write_rm(FLAGS, FLAG_V(SIGN(regval)==sign));					
-					
+					unary_rrc(dst);
 					break;
 					
 					case 0x0D:	//SRA
-					sign= SIGN(read_rm(dst)); 
-					carry = LSB(read_rm(dst));
-					write_rm(dst, (read_rm(dst)/2) + sign);
-					/* set flags */
-		          	src = read_rm(dst);
-					write_rm(FLAGS, FLAG_C(carry));
-					write_rm(FLAGS, FLAG_S(SIGN(src)));
-					write_rm(FLAGS, FLAG_Z(ZERO(src)));
-					write_rm(FLAGS, FLAG_V(SIGN(0)));	// always zero
+					unary_sra(dst);
 					break;
 					
 					case 0x0E:	//RR
-					src = read_rm(dst); // uses src as a temp
-		          	sign = SIGN(src);
-		          	carry = LSB(src);
-		          	write_rm(dst,(src/2)+(carry<<7));
-		          	/* Set flags */
-		          	src = read_rm(dst);
-					write_rm(FLAGS, FLAG_C(carry));
-					write_rm(FLAGS, FLAG_S(SIGN(src)));
-					write_rm(FLAGS, FLAG_Z(ZERO(src)));
-					write_rm(FLAGS, FLAG_V(SIGN(src)==sign));
+					unary_rr(dst);
 					break;
 					
 					case 0x0F:	//SWAP
-					src = read_rm(dst);
-					write_rm(dst, (LSN(src)<<4)|MSN(src));
-					/* set flags */
-					write_rm(FLAGS, FLAG_S(SIGN(read_rm(dst))));
-					write_rm(FLAGS, FLAG_Z(ZERO(read_rm(dst))));
-					sys_clock +=2; // total of 8 cycles 
+					unary_swap(dst);
 					break;      
 				  }
-		          
           	}
           } 	
           else{
@@ -2008,25 +4169,11 @@ printf("Program counter holds : %x \n", pc);
           		switch (low_nib)
           		{
           			case 0x02:	/* LDE (dst, src) r, Irr */
-          			dst = prog_mem_fetch();
-          			src = RPBLK|LSN(dst);
-          			dst = RPBLK|MSN(dst);
-          			/* obtain 16 bit address of source in data mem */
-          			dest = (read_rm(src++)<<8)|read_rm(src);
-          			/* dst <-- src */
-          			write_rm(dst, read_dm(dest));
-          			sys_clock +=12; //12 cycles 
+          			op_lde_r_Irr(inst);
           			break;
           			
           			case 0x03: /* LDEI (dst, src) Ir, Irr */
-          			dst = prog_mem_fetch();
-          			src = RPBLK|LSN(dst);
-          			dst = read_rm(RPBLK|MSN(dst));
-          			/* obtain 16 bit address of source in data mem */
-          			dest = (read_rm(src++)<<8)|read_rm(src++);
-          			/* dst <-- src */
-          			write_rm(dst++, read_dm(dest)); 
-          			sys_clock +=18; //18 cycles 
+          			op_ldei_Ir_Irr(inst);
           			break;
           		}
           		break;
@@ -2035,25 +4182,11 @@ printf("Program counter holds : %x \n", pc);
           		switch (low_nib)
           		{
           			case 0x02:	/* LDE (dst, src) Irr, r */
-          			dst = prog_mem_fetch();
-          			src = RPBLK|MSN(dst);
-          			dst = RPBLK|LSN(dst);
-          			/* obtain 16 bit address of source in data mem */
-          			dest = (read_rm(src++)<<8)|read_rm(src);
-          			/* dst <-- src */
-          			write_rm(dst, read_dm(dest));
-          			sys_clock += 12; //12 cycles 
+          			op_lde_Irr_r(inst);
           			break;
           			
           			case 0x03: /* LDEI (dst, src) Irr, Ir */
-          			dst = prog_mem_fetch();
-          			src = RPBLK|MSN(dst);
-          			dst = read_rm(RPBLK|LSN(dst));
-          			/* obtain 16 bit address of source in prog mem */
-          			dest = (read_rm(src++)<<8)|read_rm(src++);
-          			/* dst <-- src */
-          			write_rm(dst++, read_dm(dest));
-          			sys_clock +=18; //18 cycles
+          			op_ldei_Irr_Ir(inst);
           			break;         			
           		}
           		break;
@@ -2062,53 +4195,15 @@ printf("Program counter holds : %x \n", pc);
           		switch (low_nib)
           		{
           			case 0x02:	/* LDC (dst, src) r, Irr */
-          			dst = prog_mem_fetch();
-          			src = RPBLK|LSN(dst);
-          			dst = RPBLK|MSN(dst);
-          			/* obtain 16 bit address of source in prog mem */
-          			regval = read_rm(src);
-          			dest = read_rm(RPBLK|(regval++))<<8;
-          			dest |= read_rm(RPBLK|(regval));
-          			/* destination now holds target addr in program mem */
-          			/* get source value */
-          			src = read_pm(dest);
-          			/* dst <-- src */
-          			write_rm(dst, src);
-					sys_clock +=12; // 12 cycles  			
+          			op_ldc_r_Irr(inst);
           			break;
           			
           			case 0x03: /* LDCI (dst, src) Ir, Irr */
-          			/* loading from program memory into register memory */
-          			dst = prog_mem_fetch();
-          			src = RPBLK|LSN(dst);
-          			dst = RPBLK|MSN(dst);
-          			/* obtain 16 bit address of source in prog mem */
-          			regval = read_rm(src);
-          			dest = read_rm(RPBLK|(regval++))<<8;
-          			dest |= read_rm(RPBLK|(regval++));
-          			temp = dest +1; // rr<-- rr+1
-          			regval = MSBY(temp); 
-          			write_rm(src++, regval);
-          			regval = LSBY(temp);
-          			write_rm(src, regval);
-          			/* destination now holds target addr in program mem
-          			and Irr in reg_mem now points to the succeeding register pair */
-          			/* get source value */
-          			src = read_pm(dest);
-          			/* get dst addr in reg_mem */
-          			regval = read_rm(dst);
-          			write_rm(dst, (regval+1)); // r<-- r+1
-          			/* dst <-- src */
-          			dst = RPBLK|regval;
-          			write_rm(dst, src); 
-          			sys_clock +=18; //18 cycles 
+          			op_ldci_Ir_Irr(inst);
           			break;
 					
 					case 0x07:	/*LD (dst, src) : r, X	*/
-					dst = RPBLK|MSN(prog_mem_fetch());
-					src = prog_mem_fetch();
-					write_rm(dst, read_rm(src+dst));
-					sys_clock += 10; // 10 cycles 
+					op_ld_r_X(inst);
 					break;    			
           		}
 				break;
@@ -2117,124 +4212,23 @@ printf("Program counter holds : %x \n", pc);
           		switch (low_nib)
           		{
           			case 0x02:	/* LDC (dst, src): Irr, r */
-          			dst = prog_mem_fetch();
-          			src = RPBLK|MSN(dst);
-          			dst = RPBLK|LSN(dst);
-          			/* obtain 16 bit address of destination in prog mem */
-          			regval = read_rm(dst);
-          			dest = read_rm(RPBLK|(regval++))<<8;
-          			dest |= read_rm(RPBLK|(regval));
-          			/* PROG_MEM[dest] <-- src */
-          			write_pm(dest, src);
-          			sys_clock +=12; //12 cycles 
+          			op_ldc_Irr_r(inst);
           			break;
           			
           			case 0x03: /* LDCI (dst, src) Irr, Ir */
-          			/* load from reg_mem to program memory 
-					  and increment r and rr	*/
-          			dst = prog_mem_fetch(); // get operands
-					src = RPBLK|MSN(dst);
-          			dst = RPBLK|LSN(dst);
-          			/* obtain 16 bit address of destination in prog mem */
-          			regval = read_rm(dst);
-          			dest = read_rm(RPBLK|(regval++))<<8;
-          			dest |= read_rm(RPBLK|(regval++));
-          			temp = dest +1; // rr<-- rr+1
-          			regval = MSBY(temp);
-          			write_rm(dst++, regval);
-          			regval = LSBY(temp);
-          			write_rm(dst, regval);
-          			/* destination now holds target addr in program mem
-          			and Irr in reg_mem now points to the succeeding register pair */
-          			/* get source value */
-          			regval = read_rm(src);
-          			dst = read_rm(RPBLK|(regval++)); // source value
-          			write_rm(src, regval); // r<--r+1
-          			src = dst; // src now holds source value
-          			/* PROG_MEM[dest] <-- src */
-          			write_pm(dest, src);
-          			sys_clock +=18; // 18 cycles 
+          			op_ldci_Irr_Ir(inst);
           			break;
 					
 					case 0x04: /* CALL (dst) IRR	*/
-					/* get destination */
-					dst = prog_mem_fetch();
-					dest = (read_rm(dst++))<<8;
-					dest = (dest|read_rm(dst));
-					/* SP <-- SP-2 */
-					sp = SP;
-					sp =-0x02;
-					/* updating the SP */
-					write_rm(SPL, LSBY(sp));
-					if(SPLOC == 0){ // stack is in data memory
-					write_rm(SPH, MSBY(sp));
-					/* @SP <-- PC */
-					write_dm(sp++, MSBY(pc));
-					write_dm(sp++, LSBY(pc));
-					}else{	// stack is in register memory 
-					/* @SP <-- PC */
-					write_rm(sp++, MSBY(pc));
-					write_rm(sp++, LSBY(pc));
-					}
-					/* PC <-- dst */
-					pc = dest;
-					/***********IF ADDITION *************/
-					tcount =0;
-					fcount=0;
-					cexec=0;
-					#ifdef IF_TEST
-	                printf("flow of control tcount: %x fcount: %x cexec: %x \n", tcount, fcount, cexec);
-	                #endif
-					/***********************************/ 
-					sys_clock +=20; // 20 cycles
+					op_call_IRR(inst);
 					break;
 					
 					case 0x06: /* CALL (dst) DA 	*/
-					/* get destination */
-					dst = prog_mem_fetch();
-					dest = dst<<8;
-					dst = prog_mem_fetch();
-					dest = (dest|dst);
-					/* SP <-- SP-2 */
-					sp = SP;
-					sp =-0x02;
-					write_rm(SPL, LSBY(sp));
-					if(SPLOC==0){ // stack is in data mem
-						write_rm(SPH, MSBY(sp));
-						/* @SP <-- PC */
-						write_dm( sp++, MSBY(pc));
-						write_dm(sp, LSBY(pc));	
-					}else{// stack is in reg mem
-					/* @SP <-- PC */
-						write_rm( sp++, MSBY(pc));
-						write_rm(sp, LSBY(pc));	
-						#ifdef VEIW_STACK
-						printf(" stack holds : lo: %2x hi: %2x \n", read_rm(sp--), read_rm(sp));
-						#endif							
-					}
-					/* PC <-- dst */
-					pc = dest;
-					/*increment system clock */
-					sys_clock +=20; // 20 cycles
-					/***********IF ADDITION *************/
-					tcount =0;
-					fcount=0;
-					cexec=0;
-					#ifdef IF_TEST
-					printf("flow of control tcount: %x fcount: %x cexec: %x \n", tcount, fcount, cexec);
-					#endif
-					/***********************************/ 
-					#ifdef VEIW_MEM
-					printf("pc holds : %4x \n", pc);
-					#endif
+					op_call_DA(inst);
 					break;
 					
 					case 0x07:	/* LD X,r	*/
-					src = RPBLK|MSN(prog_mem_fetch()); // fetch register r
-					dst = prog_mem_fetch();    // fetch offset X
-					// dst <- reg_mem[R + offset]
-					write_rm(dst, read_rm(src+dst));
-					sys_clock +=10; //10 cycles 
+					op_ld_X_r(inst);
 					break;
           		}		
           		break;
@@ -2243,256 +4237,2272 @@ printf("Program counter holds : %x \n", pc);
           		switch (low_nib)
           		{
           			case 0x03:	/* LD (dst, src) Ir, r */
-          			dst = prog_mem_fetch();
-          			src = read_rm(RPBLK|LSN(dst));
-          			dst = read_rm(RPBLK|MSN(dst));
-          			write_rm(dst, src);	// dst <-- src
-          			sys_clock +=6; // 6 cycles 
+          			op_ld_Ir_r(inst);
           			break;
           			
           			case 0x05: /* LD (dst, src) IR, R */
-          			src = prog_mem_fetch(); //get IR
-          			regval = read_rm(src);  // regval <-- reg_mem{IR] i.e  
-          			src = read_rm(regval);  // src = reg_mem[R]
-          			dst = prog_mem_fetch();
-          			write_rm(dst, src);
-          			sys_clock +=10; // 10 cycles
+          			op_ld_IR_R(inst);
           			break;         			
           		}
           		break;
           	}
           }
      }
+}
+
+/*********************** TABLE DISPATCH ************************************/
+/* 256 entry table indexed by the full opcode byte. Each entry is a handler
+   specialized for the addressing mode, so no nibble decoding or get_args()
+   switch is done at run time. Filled by op_table_init() */
+void (*op_table[256])(BYTE inst);
+
+/* two operand handlers - one per addressing mode (lnib 2..7) */
+#define ALU_HANDLERS(op) \
+void op##_r_r(BYTE inst)   { BYTE dst; BYTE src = args_r_r(&dst);   op(dst, src); } \
+void op##_r_Ir(BYTE inst)  { BYTE dst; BYTE src = args_r_Ir(&dst);  op(dst, src); } \
+void op##_R_R(BYTE inst)   { BYTE dst; BYTE src = args_R_R(&dst);   op(dst, src); } \
+void op##_R_IR(BYTE inst)  { BYTE dst; BYTE src = args_R_IR(&dst);  op(dst, src); } \
+void op##_R_IM(BYTE inst)  { BYTE dst; BYTE src = args_R_IM(&dst);  op(dst, src); } \
+void op##_IR_IM(BYTE inst) { BYTE dst; BYTE src = args_IR_IM(&dst); op(dst, src); }
+
+ALU_HANDLERS(alu_add)
+ALU_HANDLERS(alu_adc)
+ALU_HANDLERS(alu_sub)
+ALU_HANDLERS(alu_sbc)
+ALU_HANDLERS(alu_or)
+ALU_HANDLERS(alu_and)
+ALU_HANDLERS(alu_tcm)
+ALU_HANDLERS(alu_tm)
+ALU_HANDLERS(alu_cp)
+ALU_HANDLERS(alu_xor)
+ALU_HANDLERS(alu_ld)
+
+/* single operand handlers - R (lnib 0) and IR (lnib 1) */
+#define UNARY_HANDLERS(op) \
+void op##_R(BYTE inst)  { op(args_R()); } \
+void op##_IR(BYTE inst) { op(args_IR()); }
+
+UNARY_HANDLERS(unary_dec)
+UNARY_HANDLERS(unary_rlc)
+UNARY_HANDLERS(unary_inc)
+UNARY_HANDLERS(unary_da)
+UNARY_HANDLERS(unary_pop)
+UNARY_HANDLERS(unary_com)
+UNARY_HANDLERS(unary_decw)
+UNARY_HANDLERS(unary_rl)
+UNARY_HANDLERS(unary_incw)
+UNARY_HANDLERS(unary_clr)
+UNARY_HANDLERS(unary_rrc)
+UNARY_HANDLERS(unary_sra)
+UNARY_HANDLERS(unary_rr)
+UNARY_HANDLERS(unary_swap)
+
+void unary_push_R(BYTE inst)  { unary_push(args_R(), 0x00); }
+void unary_push_IR(BYTE inst) { unary_push(args_IR(), 0x01); }
+
+#define SET_ALU(hi, op) \
+	op_table[(hi)<<4|0x02] = op##_r_r; \
+	op_table[(hi)<<4|0x03] = op##_r_Ir; \
+	op_table[(hi)<<4|0x04] = op##_R_R; \
+	op_table[(hi)<<4|0x05] = op##_R_IR; \
+	op_table[(hi)<<4|0x06] = op##_R_IM; \
+	op_table[(hi)<<4|0x07] = op##_IR_IM
+
+#define SET_UNARY(hi, op) \
+	op_table[(hi)<<4|0x00] = op##_R; \
+	op_table[(hi)<<4|0x01] = op##_IR
+
+/* operand bytes fetched by the handler of opcode inst - used to predecode */
+BYTE op_operands[256];
+
+BYTE op_operand_count(BYTE inst)
+{
+	if (op_table[inst] == op_none)
+		return 0;
+	switch (LSN(inst))
+	{
+		case 0x04:
+			return (inst == 0xD4) ? 1 : 2; // CALL IRR
+		case 0x05:
+		case 0x06:
+		case 0x07:
+		case 0x0D:
+			return 2;
+		case 0x0E:
+			return 0;
+		case 0x0F:
+			return (inst == 0x1F) ? 1 : 0; // IF cc,tf
+		default:
+			return 1;
+	}
+}
+
+/* initializes the dispatch table called by the mainline program */
+void op_table_init()
+{
+int i;
+
+for (i=0; i<256; i++)
+	op_table[i] = op_none;
+
+/* lnib 0x00, 0x01 */
+SET_UNARY(0x00, unary_dec);
+SET_UNARY(0x01, unary_rlc);
+SET_UNARY(0x02, unary_inc);
+op_table[0x30] = op_jp_IRR;
+op_table[0x31] = op_srp;
+SET_UNARY(0x04, unary_da);
+SET_UNARY(0x05, unary_pop);
+SET_UNARY(0x06, unary_com);
+SET_UNARY(0x07, unary_push);
+SET_UNARY(0x08, unary_decw);
+SET_UNARY(0x09, unary_rl);
+SET_UNARY(0x0A, unary_incw);
+SET_UNARY(0x0B, unary_clr);
+SET_UNARY(0x0C, unary_rrc);
+SET_UNARY(0x0D, unary_sra);
+SET_UNARY(0x0E, unary_rr);
+SET_UNARY(0x0F, unary_swap);
+
+/* lnib 0x02 .. 0x07 */
+SET_ALU(0x00, alu_add);
+SET_ALU(0x01, alu_adc);
+SET_ALU(0x02, alu_sub);
+SET_ALU(0x03, alu_sbc);
+SET_ALU(0x04, alu_or);
+SET_ALU(0x05, alu_and);
+SET_ALU(0x06, alu_tcm);
+SET_ALU(0x07, alu_tm);
+SET_ALU(0x0A, alu_cp);
+SET_ALU(0x0B, alu_xor);
+SET_ALU(0x0E, alu_ld);
+
+op_table[0x82] = op_lde_r_Irr;
+op_table[0x83] = op_ldei_Ir_Irr;
+op_table[0x92] = op_lde_Irr_r;
+op_table[0x93] = op_ldei_Irr_Ir;
+op_table[0xC2] = op_ldc_r_Irr;
+op_table[0xC3] = op_ldci_Ir_Irr;
+op_table[0xC7] = op_ld_r_X;
+op_table[0xD2] = op_ldc_Irr_r;
+op_table[0xD3] = op_ldci_Irr_Ir;
+op_table[0xD4] = op_call_IRR;
+op_table[0xD6] = op_call_DA;
+op_table[0xD7] = op_ld_X_r;
+op_table[0xF3] = op_ld_Ir_r;
+op_table[0xF5] = op_ld_IR_R;
+
+/* lnib 0x08 .. 0x0E - r or cc in hnib */
+for (i=0; i<0x10; i++)
+{
+	op_table[i<<4|0x08] = op_ld_r_R;
+	op_table[i<<4|0x09] = op_ld_R_r;
+	op_table[i<<4|0x0A] = op_djnz;
+	op_table[i<<4|0x0B] = op_jr;
+	op_table[i<<4|0x0C] = op_ld_r_IM;
+	op_table[i<<4|0x0D] = op_jp;
+	op_table[i<<4|0x0E] = op_inc_r;
+}
+
+/* lnib 0x0F - no-operand instructions */
+op_table[0x1F] = op_if;
+op_table[0x6F] = op_stop;
+op_table[0x7F] = op_halt;
+op_table[0x8F] = op_di;
+op_table[0x9F] = op_ei;
+op_table[0xAF] = op_ret;
+op_table[0xBF] = op_iret;
+op_table[0xCF] = op_rcf;
+op_table[0xDF] = op_scf;
+op_table[0xEF] = op_ccf;
+op_table[0xFF] = op_nop;
+
+for (i=0; i<256; i++)
+	op_operands[i] = op_operand_count(i);
+}
+
+/*********************** END OF CYCLE *************************************/
+/* Instruction cycle completed -- check for interrupts 
+   - call device check
+   - TRAPs - software-generated interrupts (SWI, SVC, etc) are caused
+     by turning IRQ bit on (see section 2.6.4 in assignment)
+   - IRET enables interrupts:
+      reg_mem[IRQ] |= INT_ENA;
+   - Concurrent interrupts are possible if timer and uart interrupt at 
+     same time
+*/
+void check_interrupts()
+{
+BYTE src;
+BYTE dst;
+BYTE regval;
+WORD dest;
+     if ((reg_mem[IMR] & INT_ENA) && reg_mem[IRQ] != 0)
+     {
+          /* CPU interrupts enabled and one or more pending interrupts
+	       - check interrupt mask (IMR) if device allowed 
+          */
+          if ((reg_mem[IMR] & reg_mem[IRQ]) & IRQ_MASK)
+          {
+#ifdef IE_TEST
+printf("Interrupt on IMR: %02x\n", 
+                  reg_mem[IMR] & reg_mem[IRQ]);
+#endif
+               /* At least one interrupt pending 
+                - if single, proceed
+                - if multiple, determine priority to select
+                - push Flags, PC lo, and PC hi
+                - clear interrupt status bit (IMR[7])
+                - PC hi = device vector[n]
+                - PC lo = device vector[n+1]
+                - ISR entered on this clock tick 
+                - Pending interrupts remain until after IRET
+                - IRET enables interrupt
+                - update sys_clock with interrupt overhead
+               */
+               
+               switch (reg_mem[IRQ])
+               {
+               	case IRQ0:
+               		/* IRQ0 interrupt */
+               		regval = 0x00; // reg_val holds the value of the IRQ index
+               		break;
+               	case IRQ1:
+               		regval = 0x01;
+               		break;
+               	case IRQ2:
+               		regval = 0x02;
+               		break;
+               	case IRQ3:
+               		regval = 0x03;
+               		break;
+               	case IRQ4:
+               		regval = 0x04;
+               		break;
+               	case IRQ5:
+               		regval = 0x05;
+               		break;
+               	default:
+               		/* more than one pending interrupt
+               		   call polling function to determine by priority 
+					   returns IRQ with highest priority */
+               		regval = polling();
+               }
+               /* get interrupt vector */
+				dst = regval*2; // Interrupt vector holds two contiguous locations in memory
+				dest = read_pm(dst); // hi byte is 00
+				dest = dest <<8 | (read_pm(dst+1));
+				/* PUSH PC lo and PC hi unto stack */
+				/* SP <-- SP-2 */
+				sp = SP;
+				sp =-0x02;
+				write_rm(SPL, LSBY(sp));
+				if(SPLOC==0){ // stack is in data mem
+					write_rm(SPH, MSBY(sp));
+					/* @SP <-- PC */
+					write_dm( sp++, MSBY(pc));
+					write_dm(sp, LSBY(pc));	
+				}else{// stack is in reg mem
+				/* @SP <-- PC */
+					write_rm( sp++, MSBY(pc));
+					write_rm(sp, LSBY(pc));								
+				}
+				/* PC <-- interrupt vector */
+				pc = dest;
+				#ifdef IE_TEST
+				printf(" pc holds interrupt vector : %x \n", pc);
+				#endif
+				
+				/*increment system clock */
+				sys_clock +=20; // 20 cycles
+				
+				/* PUSH flags unto stack */
+				/* SP <-- SP-1 */
+				sp =SP-0x01;
+				write_rm(SPL, LSBY(sp));
+				/*@SP <-- src */				
+				src = read_rm(FLAGS);
+				if (SPLOC == 0){ //stack is in data memory
+				write_dm(sp, src);
+				write_rm(SPH, MSBY(sp));
+				sys_clock += 2; // 2 extra cycles for external stack
+				}else{	// stack is in register mermory
+				write_rm(SPL, src);
+				}
+				sys_clock +=10; // 10 cycles for pushing
+				/* clear interrupt status bit */
+				reg_mem[IMR] &= ~INT_ENA; 
+				
+				/* clear IRQ bit to signal interrupt is being handled*/
+				switch(regval){
+					case 0x00:
+						dst = IRQ0;
+						break;
+					case 0x01:
+						dst = IRQ1;
+						break;
+					case 0x02:
+						dst = IRQ2;
+						break;
+					case 0x03:
+						dst = IRQ3;
+						break;
+					case 0x04:
+						dst = IRQ4;
+						break;
+					case 0x05:
+						dst = IRQ5;
+						break;
+				}
+				reg_mem[IRQ] &= ~dst; 
+				/* 6 cycles for clearing */
+				sys_clock +=6; // total of atleast 36 cycles overhead
+          }
+     }
+}
+
+/**********************************IF ADDITION ****************************/
+/* step the IF sequence: restore the flags while a part is executing and 
+   skip over the part that is not executed */
+void if_sequence()
+{
+int i;
+BYTE inst;
+     if(cexec) // cexec is 1
+     {
+     	if(tcount>0x00 && tcount<0x04) //sanity check
+     	{
+     		#ifdef IF_TEST
+     		if (!batch)
+     		printf("executing true part, tcount: %x \n", tcount);
+     		#endif
+     		/* execute true part of the statement */
+     		tcount--; // decrement the count of true instructions
+     		/* restore flags */
+     		write_rm(FLAGS, tempflags);
+     	}
+     	else if(fcount>0x00 && fcount<0x04)
+     	{
+     		/* do not execute false part skip over false part
+			  increment program counter by number of bytes required per instruction */
+			  for(i=fcount; i>0; i--)
+			  {
+			  	#ifdef IF_TEST
+			  	if (!batch)
+			  	printf("skipping false part, fcount: %x \n", fcount);
+			  	#endif
+			  	fcount--;
+			  	inst = prog_mem_fetch(); // fetch opcode 
+			  	pc +=opcode_size[MSN(inst)][LSN(inst)]; // increment pc by size of operands for opcode
+			  }
+			  /* restore flags */
+     		  write_rm(FLAGS, tempflags);
+     	}
+     }
+     else { // cexec == 0,  execute false part only 
+     	if(tcount>0x00 && tcount<0x04)
+     	{
+     		for(i=tcount; i>0; i--)
+     		{
+     			#ifdef IF_TEST
+	     		if (!batch)
+	     		printf("skipping true part, tcount: %x \n", tcount);
+	     		#endif
+	     		tcount--;
+     			inst = prog_mem_fetch(); // fetch opcode
+			  	pc +=opcode_size[MSN(inst)][LSN(inst)]; // increment pc by size of operands for opcode
+     		}
+     	}
+     	else if(fcount>0x00 && fcount<0x04)
+     	{
+     		/* execute false part */
+     		#ifdef IF_TEST
+     		if (!batch)
+     		printf("executing false part, fcount: %x \n", fcount);
+     		#endif
+     		fcount--; //decrement false count
+     		/* restore Flags */
+     		write_rm(FLAGS, tempflags);
+     	}
+     }
+}
+
+unsigned long inst_limit = 30; /* Stop after this many instruction cycles - 0 for no limit */
+unsigned long cycle_limit;     /* Stop when sys_clock reaches this - 0 for no limit */
+
+/* TRUE while the machine may start another instruction cycle */
+#define MACHINE_GO	(running && (inst_limit == 0 || sanity < inst_limit) \
+			 && (cycle_limit == 0 || sys_clock < cycle_limit))
+
+/* start of an instruction cycle - trace before the opcode is fetched */
+void begin_cycle()
+{
+#ifdef IE_TEST
+if (!batch)
+printf("Time: %02d  IRQ: %02x\n", sys_clock, reg_mem[IRQ]);
+#endif
+
+     
+/* Get next instruction and decode */
+#ifdef WATCH
+if (!batch)
+printf("Program counter holds : %x \n", pc);
+#endif
+z8->inst_pc = pc;
+}
+
+/* instruction executed - devices, interrupts, IF sequence and the 
+   per cycle displays. Shared by all dispatch engines */
+void end_cycle()
+{
+#ifdef IE_TEST
+BYTE regval;	 /* temp to emulate OR instruction */
+
+     switch(sanity)
+     {
+     case 3:
+            write_rm(PORT0, 0x83); /* Timer: continuous & 3x2 (6) cycles */
+            break;
+     case 11:
+     case 16:
+            /* Emulate ISR:
+               - Acknowledge IRQ0 interrupt - emulate OR 
+            */
+            regval = read_rm(IRQ);
+            regval &= ~IRQ0;      /* Mask off IRQ0 only */
+            write_rm(IRQ, regval);
+            break;
+     case 12:
+     case 17:
+            /* Emulate ISR:
+               - Emulate IRET - reenable interrupts */
+            reg_mem[IMR] |= INT_ENA;
+            break;
+            
+     }
+#endif
+     
+     #ifdef IE_TEST
+	 TIMER_check();
+     //UART_check();
+     #endif
+
+     check_interrupts();
+     if_sequence();
+     
+     #ifdef IE_TEST
+     if (!batch)
+     printf("System clock : %x \n", sys_clock);
+     #endif
+     if (!batch)
+     {
+          disp_reg_mem();
+          #ifdef VEIW_CACHE
+          veiw_cache();
+          #endif
+          test_prog();
+     }
+     sys_clock++;
+     sanity++;
+}
+
+#ifdef THREADED_DISPATCH
+/*********************** THREADED DISPATCH *********************************/
+/* every handler named in op_table_init(), listed for the threaded engine */
+#define ALU_LIST(X, op) \
+	X(op##_r_r) X(op##_r_Ir) X(op##_R_R) X(op##_R_IR) X(op##_R_IM) X(op##_IR_IM)
+#define UNARY_LIST(X, op) \
+	X(op##_R) X(op##_IR)
+
+#define HANDLER_LIST(X) \
+	ALU_LIST(X, alu_add) ALU_LIST(X, alu_adc) ALU_LIST(X, alu_sub) \
+	ALU_LIST(X, alu_sbc) ALU_LIST(X, alu_or) ALU_LIST(X, alu_and) \
+	ALU_LIST(X, alu_tcm) ALU_LIST(X, alu_tm) ALU_LIST(X, alu_cp) \
+	ALU_LIST(X, alu_xor) ALU_LIST(X, alu_ld) \
+	UNARY_LIST(X, unary_dec) UNARY_LIST(X, unary_rlc) UNARY_LIST(X, unary_inc) \
+	UNARY_LIST(X, unary_da) UNARY_LIST(X, unary_pop) UNARY_LIST(X, unary_com) \
+	UNARY_LIST(X, unary_push) UNARY_LIST(X, unary_decw) UNARY_LIST(X, unary_rl) \
+	UNARY_LIST(X, unary_incw) UNARY_LIST(X, unary_clr) UNARY_LIST(X, unary_rrc) \
+	UNARY_LIST(X, unary_sra) UNARY_LIST(X, unary_rr) UNARY_LIST(X, unary_swap) \
+	X(op_ld_r_R) X(op_ld_R_r) X(op_djnz) X(op_jr) X(op_ld_r_IM) X(op_jp) \
+	X(op_inc_r) X(op_if) X(op_stop) X(op_halt) X(op_di) X(op_ei) X(op_ret) \
+	X(op_iret) X(op_rcf) X(op_scf) X(op_ccf) X(op_nop) X(op_none) \
+	X(op_jp_IRR) X(op_srp) X(op_lde_r_Irr) X(op_ldei_Ir_Irr) X(op_lde_Irr_r) \
+	X(op_ldei_Irr_Ir) X(op_ldc_r_Irr) X(op_ldci_Ir_Irr) X(op_ld_r_X) \
+	X(op_ldc_Irr_r) X(op_ldci_Irr_Ir) X(op_call_IRR) X(op_call_DA) \
+	X(op_ld_X_r) X(op_ld_Ir_r) X(op_ld_IR_R)
+
+/* Threaded code emulator (GCC/Clang labels as values)
+   - one label per handler, the label address table is built from op_table
+   - each handler ends by fetching the next opcode and jumping straight to
+     its label, so there is one indirect branch per handler instead of a
+     single shared one at the top of the loop
+*/
+void run_threaded()
+{
+static void *labels[256];
+static int built = FALSE;
+BYTE inst;       /* Current instruction */
+int i;
+
+if (!built)
+{
+	/* op_table holds function pointers, labels holds the matching
+	   label addresses - one lookup per opcode at start up only */
+	for (i=0; i<256; i++)
+	{
+#define LABEL_OF(h)	if (op_table[i] == h) labels[i] = &&h;
+		HANDLER_LIST(LABEL_OF)
+#undef LABEL_OF
+	}
+	built = TRUE;
+}
+
+#define NEXT \
+	end_cycle(); \
+	if (!MACHINE_GO) \
+		return; \
+	begin_cycle(); \
+	inst = prog_mem_fetch(); \
+	goto *labels[inst]
+
+if (!MACHINE_GO)
+	return;
+begin_cycle();
+inst = prog_mem_fetch();
+goto *labels[inst];
+
+#define HANDLER_BODY(h)	h: h(inst); NEXT;
+HANDLER_LIST(HANDLER_BODY)
+#undef HANDLER_BODY
+#undef NEXT
+}
+#endif
+
+/*********************** PREDECODED BLOCKS *********************************/
+/* Straight line runs of program memory are decoded once into a dec_block 
+   (handler, opcode and operand bytes per instruction) and executed from
+   there on every later visit. A block ends at the first instruction that
+   can change the flow of control.
+   - blocks are held in a direct mapped table indexed by the start address,
+     allocated the first time a machine runs from blocks
+   - block_page[] counts the blocks overlapping each 256 byte page, so a 
+     store to program memory only searches the table when code is there 
+   - write_pm() (LDC, LDCI) and the loader call block_invalidate() 
+   NOTE: operands of a predecoded instruction are not refetched, so they 
+   are not seen by cache() again until the block is decoded again
+*/
+/* pages spanned by a block - a block may wrap around 0xFFFF */
+void block_pages(struct dec_block *blk, int incr)
+{
+	WORD addr;
+	BYTE page;
+	addr = blk->start;
+	page = MSBY(addr);
+	z8->block_page[page] += incr;
+	while (addr != blk->end)
+	{
+		if (MSBY(addr) != page)
+		{
+			page = MSBY(addr);
+			z8->block_page[page] += incr;
+		}
+		addr++;
+	}
+}
+
+void block_drop(struct dec_block *blk)
+{
+	if (!blk->valid)
+		return;
+	blk->valid = FALSE;
+	block_pages(blk, -1);
+}
+
+/* program memory at addr has been (or is about to be) written -
+   drop every block holding that byte */
+void block_invalidate(WORD addr)
+{
+	int i;
+	WORD len;
+	if (z8->block_page[MSBY(addr)] == 0)
+		return;
+	for (i=0; i<BLOCK_CACHE_SIZE; i++)
+	{
+		len = z8->block_cache[i].end - z8->block_cache[i].start;
+		if (z8->block_cache[i].valid && (WORD)(addr - z8->block_cache[i].start) < len)
+			block_drop(&z8->block_cache[i]);
+	}
+}
+
+/* program page has been rewritten as a whole (snapshot restore) - drop 
+   every block holding a byte of it */
+void block_invalidate_page(BYTE page)
+{
+	int i;
+	WORD len;
+	if (z8->block_page[page] == 0)
+		return;
+	for (i=0; i<BLOCK_CACHE_SIZE; i++)
+	{
+		len = z8->block_cache[i].end - z8->block_cache[i].start;
+		if (z8->block_cache[i].valid && ((WORD)(z8->block_cache[i].start - (page<<8)) < 256
+		    || (WORD)((page<<8) - z8->block_cache[i].start) < len))
+			block_drop(&z8->block_cache[i]);
+	}
+}
+
+/* does opcode inst end a block? (jumps, calls, returns, IF and STOP) */
+int block_ends(BYTE inst)
+{
+	switch (LSN(inst))
+	{
+		case 0x0A: /* DJNZ */
+		case 0x0B: /* JR */
+		case 0x0D: /* JP cc */
+			return TRUE;
+	}
+	switch (inst)
+	{
+		case 0x30: /* JP IRR */
+		case 0xD4: /* CALL IRR */
+		case 0xD6: /* CALL DA */
+		case 0x1F: /* IF */
+		case 0x6F: /* STOP */
+		case 0x7F: /* HALT */
+		case 0xAF: /* RET */
+		case 0xBF: /* IRET */
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* decode the block starting at addr into blk */
+void block_decode(struct dec_block *blk, WORD addr)
+{
+	struct dec_inst *di;
+	BYTE inst;
+	int i;
+
+	block_drop(blk);
+	blk->start = addr;
+	blk->count = 0;
+	blk->branch = addr;  /* no branch target unless found below */
+	blk->cycles = 0;
+	blk->entries = 0;
+	blk->native = NULL;
+	blk->succ[0] = NULL;
+	blk->succ[1] = NULL;
+	do
+	{
+		di = &blk->inst[blk->count++];
+		inst = read_pm(addr++);
+		di->opcode = inst;
+		di->handler = op_table[inst];
+		di->size = op_operands[inst] + 1;
+		for (i=0; i<op_operands[inst]; i++)
+			di->ops[i] = read_pm(addr++);
+	}
+	while (!block_ends(inst) && blk->count < BLOCK_MAX);
+
+	blk->end = addr;
+	blk->fall_through = addr;
+	switch (LSN(inst))
+	{
+		case 0x0A: /* DJNZ r,RA */
+		case 0x0B: /* JR cc,RA */
+			blk->branch = addr + SIGN_EXT(di->ops[0]);
+			break;
+		case 0x0D: /* JP cc,DA */
+			blk->branch = di->ops[0]<<8 | di->ops[1];
+			break;
+	}
+	if (inst == 0xD6) /* CALL DA */
+		blk->branch = di->ops[0]<<8 | di->ops[1];
+	blk->valid = TRUE;
+	block_pages(blk, 1);
+}
+
+/* block starting at addr, decoding it if it is not in block_cache */
+struct dec_block *block_lookup(WORD addr)
+{
+	struct dec_block *blk;
+	blk = &z8->block_cache[addr & (BLOCK_CACHE_SIZE-1)];
+	if (!blk->valid || blk->start != addr)
+		block_decode(blk, addr);
+	return blk;
+}
+
+/* block to run after blk - follow the chain when control left blk through
+   its fall through or branch target */
+struct dec_block *block_next(struct dec_block *blk)
+{
+	struct dec_block **link;
+	if (pc == blk->fall_through)
+		link = &blk->succ[0];
+	else if (pc == blk->branch)
+		link = &blk->succ[1];
+	else
+		return block_lookup(pc);
+	if (*link == NULL || !(*link)->valid || (*link)->start != pc)
+		*link = block_lookup(pc);
+	return *link;
+}
+
+/* more instructions of blk to run? - called between the instructions of 
+   a translated block */
+int block_continue(struct dec_block *blk, WORD next)
+{
+	return MACHINE_GO && blk->valid && pc == next;
+}
+
+/* run the predecoded instructions of blk
+   returns TRUE if every instruction in the block was executed */
+int block_interpret(struct dec_block *blk)
+{
+struct dec_inst *di;
+WORD addr;
+int i;
+
+addr = blk->start;
+for (i=0; i<blk->count; i++)
+{
+	di = &blk->inst[i];
+	begin_cycle();
+	pc = addr + 1;
+	z8->fetch_ops = di->ops;
+	di->handler(di->opcode);
+	z8->fetch_ops = NULL;
+	addr += di->size;
+	end_cycle();
+	if (i+1 < blk->count && !block_continue(blk, addr))
+		return FALSE;
+}
+return TRUE;
+}
+
+#ifdef JIT_DISPATCH
+/*********************** x86-64 TRANSLATION *********************************/
+/* Blocks entered JIT_THRESHOLD times are translated into x86-64 code in
+   jit_buf. Each instruction becomes
+   - a call to its handler with pc and fetch_ops set up as block_interpret()
+     does, or
+   - inline code for LD r,IM  LD r,R  LD R,r  LD R,R  LD R,IM, the register
+     modes (r,r  R,R  R,IM) of ADD ADC SUB SBC CP OR AND TCM TM XOR, and
+     DJNZ, JR cc and JP cc. The inline code checks that every register it
+     touches is RA_RDWR and takes the handler call when it is not
+     (devices, read only, E0..EF)
+   In batch mode (nothing traced) the begin and end of cycle are inline
+   too - end_cycle() is called only after a handler or when an interrupt
+   may be taken, block_continue() only after a handler. Otherwise every
+   instruction calls begin_cycle(), end_cycle() and block_continue().
+   Inline code leaves the flags and the carry, zero, sign ... variables as
+   the handlers do. With LAZY_FLAGS only the LD forms and DJNZ are inline,
+   with JUMP traces only in batch mode.
+   rbx holds z8 while translated code runs.
+   The buffer is mapped RW while code is written and RX while it runs.
+   When it is full every translation is dropped and it is reused.
+*/
+/* x86-64 registers */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RDI 7
+
+/* attribute of a register from its content address */
+#define RA_OFF  (z8->reg_attr - reg_mem)
+
+void jit_emit(BYTE b)
+{
+	if (z8->jit_used < JIT_BUF_SIZE)
+		z8->jit_buf[z8->jit_used++] = b;
+	else
+		z8->jit_full = TRUE;
+}
+
+void jit_emit32(unsigned v)
+{
+	jit_emit(v); jit_emit(v>>8); jit_emit(v>>16); jit_emit(v>>24);
+}
+
+void jit_emit64(unsigned long long v)
+{
+	jit_emit32(v); jit_emit32(v>>32);
+}
+
+/* movabs reg, imm64 */
+void jit_mov64(BYTE reg, void *ptr)
+{
+	jit_emit(0x48); jit_emit(0xB8+reg); jit_emit64((unsigned long long) ptr);
+}
+
+/* movabs rax, fn ; call rax */
+void jit_call(void *fn)
+{
+	jit_mov64(RAX, fn);
+	jit_emit(0xFF); jit_emit(0xD0);
+}
+
+/* ModRM and displacement of [rbx + field of the machine] - reg is the
+   register or opcode extension of the instruction */
+void jit_field(BYTE reg, void *field)
+{
+	jit_emit(0x83 | reg<<3); jit_emit32((char *) field - (char *) z8);
+}
+
+/* jcc/jmp rel32 with the displacement to be patched - returns its offset */
+unsigned jit_jump(BYTE cc)
+{
+	if (cc == 0)
+		jit_emit(0xE9); /* jmp */
+	else{
+		jit_emit(0x0F); jit_emit(cc);
+	}
+	jit_emit32(0);
+	return z8->jit_used - 4;
+}
+
+/* point the jump at offset "at" to the current position */
+void jit_patch(unsigned at)
+{
+	unsigned rel;
+	if (z8->jit_full)
+		return;
+	rel = z8->jit_used - (at + 4);
+	z8->jit_buf[at] = rel; z8->jit_buf[at+1] = rel>>8;
+	z8->jit_buf[at+2] = rel>>16; z8->jit_buf[at+3] = rel>>24;
+}
+
+#define JNE 0x85
+#define JE  0x84
+#define JAE 0x83
+#define JMP 0x00
+
+/* pc <-- addr */
+void jit_set_pc(WORD addr)
+{
+	jit_emit(0x66); jit_emit(0xC7); jit_field(0, &pc); jit_emit(addr); jit_emit(addr>>8);
+}
+
+/* sys_clock += cycles */
+void jit_add_clock(BYTE cycles)
+{
+	jit_emit(0x48); jit_emit(0x83); jit_field(0, &sys_clock); jit_emit(cycles);
+}
+
+/* mov byte [field], value */
+void jit_set_field(BYTE *field, BYTE value)
+{
+	jit_emit(0xC6); jit_field(0, field); jit_emit(value);
+}
+
+/* cmp byte [reg+RA_OFF], RA_RDWR ; jne slow */
+void jit_check_rdwr(BYTE reg)
+{
+	jit_emit(0x80); jit_emit(0xB8+reg); jit_emit32(RA_OFF); jit_emit(RA_RDWR);
+	z8->jit_slow[z8->jit_nslow++] = jit_jump(JNE);
+}
+
+/* FLAGS must be RA_RDWR too when inline code sets or tests it */
+void jit_check_flags()
+{
+	jit_emit(0x80); jit_field(7, &z8->reg_attr[FLAGS]); jit_emit(RA_RDWR);
+	z8->jit_slow[z8->jit_nslow++] = jit_jump(JNE);
+}
+
+/* rdx <-- &reg_mem[RPBLK | n] and check it is RA_RDWR */
+void jit_work_reg(BYTE n)
+{
+	jit_mov64(RAX, &reg_mem[RP]);
+	jit_emit(0x0F); jit_emit(0xB6); jit_emit(0x08);             /* movzx ecx, byte [rax] */
+	jit_emit(0xC1); jit_emit(0xE1); jit_emit(0x04);             /* shl ecx, 4 */
+	jit_emit(0x83); jit_emit(0xC9); jit_emit(n);                /* or ecx, n */
+	jit_emit(0x0F); jit_emit(0xB6); jit_emit(0xC9);             /* movzx ecx, cl */
+	jit_emit(0x80); jit_emit(0xF9); jit_emit(RP);               /* cmp cl, RP */
+	z8->jit_slow[z8->jit_nslow++] = jit_jump(JE);               /* see jit_plain() */
+#ifdef LAZY_FLAGS
+	jit_emit(0x80); jit_emit(0xF9); jit_emit(FLAGS);            /* cmp cl, FLAGS */
+	z8->jit_slow[z8->jit_nslow++] = jit_jump(JE);               /* may be pending */
+#endif
+	jit_mov64(RDX, reg_mem);
+	jit_emit(0x48); jit_emit(0x01); jit_emit(0xCA);             /* add rdx, rcx */
+	jit_check_rdwr(RDX);
+}
+
+/* reg <-- &reg_mem[r] and check it is RA_RDWR */
+void jit_reg(BYTE reg, BYTE r)
+{
+	jit_mov64(reg, &reg_mem[r]);
+	jit_check_rdwr(reg);
+}
+
+/* mov byte [reg], imm8 */
+void jit_store_imm(BYTE reg, BYTE value)
+{
+	jit_emit(0xC6); jit_emit(reg); jit_emit(value);
+}
+
+/* mov cl, [src] ; mov [dst], cl */
+void jit_copy(BYTE dst, BYTE src)
+{
+	jit_emit(0x8A); jit_emit(0x08+src);
+	jit_emit(0x88); jit_emit(0x08+dst);
+}
+
+/* can inline code use register r directly? */
+int jit_plain(BYTE r)
+{
+	if (r == RP)
+		return FALSE; /* write_rm() finds the working registers again */
+#ifdef LAZY_FLAGS
+	if (r == FLAGS)
+		return FALSE; /* pending flags are applied by read_rm/write_rm */
+#endif
+	return TRUE;
+}
+
+/* if_reset() - called while IF_TEST traces it */
+void jit_if_reset()
+{
+#ifdef IF_TEST
+	if (!batch)
+	{
+		jit_call(if_reset);
+		return;
+	}
+#endif
+	jit_set_field(&tcount, 0);
+	jit_set_field(&fcount, 0);
+	jit_set_field(&cexec, 0);
+}
+
+#ifndef LAZY_FLAGS
+/* edx <-- (eax ^ ecx) >> shift & 1 (shift 0 - eax >> 8 & 1), flipped if
+   invert, into field and or'ed into esi at bit */
+void jit_alu_flag(int shift, int invert, BYTE *field, BYTE bit)
+{
+	jit_emit(0x89); jit_emit(0xC2);                             /* mov edx, eax */
+	if (shift){
+		jit_emit(0x31); jit_emit(0xCA);                         /* xor edx, ecx */
+	}
+	jit_emit(0xC1); jit_emit(0xEA); jit_emit(shift ? shift : 8); /* shr edx, shift */
+	jit_emit(0x83); jit_emit(0xE2); jit_emit(0x01);             /* and edx, 1 */
+	if (invert){
+		jit_emit(0x83); jit_emit(0xF2); jit_emit(0x01);         /* xor edx, 1 */
+	}
+	jit_emit(0x88); jit_field(RDX, field);                      /* mov [field], dl */
+	jit_emit(0xC1); jit_emit(0xE2); jit_emit(bit);              /* shl edx, bit */
+	jit_emit(0x09); jit_emit(0xD6);                             /* or esi, edx */
+}
+
+/* inline code for the register modes of the two operand instructions -
+   registers and flags as alu_add() ... alu_xor() leave them */
+int jit_alu(struct dec_inst *di, WORD next, unsigned *done)
+{
+	BYTE op = MSN(di->opcode);
+	int sub = (op == 0x02 || op == 0x03 || op == 0x0A);
+
+	if (op > 0x07 && op != 0x0A && op != 0x0B)
+		return FALSE;
+	/* rdi <-- &dst, esi <-- src as args_r_r(), args_R_R(), args_R_IM() */
+	switch (LSN(di->opcode))
+	{
+	case 0x02: /* r,r */
+		jit_work_reg(LSN(di->ops[0]));
+		jit_emit(0x0F); jit_emit(0xB6); jit_emit(0x32);         /* movzx esi, byte [rdx] */
+		jit_work_reg(MSN(di->ops[0]));
+		break;
+	case 0x04: /* R,R */
+		if (!jit_plain(di->ops[0]) || !jit_plain(di->ops[1]))
+			return FALSE;
+		jit_reg(RAX, di->ops[0]);
+		jit_emit(0x0F); jit_emit(0xB6); jit_emit(0x30);         /* movzx esi, byte [rax] */
+		jit_reg(RDX, di->ops[1]);
+		break;
+	case 0x06: /* R,IM */
+		if (!jit_plain(di->ops[0]))
+			return FALSE;
+		jit_reg(RDX, di->ops[0]);
+		jit_emit(0xBE); jit_emit32(di->ops[1]);                 /* mov esi, imm */
+		break;
+	default:
+		return FALSE;
+	}
+	jit_check_flags();
+	jit_emit(0x48); jit_emit(0x89); jit_emit(0xD7);             /* mov rdi, rdx */
+	jit_emit(0x0F); jit_emit(0xB6); jit_emit(0x0F);             /* movzx ecx, byte [rdi] */
+
+	if (op < 0x04 || op == 0x0A)
+	{
+		/* ADD ADC SUB SBC CP - as adder() and subber() */
+		if (op == 0x01 || op == 0x03)
+		{
+			jit_emit(0x0F); jit_emit(0xB6); jit_field(RAX, &carry); /* movzx eax, byte [carry] */
+			jit_emit(0x01); jit_emit(0xC6);                     /* add esi, eax */
+		}
+		jit_emit(0x89); jit_emit(0xC8);                         /* mov eax, ecx */
+		jit_emit(sub ? 0x29 : 0x01); jit_emit(0xF0);            /* sub/add eax, esi */
+		jit_emit(0x31); jit_emit(0xF6);                         /* xor esi, esi - new flags */
+		jit_alu_flag(0, sub, &carry, 7);
+		jit_emit(0x31); jit_emit(0xD2);                         /* xor edx, edx */
+		jit_emit(0x84); jit_emit(0xC0);                         /* test al, al */
+		jit_emit(0x0F); jit_emit(0x94); jit_emit(0xC2);         /* sete dl */
+		jit_emit(0x88); jit_field(RDX, &zero);                  /* mov [zero], dl */
+		jit_emit(0xC1); jit_emit(0xE2); jit_emit(6);            /* shl edx, 6 */
+		jit_emit(0x09); jit_emit(0xD6);                         /* or esi, edx */
+		jit_emit(0x89); jit_emit(0xC2);                         /* mov edx, eax */
+		jit_emit(0x81); jit_emit(0xE2); jit_emit32(0x80);       /* and edx, 0x80 */
+		jit_emit(0x88); jit_field(RDX, &sign);                  /* mov [sign], dl */
+		jit_emit(0xC1); jit_emit(0xEA); jit_emit(2);            /* shr edx, 2 */
+		jit_emit(0x09); jit_emit(0xD6);                         /* or esi, edx */
+		jit_alu_flag(7, FALSE, &overflow, 4);
+		jit_set_field(&decimal_adjust, sub);
+		if (sub){
+			jit_emit(0x83); jit_emit(0xCE); jit_emit(0x08);     /* or esi, D */
+		}
+		jit_alu_flag(4, sub, &half_carry, 2);
+		jit_emit(0x0F); jit_emit(0xB6); jit_field(RDX, &reg_mem[FLAGS]); /* movzx edx, byte [FLAGS] */
+		jit_emit(0x83); jit_emit(0xE2); jit_emit(0x03);         /* and edx, 0x03 */
+		jit_emit(0x09); jit_emit(0xF2);                         /* or edx, esi */
+		jit_emit(0x88); jit_field(RDX, &reg_mem[FLAGS]); /* mov [FLAGS], dl */
+		if (op != 0x0A){
+			jit_emit(0x88); jit_emit(0x07);                     /* mov [rdi], al */
+		}
+	}
+	else
+	{
+		/* OR AND TCM TM XOR - as alu_or() ... */
+		jit_emit(0x89); jit_emit(0xC8);                         /* mov eax, ecx */
+		switch (op)
+		{
+		case 0x04: /* OR */
+			jit_emit(0x09); jit_emit(0xF0);                     /* or eax, esi */
+			break;
+		case 0x06: /* TCM */
+			jit_emit(0xF7); jit_emit(0xD0);                     /* not eax */
+			/* fall through */
+		case 0x05: /* AND */
+		case 0x07: /* TM */
+			jit_emit(0x21); jit_emit(0xF0);                     /* and eax, esi */
+			break;
+		case 0x0B: /* XOR - stored, flags from the old value */
+			jit_emit(0x31); jit_emit(0xF0);                     /* xor eax, esi */
+			jit_emit(0x88); jit_emit(0x07);                     /* mov [rdi], al */
+			jit_emit(0x89); jit_emit(0xC8);                     /* mov eax, ecx */
+			break;
+		}
+		/* Z and S from eax, V cleared */
+		jit_emit(0x0F); jit_emit(0xB6); jit_field(RDX, &reg_mem[FLAGS]); /* movzx edx, byte [FLAGS] */
+		jit_emit(0x83); jit_emit(0xE2); jit_emit(0x8F);         /* and edx, ~(Z|S|V) */
+		jit_emit(0x31); jit_emit(0xC9);                         /* xor ecx, ecx */
+		jit_emit(0x84); jit_emit(0xC0);                         /* test al, al */
+		jit_emit(0x0F); jit_emit(0x94); jit_emit(0xC1);         /* sete cl */
+		jit_emit(0xC1); jit_emit(0xE1); jit_emit(6);            /* shl ecx, 6 */
+		jit_emit(0x09); jit_emit(0xCA);                         /* or edx, ecx */
+		jit_emit(0x25); jit_emit32(0x80);                       /* and eax, 0x80 */
+		jit_emit(0xC1); jit_emit(0xE8); jit_emit(2);            /* shr eax, 2 */
+		jit_emit(0x09); jit_emit(0xC2);                         /* or edx, eax */
+		jit_emit(0x88); jit_field(RDX, &reg_mem[FLAGS]); /* mov [FLAGS], dl */
+	}
+	jit_set_pc(next);
+	jit_add_clock(LSN(di->opcode) == 0x02 ? 6 : 10);
+	done[0] = jit_jump(JMP);
+	return TRUE;
+}
+
+/* cond_handler() for condition code cc - returns the jcc that skips the
+   jump (JMP for cc 0, cc 8 needs no test) */
+BYTE jit_cond(BYTE cc)
+{
+	int bit;
+
+	jit_check_flags();
+	jit_emit(0x0F); jit_emit(0xB6); jit_field(RAX, &reg_mem[FLAGS]); /* movzx eax, byte [FLAGS] */
+	for (bit=7; bit>=4; bit--)
+	{
+		jit_emit(0x89); jit_emit(0xC2);                         /* mov edx, eax */
+		jit_emit(0xC1); jit_emit(0xEA); jit_emit(bit);          /* shr edx, bit */
+		jit_emit(0x83); jit_emit(0xE2); jit_emit(0x01);         /* and edx, 1 */
+		jit_emit(0x88); jit_field(RDX, bit == 7 ? &carry : bit == 6 ? &zero
+		                               : bit == 5 ? &sign : &overflow); /* mov [flag], dl */
+	}
+	jit_add_clock(10);
+	switch (cc & 0x07)
+	{
+	case 0x00:
+		return JMP;
+	case 0x01: /* (S XOR V) = 0 for 1 and 9 alike, as cond_handler() */
+	case 0x02: /* Z OR (S XOR V) */
+		jit_emit(0x89); jit_emit(0xC2);                         /* mov edx, eax */
+		jit_emit(0xD1); jit_emit(0xEA);                         /* shr edx, 1 - S to V */
+		jit_emit(0x31); jit_emit(0xC2);                         /* xor edx, eax */
+		if ((cc & 0x07) == 0x01)
+		{
+			jit_emit(0xF6); jit_emit(0xC2); jit_emit(0x10);     /* test dl, 0x10 */
+			return JNE;
+		}
+		jit_emit(0x89); jit_emit(0xC1);                         /* mov ecx, eax */
+		jit_emit(0xC1); jit_emit(0xE9); jit_emit(2);            /* shr ecx, 2 - Z to V */
+		jit_emit(0x09); jit_emit(0xCA);                         /* or edx, ecx */
+		jit_emit(0xF6); jit_emit(0xC2); jit_emit(0x10);         /* test dl, 0x10 */
+		break;
+	case 0x03: /* C OR Z */
+		jit_emit(0xA8); jit_emit(0xC0);                         /* test al, C|Z */
+		break;
+	default: /* V, S, Z, C */
+		jit_emit(0xA8); jit_emit(0x10 << ((cc & 0x07) - 4));   /* test al, bit */
+		break;
+	}
+	return (cc & 0x08) ? JNE : JE;
+}
+
+/* JR cc and JP cc to target - as op_jr() and op_jp() */
+int jit_branch(struct dec_inst *di, WORD target, WORD next, unsigned *done)
+{
+	unsigned skip = 0;
+	BYTE cc = MSN(di->opcode);
+	BYTE jcc;
+
+	jcc = jit_cond(cc);
+	if (cc != 0x08)
+		skip = jit_jump(jcc);
+	jit_set_pc(target);
+	jit_if_reset();
+	jit_add_clock(2);
+	done[0] = jit_jump(JMP);
+	if (skip)
+		jit_patch(skip);
+	jit_set_pc(next);
+	done[1] = jit_jump(JMP);
+	return TRUE;
+}
+#endif
+
+/* inline code for di at addr if there is any - returns FALSE if the
+   instruction needs the handler call. Register checks that fail jump to
+   the handler call (jit_slow[]), the inline code jumps past it (done[]) */
+int jit_inline(struct dec_inst *di, WORD addr, unsigned *done)
+{
+	unsigned taken;
+	WORD next = addr + di->size;
+	switch (di->opcode)
+	{
+	case 0xE4: /* LD R,R */
+		if (!jit_plain(di->ops[0]) || !jit_plain(di->ops[1]))
+			return FALSE;
+		jit_reg(RDX, di->ops[1]);
+		jit_reg(RAX, di->ops[0]);
+		jit_copy(RDX, RAX);
+		jit_set_pc(next);
+		jit_add_clock(10);
+		done[0] = jit_jump(JMP);
+		return TRUE;
+	case 0xE6: /* LD R,IM */
+		if (!jit_plain(di->ops[0]))
+			return FALSE;
+		jit_reg(RDX, di->ops[0]);
+		jit_store_imm(RDX, di->ops[1]);
+		jit_set_pc(next);
+		jit_add_clock(10);
+		done[0] = jit_jump(JMP);
+		return TRUE;
+	}
+	switch (LSN(di->opcode))
+	{
+	case 0x08: /* LD r,R */
+		if (!jit_plain(di->ops[0]))
+			return FALSE;
+		jit_work_reg(MSN(di->opcode));
+		jit_reg(RAX, di->ops[0]);
+		jit_copy(RDX, RAX);
+		break;
+	case 0x09: /* LD R,r */
+		if (!jit_plain(di->ops[0]))
+			return FALSE;
+		jit_work_reg(MSN(di->opcode));
+		jit_reg(RAX, di->ops[0]);
+		jit_copy(RAX, RDX);
+		break;
+	case 0x0C: /* LD r,IM */
+		jit_work_reg(MSN(di->opcode));
+		jit_store_imm(RDX, di->ops[0]);
+		break;
+#ifndef LAZY_FLAGS
+	case 0x02: /* r,r */
+	case 0x04: /* R,R */
+	case 0x06: /* R,IM */
+		return jit_alu(di, next, done);
+#endif
+	case 0x0A: /* DJNZ r,RA */
+	case 0x0B: /* JR cc,RA */
+	case 0x0D: /* JP cc,DA */
+#ifdef JUMP
+		if (!batch)
+			return FALSE; /* the handlers trace */
+#endif
+#ifndef LAZY_FLAGS
+		if (LSN(di->opcode) == 0x0B)
+			return jit_branch(di, next + SIGN_EXT(di->ops[0]), next, done);
+		if (LSN(di->opcode) == 0x0D)
+			return jit_branch(di, di->ops[0]<<8 | di->ops[1], next, done);
+#else
+		if (LSN(di->opcode) != 0x0A)
+			return FALSE;
+#endif
+		jit_work_reg(MSN(di->opcode));
+		jit_emit(0x80); jit_emit(0x2A); jit_emit(0x01);   /* sub byte [rdx], 1 */
+		taken = jit_jump(JNE);
+		jit_set_pc(next);
+		jit_add_clock(10);
+		done[0] = jit_jump(JMP);
+		jit_patch(taken);
+		jit_set_pc(next + SIGN_EXT(di->ops[0]));
+		jit_if_reset();
+		jit_add_clock(12);
+		done[1] = jit_jump(JMP);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+	jit_set_pc(next);
+	jit_add_clock(6);
+	done[0] = jit_jump(JMP);
+	return TRUE;
+}
+
+/* jump to exit unless sanity < inst_limit and sys_clock < cycle_limit
+   (MACHINE_GO after an inline instruction) */
+void jit_limits(unsigned *exits, int *nexits)
+{
+	unsigned skip;
+	int n;
+
+	for (n=0; n<2; n++)
+	{
+		jit_mov64(RAX, n ? &cycle_limit : &inst_limit);
+		jit_emit(0x48); jit_emit(0x8B); jit_emit(0x00);           /* mov rax, [rax] */
+		jit_emit(0x48); jit_emit(0x85); jit_emit(0xC0);           /* test rax, rax */
+		skip = jit_jump(JE);                                      /* 0 - no limit */
+		jit_emit(0x48); jit_emit(0x39); jit_field(RAX, n ? &sys_clock : &sanity); /* cmp [field], rax */
+		exits[(*nexits)++] = jit_jump(JAE);
+		jit_patch(skip);
+	}
+}
+
+/* translate blk - leaves blk->native NULL if jit_buf is full */
+void jit_translate(struct dec_block *blk)
+{
+	struct dec_inst *di;
+	unsigned done[2];
+	unsigned exits[3*BLOCK_MAX];
+	unsigned ended, pending, quiet, over;
+	int nexits = 0;
+	int i, n, inline_end, fast;
+	unsigned start;
+	WORD addr;
+
+	if (z8->jit_buf == NULL)
+	{
+		z8->jit_buf = mmap(NULL, JIT_BUF_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (z8->jit_buf == MAP_FAILED)
+		{
+			printf("JIT buffer not available - interpreting\n");
+			z8->jit_buf = NULL;
+			z8->jit_off = TRUE; /* this machine only - dispatch is shared */
+			return;
+		}
+	}
+	else
+		mprotect(z8->jit_buf, JIT_BUF_SIZE, PROT_READ|PROT_WRITE);
 
+	/* begin and end of cycle inline - nothing to display or trace */
+	fast = batch;
 #ifdef IE_TEST
-     switch(sanity)
-     {
-     case 3:
-            write_rm(PORT0, 0x83); /* Timer: continuous & 3x2 (6) cycles */
-            break;
-     case 11:
-     case 16:
-            /* Emulate ISR:
-               - Acknowledge IRQ0 interrupt - emulate OR 
-            */
-            regval = read_rm(IRQ);
-            regval &= ~IRQ0;      /* Mask off IRQ0 only */
-            write_rm(IRQ, regval);
-            break;
-     case 12:
-     case 17:
-            /* Emulate ISR:
-               - Emulate IRET - reenable interrupts */
-            reg_mem[IMR] . content |= INT_ENA;
-            break;
-            
-     }
+	fast = FALSE;
+#endif
+	start = z8->jit_used;
+	z8->jit_full = FALSE;
+	jit_emit(0x53); /* push rbx - keeps the stack 16 byte aligned for calls */
+	jit_mov64(RBX, z8);
+	addr = blk->start;
+	for (i=0; i<blk->count; i++)
+	{
+		di = &blk->inst[i];
+		if (fast)
+		{
+			/* begin_cycle() - pc is addr */
+			jit_emit(0x66); jit_emit(0xC7); jit_field(0, &z8->inst_pc); jit_emit(addr); jit_emit(addr>>8);
+		}
+		else
+			jit_call(begin_cycle);
+		done[0] = done[1] = 0;
+		z8->jit_nslow = 0;
+		inline_end = jit_inline(di, addr, done) && fast;
+		while (z8->jit_nslow > 0)
+			jit_patch(z8->jit_slow[--z8->jit_nslow]);
+		/* handler call - pc = addr+1, fetch_ops = di->ops */
+		jit_set_pc(addr + 1);
+		jit_mov64(RAX, &z8->fetch_ops);
+		jit_mov64(RCX, di->ops);
+		jit_emit(0x48); jit_emit(0x89); jit_emit(0x08);      /* mov [rax], rcx */
+		jit_emit(0xBF); jit_emit32(di->opcode);              /* mov edi, opcode */
+		jit_call(di->handler);
+		jit_mov64(RAX, &z8->fetch_ops);
+		jit_emit(0x48); jit_emit(0xC7); jit_emit(0x00); jit_emit32(0); /* mov qword [rax], 0 */
+		addr += di->size;
+		over = 0;
+		if (inline_end)
+		{
+			ended = jit_jump(JMP);
+			for (n=0; n<2; n++)
+				if (done[n])
+					jit_patch(done[n]);
+			/* end_cycle() only does more when an interrupt may be taken
+			   (the IF sequence ended the block before this instruction) */
+			jit_emit(0x80); jit_field(7, &reg_mem[IRQ]); jit_emit(0);       /* cmp byte [IRQ], 0 */
+			quiet = jit_jump(JE);
+			jit_emit(0xF6); jit_field(0, &reg_mem[IMR]); jit_emit(INT_ENA); /* test byte [IMR], INT_ENA */
+			pending = jit_jump(JNE);
+			jit_patch(quiet);
+			jit_emit(0x48); jit_emit(0xFF); jit_field(0, &sys_clock);      /* inc qword [sys_clock] */
+			jit_emit(0x48); jit_emit(0xFF); jit_field(0, &sanity);         /* inc qword [sanity] */
+			if (i+1 < blk->count)
+				jit_limits(exits, &nexits);
+			over = jit_jump(JMP);
+			jit_patch(ended);
+			jit_patch(pending);
+		}
+		else
+			for (n=0; n<2; n++)
+				if (done[n])
+					jit_patch(done[n]);
+		jit_call(end_cycle);
+		if (i+1 < blk->count)
+		{
+			jit_mov64(RDI, blk);
+			jit_emit(0xBE); jit_emit32(addr);                /* mov esi, next */
+			jit_call(block_continue);
+			jit_emit(0x85); jit_emit(0xC0);                  /* test eax, eax */
+			exits[nexits++] = jit_jump(JE);
+		}
+		if (over)
+			jit_patch(over);
+	}
+	jit_emit(0xB8); jit_emit32(TRUE);                        /* mov eax, TRUE */
+	jit_emit(0x5B); jit_emit(0xC3);                          /* pop rbx ; ret */
+	while (nexits > 0)
+		jit_patch(exits[--nexits]);
+	jit_emit(0x31); jit_emit(0xC0);                          /* xor eax, eax */
+	jit_emit(0x5B); jit_emit(0xC3);                          /* pop rbx ; ret */
+
+	if (z8->jit_full)
+	{
+		/* out of room - drop every translation and start again */
+		for (i=0; i<BLOCK_CACHE_SIZE; i++)
+			z8->block_cache[i].native = NULL;
+		z8->jit_used = 0;
+	}
+	else
+		blk->native = (int (*)(void)) (z8->jit_buf + start);
+	mprotect(z8->jit_buf, JIT_BUF_SIZE, PROT_READ|PROT_EXEC);
+}
+#endif
+
+/* run the machine from predecoded blocks - instructions leave the block 
+   early when the PC does not follow on (interrupt, IF skip) or the block
+   has been invalidated by a store into itself */
+void run_blocks()
+{
+struct dec_block *blk;
+unsigned long clock;
+int done;
+
+if (!MACHINE_GO)
+	return;
+if (z8->block_cache == NULL && (z8->block_cache = calloc(BLOCK_CACHE_SIZE, sizeof(struct dec_block))) == NULL)
+{
+	printf("No memory for predecoded blocks\n");
+	exit(0);
+}
+blk = block_lookup(pc);
+while (TRUE)
+{
+	clock = sys_clock;
+	blk->entries++;
+#ifdef JIT_DISPATCH
+	/* hot blocks are translated, IF sequences are always interpreted */
+	if (dispatch == DISPATCH_JIT && !z8->jit_off && blk->native == NULL && blk->entries >= JIT_THRESHOLD)
+		jit_translate(blk);
+	if (dispatch == DISPATCH_JIT && blk->native && tcount == 0 && fcount == 0)
+		done = blk->native();
+	else
+#endif
+		done = block_interpret(blk);
+	if (!MACHINE_GO)
+		return;
+	if (done)
+		blk->cycles = sys_clock - clock; /* completed - cost of last run */
+	blk = block_next(blk);
+}
+}
+
+#ifdef VEIW_BLOCKS
+void veiw_blocks (void)
+{
+	int i;
+	if (z8->block_cache == NULL)
+		return;
+	printf ("start  end  insts cycles fall branch entries \n");
+	for (i = 0; i<BLOCK_CACHE_SIZE; i++)
+	{
+		if (z8->block_cache[i].valid)
+			printf("%4x  %4x  %2d   %4lu   %4x  %4x  %6lu %s\n", z8->block_cache[i].start, z8->block_cache[i].end, z8->block_cache[i].count, z8->block_cache[i].cycles, z8->block_cache[i].fall_through, z8->block_cache[i].branch, z8->block_cache[i].entries, z8->block_cache[i].native ? "jit" : "");
+	}
+}
+#endif
+
+void run_machine()
+{
+/* Z8 machine emulator
+   instruction fetch, decode, and execute 
+*/
+BYTE inst;       /* Current instruction */
+running = TRUE;
+sanity = 0;
+
+#ifdef IE_TEST
+write_rm(IMR, INT_ENA | IRQ0); /* PORT 0 interrupts allowed */
+write_rm(IRQ, 0);              /* No pending interrupt requests */
+#endif
+
+#ifdef THREADED_DISPATCH
+if (dispatch == DISPATCH_THREADED)
+{
+	run_threaded();
+	return;
+}
+#endif
+if (dispatch == DISPATCH_BLOCK || dispatch == DISPATCH_JIT)
+{
+	run_blocks();
+	return;
+}
+
+while (MACHINE_GO)
+{
+     begin_cycle();
+     inst = prog_mem_fetch();
+     if (dispatch == DISPATCH_TABLE)
+          op_table[inst](inst);
+     else
+          exec_switch(inst);
+     end_cycle();
+}
+}
+
+/* One line result of a run on out - tag naming the run (if any), why it 
+   ended, instruction cycles, clock cycles and the final special and 
+   working registers. Returns why it ended */
+enum RUN_EXIT run_result(FILE *out, char *tag)
+{
+enum RUN_EXIT why;
+int i;
+
+if (!running)
+     why = EXIT_STOP;
+else if (cycle_limit != 0 && sys_clock >= cycle_limit)
+     why = EXIT_CYCLE_LIMIT;
+else
+     why = EXIT_INST_LIMIT;
+flags_sync();
+cache_flush(); /* memory as the program left it */
+#ifdef CORPUS_RUNNER
+flockfile(out); /* one line even when several threads report */
+#endif
+fprintf(out, "result: ");
+if (tag)
+     fprintf(out, "%s ", tag);
+fprintf(out, "exit=%s insts=%lu cycles=%lu pc=%04x sp=%04x flags=%02x rp=%02x imr=%02x irq=%02x r=", 
+       exit_diag[why], sanity, sys_clock, pc, SP, reg_mem[FLAGS], 
+       reg_mem[RP], reg_mem[IMR], reg_mem[IRQ]);
+for (i=0; i<0x10; i++)
+     fprintf(out, "%02x", reg_mem[(BYTE)(RPBLK|i)]);
+#ifdef CHECKED_WRITES
+fprintf(out, " stores=%lu store_errors=%lu", z8->store_checks, z8->store_errors);
+#endif
+fprintf(out, "\n");
+#ifdef CORPUS_RUNNER
+funlockfile(out);
+#endif
+return why;
+}
+
+#ifdef CORPUS_RUNNER
+/*********************** CORPUS RUNNER *********************************/
+/* Run every program of a corpus in batch mode on a pool of threads
+   - the corpus is a directory of s-record files or a manifest naming one 
+     file per line (blank lines and lines starting with # are skipped)
+   - every worker has a deque of program numbers, dealt out round robin. 
+     It runs programs from the bottom of its own deque and, once that is 
+     empty, steals from the top of the others - long programs do not leave
+     the other workers idle
+   - each program is loaded into a machine of its own (machine_new()) on 
+     the worker's thread, run, reported and freed
+   - batch mode has no machine trace output (WATCH, JUMP, ...) - only the 
+     result lines and the report are written
+*/
+struct deque
+{
+	pthread_mutex_t lock;
+	int *job;       /* program numbers */
+	int top;        /* next job to be stolen */
+	int bottom;     /* one past the next job to run */
+};
+
+struct worker
+{
+	pthread_t thread;
+	int id;
+	struct deque jobs;
+	unsigned long runs;            /* programs run */
+	unsigned long steals;          /* programs taken from other workers */
+	unsigned long insts;           /* instruction cycles of all its runs */
+	unsigned long cycles;          /* clock cycles of all its runs */
+	unsigned long exits[EXIT_LOAD_ERROR+1]; /* runs by exit reason */
+};
+
+char **corpus;          /* program file names */
+int corpus_size;
+struct worker *workers;
+int nworkers;           /* -j threads - 0 for one per processor */
+
+void corpus_add(char *name)
+{
+	if ((corpus_size & 0xFF) == 0)
+		corpus = realloc(corpus, (corpus_size + 0x100) * sizeof(char *));
+	if (corpus == NULL || (corpus[corpus_size] = strdup(name)) == NULL)
+	{
+		printf("No memory for the corpus\n");
+		exit(0);
+	}
+	corpus_size++;
+}
+
+int corpus_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/* corpus from directory path (sorted file names) or manifest path */
+int corpus_read(char *path)
+{
+	struct stat st;
+	DIR *dir;
+	struct dirent *de;
+	FILE *mf;
+	char line[LINE_LEN + 1024];
+	int len;
+
+	if (stat(path, &st) != 0)
+	{
+		printf("No corpus %s\n", path);
+		return FALSE;
+	}
+	if (S_ISDIR(st.st_mode))
+	{
+		if ((dir = opendir(path)) == NULL)
+			return FALSE;
+		while ((de = readdir(dir)) != NULL)
+		{
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(line, sizeof(line), "%s/%s", path, de->d_name);
+			if (stat(line, &st) == 0 && S_ISREG(st.st_mode))
+				corpus_add(line);
+		}
+		closedir(dir);
+		qsort(corpus, corpus_size, sizeof(char *), corpus_cmp);
+	}
+	else{
+		if ((mf = fopen(path, "r")) == NULL)
+			return FALSE;
+		while (fgets(line, sizeof(line), mf))
+		{
+			len = strlen(line);
+			while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+				line[--len] = '\0';
+			if (len > 0 && line[0] != '#')
+				corpus_add(line);
+		}
+		fclose(mf);
+	}
+	return TRUE;
+}
+
+/* next program for worker w - its own first, then stolen. -1 when done */
+int corpus_next(struct worker *w)
+{
+	struct deque *d;
+	int i, job = -1;
+
+	d = &w->jobs;
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom > d->top)
+		job = d->job[--d->bottom];
+	pthread_mutex_unlock(&d->lock);
+	if (job >= 0)
+		return job;
+
+	for (i=1; i<nworkers && job < 0; i++)
+	{
+		d = &workers[(w->id + i) % nworkers].jobs;
+		pthread_mutex_lock(&d->lock);
+		if (d->bottom > d->top)
+			job = d->job[d->top++];
+		pthread_mutex_unlock(&d->lock);
+	}
+	if (job >= 0)
+		w->steals++;
+	return job;
+}
+
+void *corpus_worker(void *arg)
+{
+	struct worker *w = arg;
+	enum RUN_EXIT why;
+	int job;
+	char tag[LINE_LEN + 1024];
+
+	while ((job = corpus_next(w)) >= 0)
+	{
+		machine_new();
+		if (!load_srec(corpus[job]))
+		{
+			printf("result: file=%s exit=%s\n", corpus[job], exit_diag[EXIT_LOAD_ERROR]);
+			why = EXIT_LOAD_ERROR;
+		}
+		else{
+#ifdef IE_TEST
+			reg_mem_device_init(PORT0, TIMER_device, 0x00);
+#endif
+			run_machine();
+			snprintf(tag, sizeof(tag), "file=%s", corpus[job]);
+			why = run_result(stdout, tag);
+			cache_profile_report(stdout, tag);
+			cache_report(stdout, tag);
+			w->insts += sanity;
+			w->cycles += sys_clock;
+		}
+		w->exits[why]++;
+		w->runs++;
+		machine_free(z8);
+	}
+	return NULL;
+}
+
+/* run the corpus at path - returns the number of programs that did not 
+   load or did not reach STOP */
+int corpus_main(char *path)
+{
+	struct timespec t0, t1;
+	double secs;
+	unsigned long insts = 0, cycles = 0, steals = 0;
+	unsigned long exits[EXIT_LOAD_ERROR+1] = {0};
+	int i, j;
+
+	if (!corpus_read(path))
+		return 1;
+	if (nworkers <= 0)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers <= 0)
+		nworkers = 1;
+	if (nworkers > corpus_size && corpus_size > 0)
+		nworkers = corpus_size;
+
+#ifdef THREADED_DISPATCH
+	/* the threaded engine builds its label table on first use - do it 
+	   here, before the workers share it (a new machine is not running) */
+	if (dispatch == DISPATCH_THREADED)
+	{
+		machine_new();
+		run_threaded();
+		machine_free(z8);
+	}
+#endif
+
+	workers = calloc(nworkers, sizeof(struct worker));
+	for (i=0; i<nworkers; i++)
+	{
+		workers[i].id = i;
+		pthread_mutex_init(&workers[i].jobs.lock, NULL);
+		workers[i].jobs.job = malloc((corpus_size / nworkers + 1) * sizeof(int));
+		for (j=i; j<corpus_size; j+=nworkers)
+			workers[i].jobs.job[workers[i].jobs.bottom++] = j;
+		/* own jobs are taken from the bottom - run the corpus in order */
+		for (j=0; j<workers[i].jobs.bottom/2; j++)
+		{
+			int t = workers[i].jobs.job[j];
+			workers[i].jobs.job[j] = workers[i].jobs.job[workers[i].jobs.bottom-1-j];
+			workers[i].jobs.job[workers[i].jobs.bottom-1-j] = t;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i=0; i<nworkers; i++)
+		pthread_create(&workers[i].thread, NULL, corpus_worker, &workers[i]);
+	for (i=0; i<nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	for (i=0; i<nworkers; i++)
+	{
+		insts += workers[i].insts;
+		cycles += workers[i].cycles;
+		steals += workers[i].steals;
+		for (j=0; j<=EXIT_LOAD_ERROR; j++)
+			exits[j] += workers[i].exits[j];
+		printf("worker %d: programs=%lu steals=%lu insts=%lu\n", 
+		        i, workers[i].runs, workers[i].steals, workers[i].insts);
+		free(workers[i].jobs.job);
+		pthread_mutex_destroy(&workers[i].jobs.lock);
+	}
+	printf("corpus: programs=%d threads=%d stop=%lu inst_limit=%lu cycle_limit=%lu load_error=%lu steals=%lu\n",
+	        corpus_size, nworkers, exits[EXIT_STOP], exits[EXIT_INST_LIMIT], 
+	        exits[EXIT_CYCLE_LIMIT], exits[EXIT_LOAD_ERROR], steals);
+	printf("throughput: seconds=%.3f programs/s=%.1f insts=%lu insts/s=%.0f cycles=%lu cycles/s=%.0f\n",
+	        secs, secs > 0 ? corpus_size / secs : 0.0, insts, secs > 0 ? insts / secs : 0.0,
+	        cycles, secs > 0 ? cycles / secs : 0.0);
+	fflush(stdout);
+	free(workers);
+	return corpus_size - exits[EXIT_STOP];
+}
+#endif
+
+#ifdef LANE_DISPATCH
+/*********************** LOCKSTEP LANES *********************************/
+/* Step up to LANES machines loaded with the same program in lockstep
+   (fuzzing and parameter sweeps: -L lanes, -s reg gives lane k reg = k)
+   - the register files are held as a structure of arrays: reg[r] is one
+     byte vector holding register r of every lane, so an instruction run by
+     a group of lanes is a handful of vector operations (AVX2 when built 
+     with -mavx2, pairs of SSE2 operations otherwise)
+   - every step runs the group of lanes at the lowest PC. Lanes that take 
+     the other side of a branch drop out of the group and join it again 
+     when their PCs meet
+   - register to register ALU (r,r  R,R  R,IM), LD r,IM  LD r,R  LD R,r,
+     INC r and NOP on RA_RDWR registers take the vector path. Everything
+     else - memory, branches, devices, STOP, IF sequences, interrupts - is 
+     run lane by lane through op_table on the lane's own machine. A lane's
+     registers are moved out of the vectors before its first such step and 
+     back in before its next vector step
+   - carry and half_carry carry over between instructions (ADC, SBC, DA) 
+     and are vectors as well. zero, sign and overflow are always set before
+     they are read and are not kept
+   - like predecoded blocks, vector steps read their instruction straight 
+     from program memory and are not seen by cache()
+*/
+typedef BYTE lane_v __attribute__((vector_size(LANES)));
+
+/* vector operations of a lane instruction */
+enum LANE_OP       {LOP_NONE, LOP_ADD, LOP_ADC, LOP_SUB, LOP_SBC, LOP_OR, LOP_AND, 
+                    LOP_TCM, LOP_TM, LOP_CP, LOP_XOR, LOP_LD, LOP_INC, LOP_NOP,
+                    LOP_DJNZ, LOP_JR, LOP_JP};
+/* operand modes of a lane instruction */
+enum LANE_MODE     {LM_r_r, LM_R_R, LM_R_IM, LM_r_IM, LM_r_R, LM_R_r, LM_r, LM_NONE, 
+                    LM_RA, LM_DA};
+
+BYTE lane_op[256];      /* LANE_OP of each opcode - LOP_NONE runs lane by lane */
+BYTE lane_mode[256];
+
+struct gang
+{
+	lane_v reg[RM_SIZE];           /* reg_mem contents of every lane */
+	lane_v vcarry;                 /* carry of every lane */
+	lane_v vhalf_carry;            /* half_carry of every lane */
+	WORD lpc[LANES];               /* pc */
+	unsigned long clock[LANES];    /* sys_clock */
+	unsigned long count[LANES];    /* instruction cycles (sanity) */
+	struct machine *m[LANES];
+	BYTE soa[LANES];               /* TRUE - registers are in the vectors, not in m */
+	BYTE vec_ok[LANES];            /* no IF sequence, program memory never written */
+	BYTE stopped[LANES];           /* STOP executed */
+	int n;                         /* lanes in use */
+	unsigned long vsteps;          /* vector steps */
+	unsigned long vinsts;          /* lane instructions run by vector steps */
+	unsigned long sinsts;          /* lane instructions run one lane at a time */
+};
+
+/* lane_op[] and lane_mode[] from op_table */
+void lane_init()
+{
+	void (*h)(BYTE);
+	int i;
+
+	for (i=0; i<256; i++)
+	{
+		h = op_table[i];
+		lane_op[i] = LOP_NONE;
+#define LANE_ALU(op, lop) \
+		if (h == op##_r_r)  { lane_op[i] = lop; lane_mode[i] = LM_r_r; } \
+		if (h == op##_R_R)  { lane_op[i] = lop; lane_mode[i] = LM_R_R; } \
+		if (h == op##_R_IM) { lane_op[i] = lop; lane_mode[i] = LM_R_IM; }
+		LANE_ALU(alu_add, LOP_ADD) LANE_ALU(alu_adc, LOP_ADC)
+		LANE_ALU(alu_sub, LOP_SUB) LANE_ALU(alu_sbc, LOP_SBC)
+		LANE_ALU(alu_or, LOP_OR)   LANE_ALU(alu_and, LOP_AND)
+		LANE_ALU(alu_tcm, LOP_TCM) LANE_ALU(alu_tm, LOP_TM)
+		LANE_ALU(alu_cp, LOP_CP)   LANE_ALU(alu_xor, LOP_XOR)
+		LANE_ALU(alu_ld, LOP_LD)
+#undef LANE_ALU
+		if (h == op_ld_r_IM) { lane_op[i] = LOP_LD; lane_mode[i] = LM_r_IM; }
+		if (h == op_ld_r_R)  { lane_op[i] = LOP_LD; lane_mode[i] = LM_r_R; }
+		if (h == op_ld_R_r)  { lane_op[i] = LOP_LD; lane_mode[i] = LM_R_r; }
+		if (h == op_inc_r)   { lane_op[i] = LOP_INC; lane_mode[i] = LM_r; }
+		if (h == op_nop)     { lane_op[i] = LOP_NOP; lane_mode[i] = LM_NONE; }
+#if !defined(JUMP) && !defined(IF_TEST)
+		/* branches - lanes whose condition differs part here */
+		if (h == op_djnz)    { lane_op[i] = LOP_DJNZ; lane_mode[i] = LM_r; }
+		if (h == op_jr)      { lane_op[i] = LOP_JR; lane_mode[i] = LM_RA; }
+		if (h == op_jp)      { lane_op[i] = LOP_JP; lane_mode[i] = LM_DA; }
+#endif
+	}
+}
+
+/* lane l's state into its machine - z8 is left at the lane's machine */
+void lane_out(struct gang *g, int l)
+{
+	int r;
+
+	z8 = g->m[l];
+	if (g->soa[l])
+	{
+		for (r=0; r<RM_SIZE; r++)
+			reg_mem[r] = g->reg[r][l];
+		carry = g->vcarry[l];
+		half_carry = g->vhalf_carry[l];
+		g->soa[l] = FALSE;
+		work_sync();
+	}
+	pc = g->lpc[l];
+	sys_clock = g->clock[l];
+	sanity = g->count[l];
+}
+
+/* lane l's state back from its machine (z8) after it has run */
+void lane_back(struct gang *g, int l)
+{
+	g->lpc[l] = pc;
+	g->clock[l] = sys_clock;
+	g->count[l] = sanity;
+	g->stopped[l] = !running;
+	g->vec_ok[l] = tcount == 0 && fcount == 0 && z8->pm_writes == 0;
+}
+
+/* lane l's registers into the vectors */
+void lane_in(struct gang *g, int l)
+{
+	int r;
+
+	if (g->soa[l])
+		return;
+	z8 = g->m[l];
+	flags_sync();
+	for (r=0; r<RM_SIZE; r++)
+		g->reg[r][l] = reg_mem[r];
+	g->vcarry[l] = carry;
+	g->vhalf_carry[l] = half_carry;
+	g->soa[l] = TRUE;
+}
+
+/* RP of lane l wherever its registers are */
+BYTE lane_rp(struct gang *g, int l)
+{
+	if (g->soa[l])
+		return g->reg[RP][l];
+	z8 = g->m[l];
+	return reg_mem[RP];
+}
+
+/* may lane l start another instruction cycle? (MACHINE_GO of the lane) */
+int lane_go(struct gang *g, int l)
+{
+	return !g->stopped[l] && (inst_limit == 0 || g->count[l] < inst_limit)
+	       && (cycle_limit == 0 || g->clock[l] < cycle_limit);
+}
+
+/* one instruction cycle of lane l on its machine */
+void lane_step(struct gang *g, int l)
+{
+	BYTE inst;
+
+	lane_out(g, l);
+	begin_cycle();
+	inst = prog_mem_fetch();
+	op_table[inst](inst);
+	end_cycle();
+	lane_back(g, l);
+	g->sinsts++;
+}
+
+/* register reg as read_rm()/write_rm() of a lane with RP rp see it - 
+   -1 unless it is a plain RA_RDWR register. z8 is a lane's machine */
+int lane_reg(BYTE reg, BYTE rp)
+{
+	if (z8->reg_attr[reg] == RA_USERP)
+		reg = (rp << 4) | (reg - 0xE0);
+	return z8->reg_attr[reg] == RA_RDWR ? reg : -1;
+}
+
+/* new value v of vector x for the lanes in act only */
+#define LANE_SET(x, v)	((x) = ((v) & act) | ((x) & ~act))
+
+/* run the instruction at the PC of lanes in[] as vector operations - 
+   FALSE (nothing done) if it cannot be */
+int lane_vector(struct gang *g, BYTE *in, int lead)
+{
+	lane_v act = {0};
+	lane_v zv = {0};
+	lane_v a, b, res, c, h, fl;
+	lane_v taken = {0};             /* lanes whose branch is taken */
+	WORD at;
+	BYTE inst, b1, b2, rp = 0, size, cycles;
+	int l, dst = -1, src = -1;
+	BYTE imm = 0;
+
+	if (cache_timed)
+		return FALSE; /* every fetch through the caches */
+	for (l=0; l<g->n; l++)
+		if (in[l] && !g->vec_ok[l])
+			return FALSE;
+	at = g->lpc[lead];
+	z8 = g->m[lead];  /* program memory and register attributes of every lane */
+	if (z8->mem_map[PROG][MSBY(at)].rd == NULL || z8->mem_map[PROG][MSBY((WORD)(at+1))].rd == NULL
+	    || z8->mem_map[PROG][MSBY((WORD)(at+2))].rd == NULL)
+		return FALSE; /* code from a device */
+	inst = z8->mem_map[PROG][MSBY(at)].rd[LSBY(at)];
+	if (lane_op[inst] == LOP_NONE)
+		return FALSE;
+	b1 = z8->mem_map[PROG][MSBY((WORD)(at+1))].rd[LSBY(at+1)];
+	b2 = z8->mem_map[PROG][MSBY((WORD)(at+2))].rd[LSBY(at+2)];
+
+	/* working registers and E0..EF need a common RP */
+	rp = lane_rp(g, lead);
+	for (l=0; l<g->n; l++)
+		if (in[l] && lane_rp(g, l) != rp)
+			return FALSE;
+	z8 = g->m[lead];
+
+	switch (lane_mode[inst])
+	{
+	case LM_r_r:   /* dst, src working registers - 6 cycles */
+		dst = lane_reg(rp<<4 | MSN(b1), rp);
+		src = lane_reg(rp<<4 | LSN(b1), rp);
+		size = 2; cycles = 6;
+		break;
+	case LM_R_R:   /* src, dst - 10 cycles */
+		src = lane_reg(b1, rp);
+		dst = lane_reg(b2, rp);
+		size = 3; cycles = 10;
+		break;
+	case LM_R_IM:  /* dst, IM - 10 cycles */
+		dst = lane_reg(b1, rp);
+		imm = b2;
+		size = 3; cycles = 10;
+		break;
+	case LM_r_IM:  /* LD r,IM */
+		dst = lane_reg(rp<<4 | MSN(inst), rp);
+		imm = b1;
+		size = 2; cycles = 6;
+		break;
+	case LM_r_R:   /* LD r,R */
+		dst = lane_reg(rp<<4 | MSN(inst), rp);
+		src = lane_reg(b1, rp);
+		size = 2; cycles = 6;
+		break;
+	case LM_R_r:   /* LD R,r */
+		src = lane_reg(rp<<4 | MSN(inst), rp);
+		dst = lane_reg(b1, rp);
+		size = 2; cycles = 6;
+		break;
+	case LM_r:     /* INC r, DJNZ r,RA */
+		dst = lane_reg(rp<<4 | MSN(inst), rp);
+		if (lane_op[inst] == LOP_DJNZ)
+		{
+			size = 2; cycles = 10;
+		}
+		else{
+			size = 1; cycles = 6;
+		}
+		break;
+	case LM_NONE:  /* NOP */
+		dst = FLAGS;
+		size = 1; cycles = 6;
+		break;
+	case LM_RA:    /* JR cc,RA - cond_handler() cycles */
+		dst = FLAGS;
+		size = 2; cycles = 10;
+		break;
+	case LM_DA:    /* JP cc,DA */
+		dst = FLAGS;
+		size = 3; cycles = 10;
+		break;
+	}
+	if (dst < 0 || (src < 0 && (lane_mode[inst] == LM_r_r || lane_mode[inst] == LM_R_R 
+	                           || lane_mode[inst] == LM_r_R || lane_mode[inst] == LM_R_r)))
+		return FALSE;
+
+	/* every lane of the group into the vectors */
+	for (l=0; l<g->n; l++)
+		if (in[l])
+		{
+			lane_in(g, l);
+			act[l] = 0xFF;
+		}
+
+	a = g->reg[dst];
+	b = src < 0 ? zv + imm : g->reg[src];
+	switch (lane_op[inst])
+	{
+	case LOP_ADD:
+	case LOP_ADC: /* as adder() */
+		res = a + b + (lane_op[inst] == LOP_ADC ? g->vcarry : zv);
+		c = ((a & b) | ((a | b) & ~res)) >> 7;
+		h = ((a ^ res) >> 4) & 1;
+		fl = g->reg[FLAGS];
+		fl = (fl & 0x03) | c<<7 | ((lane_v)(res == 0) & 0x40) | ((res >> 2) & 0x20) 
+		   | ((a ^ res) >> 7)<<4 | h<<2;
+		LANE_SET(g->reg[FLAGS], fl);
+		LANE_SET(g->vcarry, c);
+		LANE_SET(g->vhalf_carry, h);
+		LANE_SET(g->reg[dst], res);
+		break;
+	case LOP_SUB:
+	case LOP_SBC:
+	case LOP_CP: /* as subber() - carry and half carry are the complements */
+		res = a - b - (lane_op[inst] == LOP_SBC ? g->vcarry : zv);
+		c = (((~a & b) | ((~a | b) & res)) >> 7) ^ 1;
+		h = (((a ^ res) >> 4) & 1) ^ 1;
+		fl = g->reg[FLAGS];
+		fl = (fl & 0x03) | c<<7 | ((lane_v)(res == 0) & 0x40) | ((res >> 2) & 0x20) 
+		   | ((a ^ res) >> 7)<<4 | 0x08 | h<<2;
+		LANE_SET(g->reg[FLAGS], fl);
+		LANE_SET(g->vcarry, c);
+		LANE_SET(g->vhalf_carry, h);
+		if (lane_op[inst] != LOP_CP)
+			LANE_SET(g->reg[dst], res);
+		break;
+	case LOP_OR:
+	case LOP_AND:
+	case LOP_TCM:
+	case LOP_TM:
+	case LOP_XOR: /* flags of the value only - XOR stores and flags the old dst */
+		if (lane_op[inst] == LOP_OR)
+			res = a | b;
+		else if (lane_op[inst] == LOP_TCM)
+			res = ~a & b;
+		else if (lane_op[inst] == LOP_XOR)
+		{
+			LANE_SET(g->reg[dst], a ^ b);
+			res = a;
+		}
+		else
+			res = a & b;
+		fl = g->reg[FLAGS];
+		fl = (fl & 0x8F) | ((lane_v)(res == 0) & 0x40) | ((res >> 2) & 0x20);
+		LANE_SET(g->reg[FLAGS], fl);
+		break;
+	case LOP_LD:
+		LANE_SET(g->reg[dst], b);
+		break;
+	case LOP_INC: /* as op_inc_r() - dst first, then Z, S and V */
+		res = a + 1;
+		LANE_SET(g->reg[dst], res);
+		fl = g->reg[FLAGS];
+		fl = (fl & 0x8F) | ((lane_v)(res == 0) & 0x40) | ((res >> 2) & 0x20) 
+		   | ((a ^ res) >> 7)<<4;
+		LANE_SET(g->reg[FLAGS], fl);
+		break;
+	case LOP_DJNZ: /* taken where the decremented register is not 0 */
+		res = a - 1;
+		LANE_SET(g->reg[dst], res);
+		taken = (lane_v)(res != 0);
+		break;
+	case LOP_JR:
+	case LOP_JP: /* cond_handler() also loads carry from FLAGS */
+		LANE_SET(g->vcarry, (a >> 7) & 1);
+		for (l=0; l<g->n; l++)
+			if (in[l])
+				taken[l] = cond_true(MSN(inst), a[l]) ? 0xFF : 0;
+		break;
+	case LOP_NOP:
+		break;
+	}
+
+	/* rest of the cycle - an enabled pending interrupt is taken on the 
+	   lane's machine as end_cycle() would */
+	for (l=0; l<g->n; l++)
+	{
+		if (!in[l])
+			continue;
+		g->lpc[l] = at + size;
+		g->clock[l] += cycles + 1;
+		g->count[l]++;
+		if (taken[l])
+		{
+			/* as the handler - new PC, 2 more cycles and if_reset() */
+			g->lpc[l] = lane_mode[inst] == LM_DA ? b1<<8 | b2 : at + size + SIGN_EXT(b1);
+			g->clock[l] += 2;
+			z8 = g->m[l];
+			cexec = 0;
+		}
+		if ((g->reg[IMR][l] & INT_ENA) && (g->reg[IMR][l] & g->reg[IRQ][l] & IRQ_MASK))
+		{
+			lane_out(g, l);
+			check_interrupts();
+			lane_back(g, l);
+		}
+	}
+	g->vsteps++;
+	for (l=0; l<g->n; l++)
+		g->vinsts += in[l];
+	return TRUE;
+}
+
+/* run the gang until every lane has stopped or reached a limit */
+void gang_run(struct gang *g)
+{
+	BYTE in[LANES];
+	int l, lead;
+
+	while (TRUE)
+	{
+		/* lowest PC of the lanes still running */
+		lead = -1;
+		for (l=0; l<g->n; l++)
+			if (lane_go(g, l) && (lead < 0 || g->lpc[l] < g->lpc[lead]))
+				lead = l;
+		if (lead < 0)
+			break;
+		for (l=0; l<g->n; l++)
+			in[l] = lane_go(g, l) && g->lpc[l] == g->lpc[lead];
+#ifndef IE_TEST /* the IE test harness works on whole cycles of one machine */
+		if (lane_vector(g, in, lead))
+			continue;
 #endif
-     
-     /* Instruction cycle completed -- check for interrupts 
-        - call device check
-        - TRAPs - software-generated interrupts (SWI, SVC, etc) are caused
-          by turning IRQ bit on (see section 2.6.4 in assignment)
-        - IRET enables interrupts:
-           reg_mem[IRQ] . content |= INT_ENA;
-        - Concurrent interrupts are possible if timer and uart interrupt at 
-          same time
-     */
-     #ifdef IE_TEST
-	 TIMER_check();
-     //UART_check();
-     #endif
+		for (l=0; l<g->n; l++)
+			if (in[l])
+				lane_step(g, l);
+	}
+}
 
-     if ((reg_mem[IMR] . content & INT_ENA) && reg_mem[IRQ] . content != 0)
-     {
-          /* CPU interrupts enabled and one or more pending interrupts
-	       - check interrupt mask (IMR) if device allowed 
-          */
-          if ((reg_mem[IMR] . content & reg_mem[IRQ] . content) & IRQ_MASK)
-          {
+/* gang with its LANES machines - gang_load() sets up the lanes of a run */
+struct gang *gang_new()
+{
+	struct gang *g;
+	int l;
+
+	g = aligned_alloc(__alignof__(struct gang), sizeof(struct gang));
+	if (g == NULL)
+	{
+		printf("No memory for the lanes\n");
+		exit(0);
+	}
+	memset(g, 0, sizeof(struct gang));
+	for (l=0; l<LANES; l++)
+		g->m[l] = machine_new();
+	return g;
+}
+
+/* n lanes from the loaded image, lane k with register sweep = first + k
+   when sweep >= 0 - a machine used by the last gang only gets back the
+   pages it wrote */
+void gang_load(struct gang *g, int n, struct snapshot *image, int sweep, int first)
+{
+	int l;
+
+	g->n = n;
+	g->vsteps = g->vinsts = g->sinsts = 0;
+	for (l=0; l<n; l++)
+	{
+		z8 = g->m[l];
+		snapshot_restore(image);
+		if (sweep >= 0)
+		{
+			reg_mem[sweep] = first + l;
+			work_sync();
+		}
+		g->soa[l] = FALSE;
+		lane_back(g, l);
+	}
+}
+
+void gang_free(struct gang *g)
+{
+	int l;
+	for (l=0; l<LANES; l++)
+		machine_free(g->m[l]);
+	free(g);
+}
+
+/* run nlanes lanes of program file - returns the number that did not 
+   reach STOP */
+int lanes_main(char *file, int nlanes, int sweep)
+{
+	struct gang *g;
+	struct machine *m;
+	struct snapshot *image;
+	struct timespec t0, t1;
+	double secs = 0;
+	unsigned long vsteps = 0, vinsts = 0, sinsts = 0;
+	int first, l, n, left = 0;
+	char tag[32];
+
+	lane_init();
+
+	/* load once, every lane starts from a copy */
+	m = machine_new();
+	if (!load_srec(file))
+		exit(0);
 #ifdef IE_TEST
-printf("Interrupt on IMR: %02x\n", 
-                  reg_mem[IMR] . content & reg_mem[IRQ] . content);
+	reg_mem_device_init(PORT0, TIMER_device, 0x00);
+	write_rm(IMR, INT_ENA | IRQ0);
+	write_rm(IRQ, 0);
 #endif
-               /* At least one interrupt pending 
-                - if single, proceed
-                - if multiple, determine priority to select
-                - push Flags, PC lo, and PC hi
-                - clear interrupt status bit (IMR[7])
-                - PC hi = device vector[n]
-                - PC lo = device vector[n+1]
-                - ISR entered on this clock tick 
-                - Pending interrupts remain until after IRET
-                - IRET enables interrupt
-                - update sys_clock with interrupt overhead
-               */
-               
-               switch (reg_mem[IRQ].content)
-               {
-               	case IRQ0:
-               		/* IRQ0 interrupt */
-               		regval = 0x00; // reg_val holds the value of the IRQ index
-               		break;
-               	case IRQ1:
-               		regval = 0x01;
-               		break;
-               	case IRQ2:
-               		regval = 0x02;
-               		break;
-               	case IRQ3:
-               		regval = 0x03;
-               		break;
-               	case IRQ4:
-               		regval = 0x04;
-               		break;
-               	case IRQ5:
-               		regval = 0x05;
-               		break;
-               	default:
-               		/* more than one pending interrupt
-               		   call polling function to determine by priority 
-					   returns IRQ with highest priority */
-               		regval = polling();
-               }
-               /* get interrupt vector */
-				dst = regval*2; // Interrupt vector holds two contiguous locations in memory
-				dest = read_pm(dst); // hi byte is 00
-				dest = dest <<8 | (read_pm(dst+1));
-				/* PUSH PC lo and PC hi unto stack */
-				/* SP <-- SP-2 */
-				sp = SP;
-				sp =-0x02;
-				write_rm(SPL, LSBY(sp));
-				if(SPLOC==0){ // stack is in data mem
-					write_rm(SPH, MSBY(sp));
-					/* @SP <-- PC */
-					write_dm( sp++, MSBY(pc));
-					write_dm(sp, LSBY(pc));	
-				}else{// stack is in reg mem
-				/* @SP <-- PC */
-					write_rm( sp++, MSBY(pc));
-					write_rm(sp, LSBY(pc));								
-				}
-				/* PC <-- interrupt vector */
-				pc = dest;
-				#ifdef IE_TEST
-				printf(" pc holds interrupt vector : %x \n", pc);
-				#endif
-				
-				/*increment system clock */
-				sys_clock +=20; // 20 cycles
-				
-				/* PUSH flags unto stack */
-				/* SP <-- SP-1 */
-				sp =SP-0x01;
-				write_rm(SPL, LSBY(sp));
-				/*@SP <-- src */				
-				src = read_rm(FLAGS);
-				if (SPLOC == 0){ //stack is in data memory
-				write_dm(sp, src);
-				write_rm(SPH, MSBY(sp));
-				sys_clock += 2; // 2 extra cycles for external stack
-				}else{	// stack is in register mermory
-				write_rm(SPL, src);
-				}
-				sys_clock +=10; // 10 cycles for pushing
-				/* clear interrupt status bit */
-				reg_mem[IMR] . content &= ~INT_ENA; 
-				
-				/* clear IRQ bit to signal interrupt is being handled*/
-				switch(regval){
-					case 0x00:
-						dst = IRQ0;
-						break;
-					case 0x01:
-						dst = IRQ1;
-						break;
-					case 0x02:
-						dst = IRQ2;
-						break;
-					case 0x03:
-						dst = IRQ3;
-						break;
-					case 0x04:
-						dst = IRQ4;
-						break;
-					case 0x05:
-						dst = IRQ5;
-						break;
-				}
-				reg_mem[IRQ].content &= ~dst; 
-				/* 6 cycles for clearing */
-				sys_clock +=6; // total of atleast 36 cycles overhead
-          }
-     }
-     /**********************************IF ADDITION ****************************/
-     int i;
-     if(cexec) // cexec is 1
-     {
-     	if(tcount>0x00 && tcount<0x04) //sanity check
-     	{
-     		#ifdef IF_TEST
-     		printf("executing true part, tcount: %x \n", tcount);
-     		#endif
-     		/* execute true part of the statement */
-     		tcount--; // decrement the count of true instructions
-     		/* restore flags */
-     		write_rm(FLAGS, tempflags);
-     	}
-     	else if(fcount>0x00 && fcount<0x04)
-     	{
-     		/* do not execute false part skip over false part
-			  increment program counter by number of bytes required per instruction */
-			  for(i=fcount; i>0; i--)
-			  {
-			  	#ifdef IF_TEST
-			  	printf("skipping false part, fcount: %x \n", fcount);
-			  	#endif
-			  	fcount--;
-			  	inst = prog_mem_fetch(); // fetch opcode 
-			  	pc +=opcode_size[MSN(inst)][LSN(inst)]; // increment pc by size of operands for opcode
-			  }
-			  /* restore flags */
-     		  write_rm(FLAGS, tempflags);
-     	}
-     }
-     else { // cexec == 0,  execute false part only 
-     	if(tcount>0x00 && tcount<0x04)
-     	{
-     		for(i=tcount; i>0; i--)
-     		{
-     			#ifdef IF_TEST
-	     		printf("skipping true part, tcount: %x \n", tcount);
-	     		#endif
-	     		tcount--;
-     			inst = prog_mem_fetch(); // fetch opcode
-			  	pc +=opcode_size[MSN(inst)][LSN(inst)]; // increment pc by size of operands for opcode
-     		}
-     	}
-     	else if(fcount>0x00 && fcount<0x04)
-     	{
-     		/* execute false part */
-     		#ifdef IF_TEST
-     		printf("executing false part, fcount: %x \n", fcount);
-     		#endif
-     		fcount--; //decrement false count
-     		/* restore Flags */
-     		write_rm(FLAGS, tempflags);
-     	}
-     }
-     
-     #ifdef IE_TEST
-     printf("System clock : %x \n", sys_clock);
-     #endif
-     disp_reg_mem();
-     #ifdef VEIW_CACHE
-     veiw_cache();
-     #endif
-     test_prog();
-     sys_clock++;
-     sanity++;
-}
+	running = TRUE;
+	sanity = 0;
+	image = snapshot_take(NULL);
+	machine_free(m);
+
+	g = gang_new();
+	for (first=0; first<nlanes; first+=LANES)
+	{
+		n = nlanes - first < LANES ? nlanes - first : LANES;
+		gang_load(g, n, image, sweep, first);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		gang_run(g);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		secs += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		for (l=0; l<n; l++)
+		{
+			lane_out(g, l);
+			snprintf(tag, sizeof(tag), "lane=%d", first + l);
+			if (run_result(stdout, tag) != EXIT_STOP)
+				left++;
+		}
+		vsteps += g->vsteps;
+		vinsts += g->vinsts;
+		sinsts += g->sinsts;
+	}
+	gang_free(g);
+	snapshot_free(image);
+	printf("lanes: lanes=%d vector_steps=%lu vector_insts=%lu scalar_insts=%lu lanes/vector_step=%.1f\n",
+	       nlanes, vsteps, vinsts, sinsts, vsteps ? (double) vinsts / vsteps : 0.0);
+	printf("throughput: seconds=%.3f insts=%lu insts/s=%.0f\n", 
+	       secs, vinsts + sinsts, secs > 0 ? (vinsts + sinsts) / secs : 0.0);
+	return left;
 }
+#endif
 
 //////*******************Z8_MACHINE CODE *************************************/
 
@@ -2507,9 +6517,172 @@ printf("Interrupt on IMR: %02x\n",
 
 int main(int argc, char *argv[])
 {
+int i;
+int limit_set = FALSE; /* -n given - -b keeps it */
+int corpus_run = FALSE; /* -r given */
+int nlanes = 0;         /* -L lanes */
+int sweep = -1;         /* -s register */
+/* Emulator options precede the s-record file name:
+   -d switch    nested switch instruction decode (default)
+   -d table     256 entry opcode table dispatch
+   -d threaded  threaded code (computed goto) - GCC/Clang builds only
+   -d block     predecoded basic blocks
+   -d jit       predecoded blocks, hot blocks translated to x86-64.
+                With LAZY_FLAGS the ALU ops and JR/JP cc call their
+                handlers - only the LD forms and DJNZ are inline
+   -b           batch - no keyboard waits or per cycle displays, one 
+                result line at the end, no instruction limit unless -n
+   -n insts     stop after insts instruction cycles (0 - no limit)
+   -c cycles    stop when sys_clock reaches cycles (0 - no limit)
+   -r           the file is a corpus - a directory of s-record files or a 
+                manifest listing them. Every program is run in batch mode,
+                exit status 1 if any did not load or reach STOP
+   -j threads   corpus worker threads (default one per processor)
+   -L lanes     run lanes copies of the program in lockstep (batch mode)
+   -s reg       with -L - register reg of lane k starts as k
+   -P image     program memory from file image (mapped read only - ROM)
+   -D image     data memory from file image (mapped - stores go to it)
+   -C           -P and -D images copy-on-write, the files are not changed
+   -M           stack distance profile of the program memory accesses - 
+                hits and misses of many LRU caches from one run (batch)
+   -R           cache report - counters, misses by cause and by 
+                instruction at the end of each run (batch)
+   -K cache     a cache "[i:|d:|2:]size,line,ways[,wt|wb][,wa|nwa][,lat=n][,policy]
+                [,buf=n][,drain=n][,wc|nwc]" - L1 instruction (default),
+                L1 data or L2, bytes (0 - none), bytes per line, lines 
+                per set (0 - fully associative), write through/back, 
+                write (no) allocate, cycles per access, replacement lru
+                (default), plru, fifo, random or lfu, write buffer 
+                entries, cycles to write one on (0 - the next level's 
+                cost), stores to a waiting line (not) combined. 
+                -K mem:n - cycles per primary memory transfer. Repeat 
+                for each level. -K pf:next[,n] or pf:stride[,n] - 
+                prefetch n (default 1) lines into the first program 
+                memory level on a miss
+   -S           sparse memory - pages are allocated when first written
+*/
+/* shared by the machines of every thread - set before any is made */
+memset(ff_page, 0xFF, sizeof(ff_page));
+
+for (i=1; i<argc-1 && argv[i][0]=='-'; i++)
+{
+	if (argv[i][1]=='d' && i+1<argc-1)
+	{
+		i++;
+		if (strcmp(argv[i], "table")==0)
+			dispatch = DISPATCH_TABLE;
+		else if (strcmp(argv[i], "switch")==0)
+			dispatch = DISPATCH_SWITCH;
+		else if (strcmp(argv[i], "block")==0)
+			dispatch = DISPATCH_BLOCK;
+#ifdef JIT_DISPATCH
+		else if (strcmp(argv[i], "jit")==0)
+			dispatch = DISPATCH_JIT;
+#endif
+#ifdef THREADED_DISPATCH
+		else if (strcmp(argv[i], "threaded")==0)
+			dispatch = DISPATCH_THREADED;
+#endif
+		else{
+			printf("Unknown dispatch engine: %s\n", argv[i]);
+			exit(0);
+		}
+	}
+	else if (argv[i][1]=='b')
+	{
+		batch = TRUE;
+		if (!limit_set)
+			inst_limit = 0;
+	}
+	else if (argv[i][1]=='n' && i+1<argc-1)
+	{
+		inst_limit = strtoul(argv[++i], NULL, 0);
+		limit_set = TRUE;
+	}
+	else if (argv[i][1]=='c' && i+1<argc-1)
+		cycle_limit = strtoul(argv[++i], NULL, 0);
+#ifdef CORPUS_RUNNER
+	else if (argv[i][1]=='r')
+	{
+		corpus_run = batch = TRUE;
+		if (!limit_set)
+			inst_limit = 0;
+	}
+	else if (argv[i][1]=='j' && i+1<argc-1)
+		nworkers = atoi(argv[++i]);
+#endif
+#ifdef IMAGE_FILES
+	else if (argv[i][1]=='P' && i+1<argc-1)
+		mem_image[PROG] = argv[++i];
+	else if (argv[i][1]=='D' && i+1<argc-1)
+		mem_image[DATA] = argv[++i];
+	else if (argv[i][1]=='C')
+		image_private = TRUE;
+#endif
+#ifdef LANE_DISPATCH
+	else if (argv[i][1]=='L' && i+1<argc-1)
+	{
+		nlanes = atoi(argv[++i]);
+		batch = TRUE;
+		if (!limit_set)
+			inst_limit = 0;
+	}
+	else if (argv[i][1]=='s' && i+1<argc-1)
+		sweep = strtoul(argv[++i], NULL, 0) & 0xFF;
+#endif
+	else if (argv[i][1]=='S')
+		sparse_memory = TRUE;
+	else if (argv[i][1]=='M')
+		cache_profiling = TRUE;
+	else if (argv[i][1]=='R')
+		cache_reporting = TRUE;
+	else if (argv[i][1]=='K' && i+1<argc-1)
+	{
+		if (!cache_configure(argv[++i]))
+		{
+			printf("Invalid cache: %s\n", argv[i]);
+			exit(0);
+		}
+	}
+	else{
+		printf("Unknown option: %s\n", argv[i]);
+		exit(0);
+	}
+}
+cache_engine_select();
+if (cache_timed && (dispatch == DISPATCH_BLOCK || dispatch == DISPATCH_JIT))
+{
+	printf("Cache latencies need every fetch - table engine used\n");
+	dispatch = DISPATCH_TABLE;
+}
+#ifdef LANE_DISPATCH
+if (cache_timed && nlanes > 0)
+	printf("Cache latencies need every fetch - lanes step one at a time\n");
+#endif
+#ifdef CORPUS_RUNNER
+if (corpus_run && i<argc)
+{
+	opc_size_init();
+	op_table_init();
+	return corpus_main(argv[i]) ? 1 : 0;
+}
+#endif
+#ifdef LANE_DISPATCH
+if (nlanes > 0 && i<argc)
+{
+	opc_size_init();
+	op_table_init();
+	return lanes_main(argv[i], nlanes, sweep) ? 1 : 0;
+}
+#endif
+/* pass the file name on to the loader as argv[1] */
+argv[i-1] = argv[0];
+argc -= i-1;
+argv += i-1;
+
 /* Initialize emulator */
 
-reg_mem_init();
+machine_new();
 loader (argc, argv);
 /*     
 reg_mem_device_init(PORT3, UART_device, TXDONE);*/
@@ -2517,12 +6690,23 @@ reg_mem_device_init(PORT3, UART_device, TXDONE);*/
 reg_mem_device_init(PORT0, TIMER_device, 0x00);
 #endif
 opc_size_init();
-cache_mem_init();
-getchar();
+op_table_init();
+if (!batch)
+     getchar();
 run_machine();
 #ifdef VEIW_CACHE
 veiw_cache();
 #endif
-getchar();
+#ifdef VEIW_BLOCKS
+veiw_blocks();
+#endif
+if (batch)
+{
+     run_result(stdout, NULL);
+     cache_profile_report(stdout, NULL);
+     cache_report(stdout, NULL);
+}
+else
+     getchar();
 return 0;
 }
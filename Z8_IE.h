@@ -11,6 +11,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 //#define flags_test
 #define WATCH
@@ -26,12 +27,16 @@
 //#define IE_TEST        /* IE test */
 
 //#define VEIW_CACHE
+/* default program memory cache - -K sets others at run time */
 //#define WB
 #define WT
 //#define ASSOCIATIVE
 #define DIRECT_MAPPING
 //#define TEST_CACHE
 //#define CONSISTENCY
+//#define VEIW_BLOCKS
+//#define LAZY_FLAGS     /* FLAGS computed only when read */
+//#define CHECKED_WRITES /* stores read back, mismatches counted per run */
 
 #define OPC_ARRAY_TEST
 #define IF_TEST
@@ -43,8 +48,16 @@
 #define PD_MEMSZ    65536
 #define RM_SIZE        256
 #define LINE_LEN 256
-#define CACHE_SIZE 32
+#define CACHE_SIZE 32           /* default cache bytes */
+#define CACHE_SCAN_WAYS 4       /* more ways - lines found through where[] */
+#define PROFILE_SETS 9          /* stack distances for 1, 2, 4 .. 256 sets */
+#define PROFILE_DEPTH 1024      /* deepest stack distance counted - power of 2 */
 #define OP_SZ	0x10
+#define BLOCK_CACHE_SIZE 1024   /* predecoded blocks - power of 2 */
+#define BLOCK_MAX   16          /* instructions per predecoded block */
+#define JIT_THRESHOLD 32        /* block entries before translation */
+#define JIT_BUF_SIZE (1<<20)    /* bytes of translated code */
+#define LANES       32          /* machines stepped in lockstep - one AVX2 register of bytes */
 
 
 #define SIGN(x)     (0x80 & (x))
@@ -53,7 +66,7 @@
 #define ZERO(x)		((x)==0)
 #define HALF_CARRY(x)	(0x10 & (x))
 #define NEG(x)		(-1* (x))
-#define IMR_7(x)	( (x) ? (reg_mem[IMR].content| 0x80) : reg_mem[IMR].content & 0x7F)
+#define IMR_7(x)	( (x) ? (reg_mem[IMR]| 0x80) : reg_mem[IMR] & 0x7F)
 
 
 
@@ -66,16 +79,23 @@
 #define LSB(x)		((x)&0x01) /* used to extract the least significant bit */
 
 /* Special register operations */
-#define FLAG_C(x)	((x)<<7 | (reg_mem[FLAGS].content & 0x7F))	/* Set/clear C bit */
-#define FLAG_Z(x)   ((x)<<6 | (reg_mem[FLAGS].content & 0xBF))   /* Set/clear Z bit */
-#define FLAG_S(x)	((x)>>2 | (reg_mem[FLAGS].content & 0xDF))	/* Set/clear S bit */
-#define FLAG_V(x)	((x)<<4 | (reg_mem[FLAGS].content & 0xEF))	/* Set/clear V bit */
-#define FLAG_D(x)	((x)<<3 | (reg_mem[FLAGS].content & 0xF7))	/* Set/clear D bit */
-#define FLAG_H(x)	((x)<<2 | (reg_mem[FLAGS].content & 0xFB))	/* Set/clear H bit */
-#define RPBLK       (reg_mem[RP].content << 4)                   	/* For RP | working register */
-#define SPLOC		((reg_mem[P01M].content & 0x04)>>2) 		/* 0 when SP is in data mem, 1 when SP is in reg_mem */
-#define SP16		((reg_mem[SPH].content<<8)|reg_mem[SPL].content)		/* 16 bit stack pointer */
-#define SP			(SPLOC? reg_mem[SPL].content : SP16)			/* pointer to top of stack */
+#ifdef LAZY_FLAGS
+#define FLAGS_NOW	(flags_sync(), reg_mem[FLAGS])	/* FLAGS with pending flags applied */
+#else
+#define FLAGS_NOW	(reg_mem[FLAGS])
+#endif
+#define FLAG_C(x)	((x)<<7 | (FLAGS_NOW & 0x7F))	/* Set/clear C bit */
+#define FLAG_Z(x)   ((x)<<6 | (FLAGS_NOW & 0xBF))   /* Set/clear Z bit */
+#define FLAG_S(x)	((x)>>2 | (FLAGS_NOW & 0xDF))	/* Set/clear S bit */
+#define FLAG_V(x)	((x)<<4 | (FLAGS_NOW & 0xEF))	/* Set/clear V bit */
+#define FLAG_D(x)	((x)<<3 | (FLAGS_NOW & 0xF7))	/* Set/clear D bit */
+#define FLAG_H(x)	((x)<<2 | (FLAGS_NOW & 0xFB))	/* Set/clear H bit */
+#define RPBLK       (z8->work_blk)                           	/* For RP | working register */
+#define WORK_RD(n)  (z8->work_reg ? z8->work_reg[n] : read_rm(RPBLK|(n)))  /* working register n */
+#define WORK_WR(n,v) (z8->work_reg ? (void) (z8->work_reg[n] = (v)) : write_rm(RPBLK|(n), (v)))
+#define SPLOC		((reg_mem[P01M] & 0x04)>>2) 		/* 0 when SP is in data mem, 1 when SP is in reg_mem */
+#define SP16		((reg_mem[SPH]<<8)|reg_mem[SPL])		/* 16 bit stack pointer */
+#define SP			(SPLOC? reg_mem[SPL] : SP16)			/* pointer to top of stack */
 
 /* 8 bit register operations */
 #define BIT_7(x)	((x>>7) & 0x01)
@@ -92,6 +112,46 @@
 enum RDWR           {RD, WR}; 
 enum MEM            {PROG, DATA}; //PROG = 0, DATA =1
 
+/* Instruction dispatch engines - selected at startup */
+enum DISPATCH       {DISPATCH_SWITCH, DISPATCH_TABLE, DISPATCH_THREADED, DISPATCH_BLOCK, DISPATCH_JIT};
+#ifdef __GNUC__
+#define THREADED_DISPATCH  /* labels as values available for DISPATCH_THREADED */
+#endif
+#ifdef __GNUC__
+#define THREAD_LOCAL __thread      /* one current machine per host thread */
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define CORPUS_RUNNER      /* -r: many s-record files on a pool of threads */
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef __GNUC__
+#define LANE_DISPATCH      /* -L: lockstep lanes on GCC vector extensions */
+#endif
+#define IMAGE_FILES        /* -P, -D: memory images mapped from files */
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_DISPATCH       /* x86-64 block translation for DISPATCH_JIT */
+#include <stddef.h>
+#include <sys/mman.h>
+#endif
+
+/* Reasons a run ends */
+enum RUN_EXIT      {EXIT_STOP, EXIT_INST_LIMIT, EXIT_CYCLE_LIMIT, EXIT_LOAD_ERROR};
+
+/* Run result names */
+char *exit_diag[] = {
+"stop",
+"inst_limit",
+"cycle_limit",
+"load_error"};
+
 /* Loader signals */
 enum SREC_ERRORS   {MISSING_S, BAD_TYPE, CHKSUM_ERR};
 
@@ -113,30 +173,232 @@ enum IMR_BITS     {IRQ0 = 0x01, IRQ1 = 0x02, IRQ2 = 0x04, IRQ3 = 0x08, IRQ4 = 0x
 /* Program and data memory */
 //extern BYTE memory[][]; 
 
+/* Memory map - one entry per 256 byte page of PROG and DATA */
+enum PAGE_TYPE     {PG_RAM, PG_ROM, PG_HOLE, PG_DEVICE};
+
+struct mem_page
+{
+	BYTE *rd; // host memory of the page for reads, NULL - dev
+	BYTE *wr; // host memory of the page for writes, NULL - dev
+	BYTE (*dev)(WORD, BYTE, enum RDWR); // handler - NULL: reads 0xFF, writes ignored
+	BYTE *host; // storage the loader and snapshots write, NULL - none (yet)
+	BYTE *own; // page allocated by sparse memory, freed with the machine
+	BYTE type; // enum PAGE_TYPE
+};
+
+extern void mem_map_init();
+extern int mem_map_file(enum MEM, char *, int);
+#ifdef IMAGE_FILES
+extern char *mem_image[];
+extern int image_private;
+#endif
+extern void mem_map_pages(enum MEM, BYTE, BYTE, enum PAGE_TYPE, BYTE (*)(WORD, BYTE, enum RDWR));
+extern BYTE *mem_page_host(enum MEM, int);
+extern BYTE zero_page[];
+extern int sparse_memory;
+
 /* cache memory */
 struct state
 {
 	unsigned dirty:1; // dirty bit
-	unsigned lru:5; //least recently used
+	unsigned valid:1; // line holds addr
+	unsigned pref:1; // loaded by the prefetcher, not used since
 };
 
 struct cache_line
 {
-	WORD addr; // target address in primary memory
-	BYTE content; // content of mem
+	WORD addr; // target address in primary memory of the first byte
+	BYTE mem; // PROG or DATA
+	WORD older; // next less recently used line of the set (circular)
+	WORD newer; // next more recently used line of the set (circular)
 	struct state cls; // state of the cache_line 
 };
 
-/* Register memory */
-enum DEV_EM_IO    {REG_RD, REG_WR};
+/* cache levels - instructions and data in front of a unified L2 */
+enum CACHE_LEVEL   {L1I, L1D, L2, CACHE_LEVELS};
+
+/* which line of a set a miss replaces */
+enum CACHE_POLICY  {CP_LRU, CP_PLRU, CP_FIFO, CP_RANDOM, CP_LFU, CACHE_POLICIES};
+
+/* cache geometry and policy of a level - the same for every machine, set
+   before the first one is made */
+struct cache_config
+{
+	unsigned size; // bytes - 0: no cache at this level
+	unsigned line; // bytes per line - power of 2, at most 256
+	unsigned ways; // lines per set
+	unsigned sets; // size / line / ways
+	BYTE write_back; // TRUE - WB, FALSE - WT
+	BYTE write_alloc; // write misses load the line
+	unsigned latency; // sys_clock cycles per access
+	BYTE line_bits; // log2 line
+	BYTE replace; // CP_... - CP_LRU
+	unsigned buf_depth; // write buffer entries - 0: stores go straight on
+	unsigned drain; // cycles to write a buffer entry on, 0 - what the write costs
+	BYTE combine; // stores to a line waiting in the buffer join its entry
+};
+
+extern struct cache_config cache_cfg[];
+extern unsigned mem_latency;
+extern int cache_configure(char *);
+extern void cache_free();
+extern void cache_flush();
+extern int cache_profiling;
+extern void cache_profile_init();
+extern void cache_profile(WORD);
+extern void cache_profile_report(FILE *, char *);
+extern int cache_reporting;
+extern void cache_report(FILE *, char *);
+extern size_t cache_state_len();
+extern void cache_state(char *, int);
+
+/* stack distance profile of the lines cache() is asked for - one LRU 
+   stack per set for each number of sets */
+struct stack_prof
+{
+	unsigned long refs; // accesses
+	unsigned long cold; // first accesses to a line
+	unsigned long hist[PROFILE_SETS][PROFILE_DEPTH + 1]; // distances, [PROFILE_DEPTH] - deeper
+	unsigned head[(1 << PROFILE_SETS) - 1]; // most recent line of each set of each set count
+	unsigned *older[PROFILE_SETS]; // next line down the stack of its set
+	unsigned *newer[PROFILE_SETS]; // next line up
+	BYTE *seen; // line accessed before
+};
+
+/* cache counters - kept for every run */
+struct cache_stats
+{
+	unsigned long rd_hits;
+	unsigned long rd_misses;
+	unsigned long wr_hits;
+	unsigned long wr_misses;
+	unsigned long write_backs; // dirty lines written to primary memory
+	unsigned long evictions; // lines replaced
+	unsigned long compulsory; // misses by cause (-R) - first access to the line
+	unsigned long capacity; // a fully associative cache of the same size misses too
+	unsigned long conflict; // it would have hit
+	unsigned long buffered; // stores put in the write buffer
+	unsigned long combined; // of them joined to a waiting entry
+	unsigned long buf_stalls; // stores that found the buffer full
+	unsigned long stall_cycles; // sys_clock cycles they waited
+	unsigned long occupancy; // entries waiting, summed over the stores buffered
+	unsigned long occupancy_max;
+};
+
+/* what -R adds to the counters - a fully associative LRU stack of as many
+   lines as the cache, over line addresses, and the misses of each 
+   instruction */
+struct cache_detail
+{
+	unsigned *older; // next line down the stack
+	unsigned *newer; // next line up
+	unsigned head, tail, count; // most and least recently used, lines in the stack
+	BYTE *state; // CD_SEEN, CD_HELD of each line
+	unsigned long *misses_at; // misses by address of the instruction
+};
+enum CD_STATE     {CD_SEEN = 1, CD_HELD = 2};
+
+/* stores on their way from a level to the next - a ring of the lines 
+   written, oldest first, and when each will have been written */
+struct write_buffer
+{
+	unsigned *key; // line of each entry
+	unsigned long *done; // sys_clock it is written by
+	unsigned head, count;
+};
+
+/* one level of a machine's caches */
+struct cache
+{
+	struct cache_config *cfg; // cache_cfg[] of the level
+	struct cache *next; // level behind it, NULL - primary memory
+	struct cache_line *lines; // cfg->size / cfg->line, set by set
+	BYTE *data; // their contents
+	WORD *mru; // most recently used line of each set
+	unsigned *where; // line no. + 1 holding each line (of PROG then DATA), 0 - none
+	unsigned *repl; // CP_PLRU tree bits (ways - 1 per set) or CP_LFU uses of each line
+	unsigned seed; // CP_RANDOM generator
+	struct cache_stats stat;
+	struct cache_detail *det; // -R - NULL otherwise
+	struct write_buffer wbuf; // cfg->buf_depth entries
+	struct prefetch *pf; // prefetcher loading lines into it, NULL - none
+};
+
+extern void cache_move(struct cache *, enum MEM, WORD, BYTE *, unsigned, enum RDWR);
+extern void cache_access(struct cache *, enum MEM, WORD, BYTE *, unsigned, enum RDWR);
+extern void cache_peek(struct cache *, enum MEM, WORD, BYTE *);
+extern void cache_classify(struct cache *, unsigned, int);
+extern void cache_detail_init(struct cache *);
+extern BYTE (*cache_fetch)(WORD);
+extern int cache_timed;
+extern void cache_engine_select();
+
+/* instruction prefetcher - on a miss of the first program memory level
+   loads the lines after it, or on along the stride of the misses */
+enum PREFETCH_KIND {PF_NONE, PF_NEXT, PF_STRIDE, PREFETCH_KINDS};
+
+struct prefetch_config
+{
+	BYTE kind; // PF_...
+	unsigned degree; // lines loaded per miss
+};
+
+struct prefetch
+{
+	unsigned long *ready; // sys_clock each line's prefetch is loaded by
+	unsigned long busy; // the last prefetch issued is loaded by
+	unsigned last; // line of the last miss
+	unsigned stride; // lines from the miss before it to the last
+	unsigned long issued; // lines loaded
+	unsigned long useful; // of them used before they were replaced
+	unsigned long late; // of those, used before they were loaded
+	unsigned long late_cycles; // sys_clock cycles waited for them
+	unsigned long unused; // replaced without being used
+};
+
+extern struct prefetch_config prefetch_cfg;
+extern void cache_prefetch(struct cache *, WORD);
+extern void cache_prefetch_used(struct cache *, unsigned);
 
-struct reg_mem_el
+/* predecoded instruction and block */
+struct dec_inst
 {
-BYTE content;
-int (*option)(BYTE, enum DEV_EM_IO);       
+	void (*handler)(BYTE); // op_table entry of the opcode
+	BYTE opcode;
+	BYTE ops[2]; // operand bytes
+	BYTE size; // opcode + operands
 };
 
-extern struct reg_mem_el reg_mem[];
+struct dec_block
+{
+	WORD start; // address of the first instruction
+	WORD end; // address after the last byte of the block
+	WORD fall_through; // next address if no branch taken
+	WORD branch; // target of the final jump/call (if known)
+	BYTE valid;
+	BYTE count; // no. of instructions
+	unsigned long cycles; // sys_clock cycles of the last complete run
+	unsigned long entries; // times the block has been entered
+	int (*native)(void); // translated block (JIT) or NULL
+	struct dec_block *succ[2]; // chained fall through and branch blocks
+	struct dec_inst inst[BLOCK_MAX];
+};
+
+extern void block_invalidate(WORD);
+extern void block_invalidate_page(BYTE);
+extern void cache_mem_init();
+
+/* Register memory */
+enum DEV_EM_IO    {REG_RD, REG_WR};
+
+/* Register attributes - RA_DEVICE + n for registers of device hook n */
+enum REG_ATTR     {RA_RDWR, RA_RDONLY, RA_USERP, RA_DEVICE};
+#define RM_HOOKS  8                /* device emulators per machine */
+
+extern void flags_sync();
+
+/* pending lazy flags (LAZY_FLAGS) */
+enum LAZY_OP       {LAZY_NONE, LAZY_ADD, LAZY_SUB, LAZY_LOGIC};
 
 /* Devices in register memory */
 #define PORT0   0x00
@@ -164,6 +426,7 @@ extern struct reg_mem_el reg_mem[];
 
 /* Register memory functions */
 extern void reg_mem_init();
+extern void work_sync();
 extern void reg_mem_device_init(BYTE, int (*)(BYTE, enum DEV_EM_IO), BYTE);
 
 /* Device entry points */
@@ -173,6 +436,131 @@ extern int UART_device(BYTE, enum DEV_EM_IO);
 /* UART bits */
 #define TXDONE     0x04
 
+/* Machine state
+   - everything one emulated Z8 owns: memories, registers, cache, timer, 
+     IF sequence, predecoded blocks and translated code
+   - z8 points at the machine run by the current host thread, so several 
+     machines can run side by side in one process (one per thread). The 
+     emulator's original globals (memory, reg_mem, pc, the flags, timer 
+     and IF state, running, sanity) are macros for their z8 fields below,
+     so the instruction code reads as before. Other fields are written 
+     z8->field
+   - reg_mem up to sanity is the state held by a snapshot - keep it 
+     together, the predecoded blocks follow it
+*/
+struct machine
+{
+	BYTE (*memory)[PD_MEMSZ];          /* PROG and DATA - NULL with sparse memory */
+	struct mem_page mem_map[2][PD_MEMSZ>>8]; /* how bus() reaches each page */
+	BYTE *mem_file[2];                 /* image files mapped in (IMAGE_FILES) */
+	size_t mem_file_len[2];
+	BYTE reg_mem[RM_SIZE];             /* register contents */
+	BYTE reg_attr[RM_SIZE];            /* enum REG_ATTR of each register */
+	int (*reg_hook[RM_HOOKS])(BYTE, enum DEV_EM_IO); /* device emulators */
+	int reg_nhooks;
+
+	/* Hidden registers */
+	WORD pc;                           /* Program counter */
+	WORD sp;                           /* stack pointer */
+	BYTE intr_ena;                     /* Interrupt status */
+	unsigned long sys_clock;           /* system clock */
+
+	/* Flag bits */
+	BYTE carry;
+	BYTE sign;
+	BYTE overflow;
+	BYTE zero;
+	BYTE half_carry;
+	BYTE decimal_adjust;
+
+	/* Lazy flags */
+	enum LAZY_OP lazy_op;              /* operation whose flags are pending */
+	BYTE lazy_a1;                      /* destination value before the operation */
+	BYTE lazy_ans;                     /* result */
+	CARRY_BYTE lazy_temp;              /* result with carry/borrow out */
+
+	/* Timer */
+	WORD tdc;                          /* Timer delay count */
+	BYTE treload;                      /* Timer reload? T|F */
+	BYTE trunning;                     /* Timer running? T|F */
+
+	BYTE *fetch_ops;                   /* operands of a predecoded instruction, NULL otherwise */
+	WORD inst_pc;                      /* address of the instruction in hand */
+	unsigned long pm_writes;           /* stores into program memory (LDC, LDCI) */
+	unsigned long store_checks;        /* stores read back (CHECKED_WRITES) */
+	unsigned long store_errors;        /* read back differed from the store */
+
+	/* IF extension and run state */
+	BYTE tcount;                       /* number of true instructions */
+	BYTE fcount;                       /* number of false instructions */
+	BYTE cexec;                        /* 1 execute true part 0 exec false part */
+	BYTE tempflags;                    /* flags held while a conditional sequence runs */
+	int running;                       /* TRUE until STOP instruction */
+	unsigned long sanity;              /* Instruction cycles executed */
+
+	/* Predecoded blocks and translated code */
+	struct dec_block *block_cache;     /* BLOCK_CACHE_SIZE blocks - run_blocks() allocates them */
+	WORD block_page[256];              /* no. of valid blocks overlapping each page */
+	BYTE *jit_buf;                     /* executable buffer */
+	unsigned jit_used;                 /* bytes of jit_buf in use */
+	int jit_full;                      /* translation ran out of room */
+	int jit_off;                       /* no executable buffer - blocks are interpreted */
+	unsigned jit_slow[6];              /* jumps from inline code to the handler call */
+	int jit_nslow;
+
+	/* Cache - saved by snapshots after the state above */
+	struct cache caches[CACHE_LEVELS];
+	struct cache *cache_top[2];        /* first level PROG and DATA go through, NULL - none */
+	struct stack_prof *cache_prof;     /* -M - NULL otherwise */
+
+	/* Snapshot tracking */
+	BYTE page_dirty[2][PD_MEMSZ>>8];   /* 256 byte pages written since snap_base */
+	struct snapshot *snap_base;        /* snapshot last taken or restored */
+	unsigned long snap_gen;            /* its generation at that time */
+
+	/* Working registers - set by work_sync() whenever RP changes */
+	BYTE work_blk;                     /* RP << 4 */
+	BYTE *work_reg;                    /* &reg_mem[work_blk], NULL unless all 16 are RA_RDWR */
+};
+
+/* Saved machine - memories, the state from reg_mem to sanity and the cache */
+struct snapshot
+{
+	unsigned long gen;                 /* bumped each time it is taken */
+	BYTE mem[2][PD_MEMSZ];             /* PROG and DATA */
+	size_t len;                        /* bytes of state - the cache follows */
+	char state[];
+};
+
+extern THREAD_LOCAL struct machine *z8;
+extern struct machine *machine_new();
+extern void machine_free(struct machine *);
+extern struct snapshot *snapshot_take(struct snapshot *);
+extern void snapshot_restore(struct snapshot *);
+extern void snapshot_free(struct snapshot *);
+
+#define memory          (z8->memory)
+#define reg_mem         (z8->reg_mem)
+#define pc              (z8->pc)
+#define sp              (z8->sp)
+#define intr_ena        (z8->intr_ena)
+#define sys_clock       (z8->sys_clock)
+#define carry           (z8->carry)
+#define sign            (z8->sign)
+#define overflow        (z8->overflow)
+#define zero            (z8->zero)
+#define half_carry      (z8->half_carry)
+#define decimal_adjust  (z8->decimal_adjust)
+#define tdc             (z8->tdc)
+#define treload         (z8->treload)
+#define trunning        (z8->trunning)
+#define tcount          (z8->tcount)
+#define fcount          (z8->fcount)
+#define cexec           (z8->cexec)
+#define tempflags       (z8->tempflags)
+#define running         (z8->running)
+#define sanity          (z8->sanity)
+
 #endif
 
 /******************************HEADER FILE***********************************/